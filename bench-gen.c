@@ -0,0 +1,222 @@
+// Usage: bench-gen [OPTION]...
+//
+// Load generator for benchmarking out+err, see bench.sh.  Writes chunks
+// to stdout and stderr, timing every write, and appends a report line
+// to the file given with -r, or writes it to stderr:
+//
+//   chunks=N bytes=N seconds=S p50_ns=N p99_ns=N
+//
+// Options:
+//   -n N     chunks in total (default 100000)
+//   -s SIZE  chunk size, or MIN-MAX for uniformly random sizes
+//   -e PCT   percentage of chunks written to stderr (default 0)
+//   -t N     writer threads (default 1)
+//   -m MODE  raw (write(), default) or stdio (fwrite() + fflush())
+//   -g USEC  sleep between chunks, an interactive job (default 0)
+//   -r FILE  append the report to FILE
+#define _GNU_SOURCE 1
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+struct writer {
+    pthread_t thread;
+    unsigned seed;
+    size_t chunks;
+    uint32_t *latency; // ns, a sample per chunk
+    uint64_t bytes;
+};
+
+static size_t size_min = 64, size_max = 64;
+static unsigned stderr_pct;
+static int stdio;
+static unsigned gap_us;
+static char *data;
+
+static void usage(void) {
+    fprintf(
+        stderr,
+        "Usage: %s [-n N] [-s SIZE|MIN-MAX] [-e PCT] [-t N] "
+        "[-m raw|stdio] [-g USEC] [-r FILE]\n",
+        program_invocation_name
+    );
+    exit(EXIT_FAILURE);
+}
+
+static void fail(const char *msg) __attribute__((noreturn));
+static void fail(const char *msg) {
+    fprintf(
+        stderr, "%s: %s: %s\n",
+        program_invocation_name, msg, strerror(errno)
+    );
+    exit(EXIT_FAILURE);
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+static void write_chunk(int stream, const char *p, size_t len) {
+    ssize_t rc;
+    if (stdio) {
+        FILE *f = stream ? stderr : stdout;
+        if (fwrite(p, 1, len, f) != len || fflush(f) != 0) fail("fwrite");
+        return;
+    }
+    while (len) {
+        rc = write(stream ? STDERR_FILENO : STDOUT_FILENO, p, len);
+        if (rc < 0) {
+            if (errno == EINTR) continue;
+            fail("write");
+        }
+        p += rc;
+        len -= rc;
+    }
+}
+
+static void *writer_main(void *arg) {
+    struct writer *w = arg;
+    const struct timespec gap = {
+        gap_us / 1000000, gap_us % 1000000 * 1000
+    };
+    uint64_t start;
+    size_t i, len;
+    int stream;
+    for (i = 0; i < w->chunks; ++i) {
+        if (gap_us) nanosleep(&gap, NULL);
+        len = size_min == size_max ? size_min :
+            size_min + rand_r(&w->seed) % (size_max - size_min + 1);
+        stream = (unsigned)rand_r(&w->seed) % 100 < stderr_pct;
+        start = now_ns();
+        write_chunk(stream, data, len);
+        w->latency[i] = now_ns() - start;
+        w->bytes += len;
+    }
+    return NULL;
+}
+
+static int cmp_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static size_t parse_num(const char *str, char **end) {
+    unsigned long long v;
+    errno = 0;
+    v = strtoull(str, end, 10);
+    switch (**end) {
+    case 'M': v <<= 10; // fallthrough
+    case 'K': v <<= 10; ++*end;
+    }
+    if (errno || *end == str) usage();
+    return v;
+}
+
+int main(int argc, char **argv) {
+    size_t chunks = 100000, i, j;
+    unsigned threads = 1, t;
+    const char *report = NULL;
+    struct writer *writers;
+    uint32_t *latency;
+    uint64_t start, elapsed, bytes = 0;
+    char *end;
+    FILE *f;
+    int opt, err;
+
+    while ((opt = getopt(argc, argv, "n:s:e:t:m:g:r:")) != -1) {
+        switch (opt) {
+        case 'n':
+            chunks = parse_num(optarg, &end);
+            if (*end) usage();
+            break;
+        case 's':
+            size_min = size_max = parse_num(optarg, &end);
+            if (*end == '-') size_max = parse_num(end + 1, &end);
+            if (*end || !size_min || size_max < size_min) usage();
+            break;
+        case 'e':
+            stderr_pct = parse_num(optarg, &end);
+            if (*end || stderr_pct > 100) usage();
+            break;
+        case 't':
+            threads = parse_num(optarg, &end);
+            if (*end || !threads) usage();
+            break;
+        case 'm':
+            if (!strcmp(optarg, "raw")) {
+                stdio = 0;
+            } else if (!strcmp(optarg, "stdio")) {
+                stdio = 1;
+            } else {
+                usage();
+            }
+            break;
+        case 'g':
+            gap_us = parse_num(optarg, &end);
+            if (*end) usage();
+            break;
+        case 'r':
+            report = optarg;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind != argc) usage();
+
+    if (!(data = malloc(size_max))) fail("malloc");
+    // 63 character lines.
+    for (i = 0; i < size_max; ++i) {
+        data[i] = i % 64 == 63 ? '\n' : 'a' + i % 26;
+    }
+    if (
+        !(writers = calloc(threads, sizeof *writers)) ||
+        !(latency = malloc(chunks * sizeof *latency))
+    ) {
+        fail("malloc");
+    }
+    for (t = 0, j = 0; t < threads; ++t) {
+        writers[t].seed = t + 1;
+        writers[t].chunks = chunks / threads + (t < chunks % threads);
+        writers[t].latency = latency + j;
+        j += writers[t].chunks;
+    }
+
+    start = now_ns();
+    for (t = 0; t < threads; ++t) {
+        if ((err = pthread_create(
+                &writers[t].thread, NULL, writer_main, &writers[t]
+            ))
+        ) {
+            errno = err;
+            fail("pthread_create");
+        }
+    }
+    for (t = 0; t < threads; ++t) {
+        pthread_join(writers[t].thread, NULL);
+        bytes += writers[t].bytes;
+    }
+    elapsed = now_ns() - start;
+
+    qsort(latency, chunks, sizeof *latency, cmp_u32);
+    if (!report) {
+        f = stderr;
+    } else if (!(f = fopen(report, "ae"))) {
+        fail(report);
+    }
+    fprintf(
+        f, "chunks=%zu bytes=%llu seconds=%.3f p50_ns=%u p99_ns=%u\n",
+        chunks, (unsigned long long)bytes, elapsed / 1e9,
+        chunks ? latency[chunks / 2] : 0,
+        chunks ? latency[chunks * 99 / 100] : 0
+    );
+    if (fclose(f) != 0) fail("report");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,136 @@
+#!/bin/sh
+# Usage: bench.sh [SCENARIO]...
+#
+# Benchmark out+err with load from bench-gen, run by `make bench`.
+# Every scenario (all by default) runs the generator:
+#
+#   pipe      - writing to a pipe, for reference
+#   nohelper  - under out+err without the helper library
+#   helper    - under out+err with the helper library
+#   spin      - as helper, with --spin=SPIN_US (interactive scenarios)
+#
+# and reports throughput, syscalls of the master per chunk, CPU time of
+# the master, the p50/p99 latency of write() calls in the child, and
+# for interactive scenarios (the generator sleeping between chunks) the
+# p99 time from write() until the chunk is written to the capture, from
+# --latency.
+# Scenarios are repeated with a musl build of the generator if MUSL_CC
+# (musl-gcc by default) is found.
+#
+# BENCH_SCALE multiplies chunk counts (default 1).  SPIN_US is the
+# polling window of the spin scenarios (default 500).  BENCH_HOOK is
+# passed to out+err as --hook, e.g. plt.
+
+set -u
+
+cd "$(dirname "$0")"
+
+scale=${BENCH_SCALE:-1}
+spin_us=${SPIN_US:-500}
+hook=${BENCH_HOOK:+--hook=$BENCH_HOOK}
+musl_cc=${MUSL_CC:-musl-gcc}
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+# name:generator options, chunk counts before scaling
+scenarios='
+tiny:-n 200000 -s 16
+large:-n 2000 -s 64K
+mixed:-n 100000 -s 16-400
+stderr-10:-n 100000 -s 16-400 -e 10
+stderr-50:-n 100000 -s 16-400 -e 50
+threads-4:-n 100000 -s 16-400 -t 4
+stdio:-n 100000 -s 16-400 -m stdio
+over-sndbuf:-n 100 -s 1M
+interactive:-n 5000 -s 16-400 -g 100
+interactive-idle:-n 1000 -s 16-400 -g 2000
+'
+
+gens=./bench-gen
+if command -v "$musl_cc" >/dev/null 2>&1 &&
+    "$musl_cc" -O2 -pthread -o "$tmp/bench-gen-musl" bench-gen.c
+then
+    gens="$gens $tmp/bench-gen-musl"
+fi
+
+now_ns() {
+    date +%s%N
+}
+
+# Value of NAME in a "name=value ..." report.
+field() {
+    tr ' ' '\n' <"$2" | sed -n "s/^$1=//p"
+}
+
+run() {
+    name=$1 gen=$2 mode=$3 opts=$4
+    rm -f "$tmp/report" "$tmp/stats" "$tmp/latency"
+    latency=
+    case $name in
+    interactive*) latency=--latency="$tmp/latency" ;;
+    esac
+    start=$(now_ns)
+    case $mode in
+    pipe)
+        "$gen" $opts -r "$tmp/report" 2>&1 | cat >/dev/null ;;
+    nohelper)
+        ./bench-out+err-nohelper --stats="$tmp/stats" $latency \
+            -o /dev/null "$gen" $opts -r "$tmp/report" ;;
+    helper)
+        ./bench-out+err --stats="$tmp/stats" $latency $hook \
+            -o /dev/null "$gen" $opts -r "$tmp/report" ;;
+    spin)
+        ./bench-out+err --stats="$tmp/stats" $latency $hook \
+            --spin="$spin_us" -o /dev/null "$gen" $opts -r "$tmp/report" ;;
+    esac
+    end=$(now_ns)
+    if [ ! -s "$tmp/report" ]; then
+        printf '%-24s %-9s %s\n' "$name" "$mode" "failed"
+        return
+    fi
+    chunks=$(field chunks "$tmp/report")
+    bytes=$(field bytes "$tmp/report")
+    p50=$(field p50_ns "$tmp/report")
+    p99=$(field p99_ns "$tmp/report")
+    syscalls=- cpu=- cap_p99=-
+    if [ -s "$tmp/stats" ]; then
+        syscalls=$(awk -v n="$chunks" '
+            /^(recv_calls|writev_calls) / { s += $2 }
+            END { printf "%.2f", n ? s / n : 0 }' "$tmp/stats")
+        cpu=$(awk '
+            /^cpu_(user|sys)_ns / { s += $2 }
+            END { printf "%.0f", s / 1e6 }' "$tmp/stats")
+    fi
+    if [ -s "$tmp/latency" ]; then
+        # Both streams, the worse one.
+        cap_p99=$(awk '
+            /^std(out|err)_written_p99_ns / && $2 > m { m = $2 }
+            END { print m + 0 }' "$tmp/latency")
+    fi
+    awk -v name="$name" -v mode="$mode" -v bytes="$bytes" \
+        -v ns=$((end - start)) -v sc="$syscalls" -v cpu="$cpu" \
+        -v p50="$p50" -v p99="$p99" -v cap="$cap_p99" 'BEGIN {
+        printf "%-24s %-9s %9.1f %9s %9s %9d %9d %11s\n",
+            name, mode, bytes / ns * 1e3, sc, cpu, p50, p99, cap
+    }'
+}
+
+printf '%-24s %-9s %9s %9s %9s %9s %9s %11s\n' \
+    scenario mode MB/s sys/chunk cpu_ms p50_ns p99_ns cap_p99_ns
+echo "$scenarios" | while IFS=: read -r name opts; do
+    [ -n "$name" ] || continue
+    if [ $# -gt 0 ]; then
+        case " $* " in *" $name "*) ;; *) continue ;; esac
+    fi
+    n=$(echo "$opts" | sed 's/.*-n \([0-9]*\).*/\1/')
+    opts=$(echo "$opts" | sed "s/-n [0-9]*/-n $((n * scale))/")
+    for gen in $gens; do
+        label=$name
+        case $gen in *musl) label=$name-musl ;; esac
+        modes='pipe nohelper helper'
+        case $name in interactive*) modes="$modes spin" ;; esac
+        for mode in $modes; do
+            run "$label" "$gen" $mode "$opts"
+        done
+    done
+done
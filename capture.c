@@ -0,0 +1,340 @@
+#define _GNU_SOURCE 1
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "capture.h"
+
+#define CAPTURE_BUF_SIZE (1 << 20)
+
+size_t capture_file_header(char *buf, int flags) {
+    memcpy(buf, CAPTURE_MAGIC, CAPTURE_FILE_HEADER_LEN - 1);
+    buf[CAPTURE_FILE_HEADER_LEN - 1] = flags;
+    return CAPTURE_FILE_HEADER_LEN;
+}
+
+static int capture_fill(struct capture *c, size_t len);
+
+// Detect the format by the file header.
+static int capture_detect(struct capture *c) {
+    if (capture_fill(c, CAPTURE_FILE_HEADER_LEN) != 0) return -1;
+    if (
+        c->end - c->pos >= CAPTURE_FILE_HEADER_LEN &&
+        !memcmp(c->pos, CAPTURE_MAGIC, CAPTURE_FILE_HEADER_LEN - 1)
+    ) {
+        c->format = CAPTURE_COMPACT;
+        c->flags = (unsigned char)c->pos[CAPTURE_FILE_HEADER_LEN - 1];
+        c->pos += CAPTURE_FILE_HEADER_LEN;
+    }
+    if (
+        c->flags & CAPTURE_DEDUP && (
+            !(c->seen = malloc(CAPTURE_REPEAT_WINDOW * sizeof *c->seen)) ||
+            !(c->seen_data = malloc(
+                CAPTURE_REPEAT_WINDOW * CAPTURE_REPEAT_CHUNK_MAX
+            ))
+        )
+    ) {
+        return -1;
+    }
+    return 0;
+}
+
+int capture_open(struct capture *c, int fd) {
+    struct stat st;
+    memset(c, 0, sizeof *c);
+    c->fd = fd;
+    if (fstat(fd, &st) != 0) return -1;
+    if (S_ISREG(st.st_mode) && st.st_size) {
+        c->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (c->map != MAP_FAILED) {
+            madvise(c->map, st.st_size, MADV_SEQUENTIAL);
+            c->map_size = st.st_size;
+            c->pos = c->map;
+            c->end = c->map + st.st_size;
+            c->eof = 1;
+            return capture_detect(c);
+        }
+        c->map = NULL;
+    }
+    c->buf_size = CAPTURE_BUF_SIZE;
+    if (!(c->buf = malloc(c->buf_size))) return -1;
+    c->pos = c->end = c->buf;
+    return capture_detect(c);
+}
+
+// Make sure @len bytes are buffered, unless at EOF.
+static int capture_fill(struct capture *c, size_t len) {
+    size_t have = c->end - c->pos;
+    ssize_t rc;
+    if (have >= len || c->eof) return 0;
+    if (len > c->buf_size) {
+        char *buf = malloc(len);
+        if (!buf) return -1;
+        memcpy(buf, c->pos, have);
+        free(c->buf);
+        c->buf = buf;
+        c->buf_size = len;
+    } else {
+        memmove(c->buf, c->pos, have);
+    }
+    c->pos = c->buf;
+    c->end = c->buf + have;
+    while ((size_t)(c->end - c->pos) < len) {
+        rc = read(c->fd, c->buf + have, c->buf_size - have);
+        if (rc < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (!rc) {
+            c->eof = 1;
+            break;
+        }
+        have += rc;
+        c->end += rc;
+    }
+    return 0;
+}
+
+// Decode a header, returns its length or 0 if incomplete.
+static size_t capture_decode(
+    const struct capture *c, int *kind, size_t *len
+) {
+    const unsigned char *p = (const unsigned char *)c->pos;
+    const size_t avail = c->end - c->pos;
+    uint64_t key = 0;
+    size_t n;
+    if (c->format == CAPTURE_CLASSIC) {
+        uint32_t header;
+        if (avail < 4) return 0;
+        memcpy(&header, p, 4);
+        header = ntohl(header);
+        *kind = header >> 31;
+        *len = header & UINT32_C(0x7fffffff);
+        return 4;
+    }
+    for (n = 0; n < avail && n < 10; ++n) {
+        key |= (uint64_t)(p[n] & 0x7f) << 7 * n;
+        if (!(p[n] & 0x80)) {
+            *kind = key & 3;
+            *len = key >> 2;
+            return n + 1;
+        }
+    }
+    return 0;
+}
+
+static size_t get_varint(const char *data, size_t len, uint64_t *v);
+
+static char *seen_data(const struct capture *c, uint64_t i) {
+    return c->seen_data +
+        i % CAPTURE_REPEAT_WINDOW * CAPTURE_REPEAT_CHUNK_MAX;
+}
+
+// Remember a chunk, to be repeated.
+static void seen_add(
+    struct capture *c, int stream, const char *data, size_t len
+) {
+    struct capture_seen *s = &c->seen[c->seen_count % CAPTURE_REPEAT_WINDOW];
+    char *p = seen_data(c, c->seen_count++);
+    s->stream = stream;
+    s->len = len;
+    if (len <= CAPTURE_REPEAT_CHUNK_MAX && p != data) memcpy(p, data, len);
+}
+
+// Start expanding a control record if it's a CAPTURE_REPEAT one, unless
+// it's not valid.  Returns whether it is one.
+static int repeat_start(struct capture *c, const char *data, size_t len) {
+    uint64_t v[3];
+    size_t n = 0, k;
+    int i;
+    for (i = 0; i < 3; ++i) {
+        if (!(k = get_varint(data + n, len - n, &v[i]))) break;
+        n += k;
+    }
+    if (!i || v[0] != CAPTURE_REPEAT) return 0;
+    if (
+        i == 3 && v[1] && v[1] <= CAPTURE_REPEAT_WINDOW &&
+        v[1] <= c->seen_count &&
+        c->seen[(c->seen_count - v[1]) % CAPTURE_REPEAT_WINDOW].len <=
+            CAPTURE_REPEAT_CHUNK_MAX
+    ) {
+        c->repeat_distance = v[1];
+        c->repeat_left = v[2];
+    }
+    return 1;
+}
+
+// The next repeated chunk.
+static void repeat_next(struct capture *c, struct capture_chunk *chunk) {
+    const uint64_t from = c->seen_count - c->repeat_distance;
+    const struct capture_seen *s = &c->seen[from % CAPTURE_REPEAT_WINDOW];
+    char *p = seen_data(c, c->seen_count);
+    // The same buffer at the distance of the window.
+    if (p != seen_data(c, from)) memcpy(p, seen_data(c, from), s->len);
+    chunk->stream = s->stream;
+    chunk->data = p;
+    chunk->len = s->len;
+    seen_add(c, s->stream, p, s->len);
+    --c->repeat_left;
+}
+
+// Get the next record of a kind up to @kind_max.
+static int capture_next_kind(
+    struct capture *c, struct capture_chunk *chunk, int kind_max
+) {
+    size_t hlen, len;
+    int kind;
+    while (1) {
+        if (c->repeat_left) {
+            repeat_next(c, chunk);
+            return 1;
+        }
+        if (capture_fill(c, CAPTURE_HEADER_MAX) != 0) return -1;
+        if (c->pos == c->end) return 0;
+        if (!(hlen = capture_decode(c, &kind, &len))) goto torn;
+        if (capture_fill(c, hlen + len) != 0) return -1;
+        if ((size_t)(c->end - c->pos) < hlen + len) goto torn;
+        c->pos += hlen + len;
+        if (c->flags & CAPTURE_DEDUP) {
+            if (
+                kind == CAPTURE_CONTROL && repeat_start(c, c->pos - len, len)
+            ) {
+                continue;
+            }
+            if (kind <= CAPTURE_STDERR) seen_add(c, kind, c->pos - len, len);
+        }
+        if (kind <= kind_max) break;
+    }
+    chunk->stream = kind;
+    chunk->data = c->pos - len;
+    chunk->len = len;
+    return 1;
+torn:
+    c->pos = c->end;
+    errno = EILSEQ;
+    return -1;
+}
+
+int capture_next(struct capture *c, struct capture_chunk *chunk) {
+    return capture_next_kind(c, chunk, CAPTURE_STDERR);
+}
+
+int capture_next_record(struct capture *c, struct capture_chunk *chunk) {
+    return capture_next_kind(c, chunk, CAPTURE_CONTROL);
+}
+
+void capture_close(struct capture *c) {
+    if (c->map) munmap(c->map, c->map_size);
+    free(c->buf);
+    free(c->seen);
+    free(c->seen_data);
+}
+
+static size_t put_varint(char *buf, uint64_t v) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        buf[n++] = v | 0x80;
+        v >>= 7;
+    }
+    buf[n++] = v;
+    return n;
+}
+
+// Returns the length decoded, or 0.
+static size_t get_varint(const char *data, size_t len, uint64_t *v) {
+    const unsigned char *p = (const unsigned char *)data;
+    size_t n;
+    *v = 0;
+    for (n = 0; n < len && n < 10; ++n) {
+        *v |= (uint64_t)(p[n] & 0x7f) << 7 * n;
+        if (!(p[n] & 0x80)) return n + 1;
+    }
+    return 0;
+}
+
+size_t capture_dropped_encode(char *buf, const struct capture_dropped *d) {
+    size_t n = put_varint(buf, CAPTURE_DROPPED);
+    n += put_varint(buf + n, d->stream);
+    n += put_varint(buf + n, d->chunks);
+    return n + put_varint(buf + n, d->bytes);
+}
+
+int capture_dropped_decode(
+    const char *data, size_t len, struct capture_dropped *d
+) {
+    uint64_t v[4];
+    size_t n = 0, k;
+    int i;
+    for (i = 0; i < 4; ++i) {
+        if (!(k = get_varint(data + n, len - n, &v[i]))) return -1;
+        n += k;
+    }
+    if (v[0] != CAPTURE_DROPPED || v[1] > CAPTURE_STDERR) return -1;
+    d->stream = v[1];
+    d->chunks = v[2];
+    d->bytes = v[3];
+    return 0;
+}
+
+size_t capture_repeat_encode(char *buf, unsigned distance, uint64_t count) {
+    size_t n = put_varint(buf, CAPTURE_REPEAT);
+    n += put_varint(buf + n, distance);
+    return n + put_varint(buf + n, count);
+}
+
+size_t capture_block_encode(char *buf, uint64_t len, uint32_t crc) {
+    size_t n = capture_header(
+        buf, CAPTURE_COMPACT, CAPTURE_CONTROL, CAPTURE_BLOCK_DATA_LEN
+    );
+    int i;
+    buf[n++] = CAPTURE_BLOCK;
+    memcpy(buf + n, CAPTURE_BLOCK_MAGIC, 4);
+    n += 4;
+    for (i = 0; i < 8; ++i) buf[n++] = len >> 8 * i;
+    for (i = 0; i < 4; ++i) buf[n++] = crc >> 8 * i;
+    return n;
+}
+
+int capture_block_decode(const char *buf, uint64_t *len, uint32_t *crc) {
+    const unsigned char *p = (const unsigned char *)buf;
+    int i;
+    if (
+        p[0] != (CAPTURE_BLOCK_DATA_LEN << 2 | CAPTURE_CONTROL) ||
+        p[1] != CAPTURE_BLOCK || memcmp(p + 2, CAPTURE_BLOCK_MAGIC, 4)
+    ) {
+        return -1;
+    }
+    p += 6;
+    for (*len = 0, i = 0; i < 8; ++i) *len |= (uint64_t)p[i] << 8 * i;
+    p += 8;
+    for (*crc = 0, i = 0; i < 4; ++i) *crc |= (uint32_t)p[i] << 8 * i;
+    return 0;
+}
+
+size_t capture_index_encode(char *buf, int stream, uint64_t offset) {
+    const uint64_t v = (uint64_t)!!stream << 63 | offset;
+    int i;
+    for (i = 0; i < CAPTURE_INDEX_ENTRY_LEN; ++i) buf[i] = v >> 8 * i;
+    return CAPTURE_INDEX_ENTRY_LEN;
+}
+
+void capture_index_decode(const char *buf, int *stream, uint64_t *offset) {
+    const unsigned char *p = (const unsigned char *)buf;
+    uint64_t v = 0;
+    int i;
+    for (i = 0; i < CAPTURE_INDEX_ENTRY_LEN; ++i) v |= (uint64_t)p[i] << 8 * i;
+    *stream = v >> 63;
+    *offset = v & ~(UINT64_C(1) << 63);
+}
+
+size_t capture_dropped_text(char *buf, const struct capture_dropped *d) {
+    return sprintf(
+        buf, "out+err: dropped %llu chunks, %llu bytes\n",
+        (unsigned long long)d->chunks, (unsigned long long)d->bytes
+    );
+}
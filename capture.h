@@ -0,0 +1,197 @@
+// Capture file formats.
+//
+// Classic: every chunk starts with a 4 byte header.  A header encodes
+// the data size as a 32 bit big endian number.  Only 31 lower bits are
+// used.  The high bit is 0 for STDOUT, 1 for STDERR.
+//
+// Compact: the file starts with "OUT+ERR" and a flags byte, followed
+// by records.  A record starts with a key, a varint (LEB128).  The key
+// is the data size shifted left by 2, ORed with the kind: 0 - STDOUT,
+// 1 - STDERR, 2 - control record, 3 - reserved.  Chunks smaller than
+// 32 bytes get a single byte header.  The data of a control record
+// starts with a varint type; readers skip types unknown to them.
+//
+// Control records:
+//   CAPTURE_DROPPED - varints stream, chunks, bytes: chunks of a stream
+//     dropped by out+err limits since the previous such record.  A
+//     classic capture has a line of text in the stream instead, see
+//     capture_dropped_text().
+//   CAPTURE_REPEAT - varints distance, count: @count chunks follow, each
+//     a copy of the chunk @distance chunks before it (1 - the previous
+//     one; repeated chunks count), e.g. 4, 1000 repeats a cycle of 4
+//     chunks 250 times.  Only in captures flagged CAPTURE_DEDUP.
+//     Readers expand them, keeping the last CAPTURE_REPEAT_WINDOW
+//     chunks; larger ones than CAPTURE_REPEAT_CHUNK_MAX are never
+//     repeated.
+//   CAPTURE_BLOCK - CAPTURE_BLOCK_MAGIC, then the length (8 bytes) and
+//     the CRC32C (4 bytes, crc32c.h), little endian, of the bytes since
+//     the previous CAPTURE_BLOCK record or the file header, up to this
+//     one: a block trailer.  Written by out+err --blocks, so that
+//     out+err-recover finds the end of the last intact block from the
+//     end of the file.
+//
+// A classic capture can't start with 'O': that would be a chunk over
+// 1 GiB, more than a datagram can carry.
+//
+// Split (out+err --format=split -o FILE): the data of STDOUT and STDERR
+// as is, in FILE.out and FILE.err, and an ordering index in FILE.idx:
+// CAPTURE_INDEX_MAGIC and a zero byte, followed by 8 byte little endian
+// entries, each the stream (the high bit) and the offset in its file
+// (63 lower bits) where a run of the stream ends.  The order is rebuilt
+// by copying every stream up to the offsets in turn; the offsets of a
+// stream being sorted, the position of a stream offset in the order is
+// found by binary search.  Entries of the same stream may follow each
+// other, a run spanning writes of the index.  Data past the last entry
+// (torn by a crash) comes after all the indexed data.  Write boundaries
+// are not preserved.
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum { CAPTURE_CLASSIC, CAPTURE_COMPACT, CAPTURE_SPLIT };
+
+#define CAPTURE_MAGIC "OUT+ERR"
+#define CAPTURE_FILE_HEADER_LEN 8
+
+// Compact file header flags.
+// Adjacent chunks of a stream merged, write boundaries not preserved.
+#define CAPTURE_MERGED 1
+// Repeated chunks stored as CAPTURE_REPEAT records.
+#define CAPTURE_DEDUP 2
+
+// Record kinds.
+enum { CAPTURE_STDOUT, CAPTURE_STDERR, CAPTURE_CONTROL };
+
+// Control record types.
+enum { CAPTURE_DROPPED = 1, CAPTURE_REPEAT, CAPTURE_BLOCK };
+
+struct capture_dropped {
+    int stream;
+    uint64_t chunks, bytes;
+};
+
+// Max CAPTURE_DROPPED data length, and text length.
+#define CAPTURE_DROPPED_MAX (1 + 1 + 2 * 10)
+#define CAPTURE_DROPPED_TEXT_MAX 80
+
+#define CAPTURE_REPEAT_WINDOW 256
+#define CAPTURE_REPEAT_CHUNK_MAX 4096
+// Max CAPTURE_REPEAT data length.
+#define CAPTURE_REPEAT_MAX (1 + 2 + 10)
+
+#define CAPTURE_BLOCK_MAGIC "BLK\xb1"
+// CAPTURE_BLOCK data length, and record length.
+#define CAPTURE_BLOCK_DATA_LEN (1 + 4 + 8 + 4)
+#define CAPTURE_BLOCK_LEN (1 + CAPTURE_BLOCK_DATA_LEN)
+
+#define CAPTURE_INDEX_MAGIC "OUT+IDX"
+#define CAPTURE_INDEX_HEADER_LEN 8
+#define CAPTURE_INDEX_ENTRY_LEN 8
+// Split capture file suffixes: STDOUT, STDERR, the index.
+#define CAPTURE_SPLIT_SUFFIXES { ".out", ".err", ".idx" }
+
+// Max header length, for the data size below 1 GiB.
+#define CAPTURE_HEADER_MAX 5
+#define CAPTURE_CHUNK_MAX ((size_t)1 << 30)
+
+// Encode a compact file header, returns its length.
+size_t capture_file_header(char *buf, int flags);
+
+// Encode a chunk header in @format, returns its length.
+static inline size_t capture_header(
+    char *buf, int format, int stream, size_t len
+) {
+    if (format == CAPTURE_CLASSIC) {
+        uint32_t v = (stream ? UINT32_C(0x80000000) : 0) | len;
+        buf[0] = v >> 24;
+        buf[1] = v >> 16;
+        buf[2] = v >> 8;
+        buf[3] = v;
+        return 4;
+    } else {
+        uint64_t key = (uint64_t)len << 2 | stream;
+        size_t n = 0;
+        while (key >= 0x80) {
+            buf[n++] = key | 0x80;
+            key >>= 7;
+        }
+        buf[n++] = key;
+        return n;
+    }
+}
+
+struct capture_chunk {
+    int stream; // 0 - STDOUT, 1 - STDERR, CAPTURE_CONTROL
+    const char *data;
+    size_t len;
+};
+
+struct capture {
+    int fd;
+    int format;
+    int flags;
+    // A regular file is mapped, otherwise read into the buffer.
+    char *map;
+    size_t map_size;
+    char *buf;
+    size_t buf_size;
+    // Unread bytes.
+    const char *pos, *end;
+    int eof;
+    // With CAPTURE_DEDUP, the last chunks (len > CAPTURE_REPEAT_CHUNK_MAX
+    // if not kept), and the repeat being expanded.
+    struct capture_seen {
+        int stream;
+        size_t len;
+    } *seen;
+    char *seen_data;
+    uint64_t seen_count;
+    unsigned repeat_distance;
+    uint64_t repeat_left;
+};
+
+// Start reading a capture from @fd.  Returns 0 or -1 (errno set).
+int capture_open(struct capture *c, int fd);
+
+// Get the next chunk, the data is valid until the next call.  Repeats
+// are expanded.  Returns
+// 1, 0 at the end of the capture, or -1 (errno set; EILSEQ if the
+// capture ends with a torn chunk).
+int capture_next(struct capture *c, struct capture_chunk *chunk);
+
+// As capture_next(), also returning control records.
+int capture_next_record(struct capture *c, struct capture_chunk *chunk);
+
+void capture_close(struct capture *c);
+
+// Encode the data of a CAPTURE_DROPPED record, returns its length.
+size_t capture_dropped_encode(char *buf, const struct capture_dropped *d);
+
+// Decode the data of a control record.  Returns 0, or -1 if it's not a
+// valid CAPTURE_DROPPED one.
+int capture_dropped_decode(
+    const char *data, size_t len, struct capture_dropped *d
+);
+
+// Encode the data of a CAPTURE_REPEAT record, returns its length.
+size_t capture_repeat_encode(char *buf, unsigned distance, uint64_t count);
+
+// Encode a CAPTURE_BLOCK record, header included, for a block of @len
+// bytes with @crc.  Returns CAPTURE_BLOCK_LEN.
+size_t capture_block_encode(char *buf, uint64_t len, uint32_t crc);
+
+// Decode a CAPTURE_BLOCK record at @buf, header included.  Returns 0, or
+// -1 if it's not one.
+int capture_block_decode(const char *buf, uint64_t *len, uint32_t *crc);
+
+// Encode an index entry: a run of @stream ends at @offset.  Returns
+// CAPTURE_INDEX_ENTRY_LEN.
+size_t capture_index_encode(char *buf, int stream, uint64_t offset);
+
+// Decode an index entry.
+void capture_index_decode(const char *buf, int *stream, uint64_t *offset);
+
+// Format the text standing in for a CAPTURE_DROPPED record, a line.
+// Returns its length, at most CAPTURE_DROPPED_TEXT_MAX.
+size_t capture_dropped_text(char *buf, const struct capture_dropped *d);
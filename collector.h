@@ -0,0 +1,58 @@
+// Protocol between out+err and out+err-collector.
+//
+// out+err connects to the collector with a SOCK_SEQPACKET socket and
+// sends COLLECTOR_HELLO carrying its master socket (SCM_RIGHTS) and
+// the addresses of the sockets its child writes to.  From then on the
+// collector receives chunks directly, out+err merely waits for the
+// child.  Once the child exits, out+err sends COLLECTOR_EXIT and waits
+// for COLLECTOR_ACK, meaning that the remaining chunks were drained and
+// written to the store.
+//
+// A store is a sequence of records, each an 8 byte header followed by
+// data.  The header is a 32 bit big endian job number followed by a
+// capture file chunk header.  Job number 0 is for job start (STDOUT)
+// and job end (STDERR) records, their data is a 32 bit big endian job
+// number followed by the job tag or by the wait status respectively.
+// Job numbers are reused once a job ends.
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+enum { COLLECTOR_HELLO = 1, COLLECTOR_EXIT, COLLECTOR_ACK };
+
+#define COLLECTOR_TAG_MAX 256
+
+struct collector_msg {
+    uint32_t type;
+    union {
+        struct {
+            socklen_t output_addrlen, error_addrlen;
+            struct sockaddr_un output_addr, error_addr;
+            char tag[COLLECTOR_TAG_MAX];
+        } hello;
+        int status;
+    };
+};
+
+// Collector address: a path, or a name in the abstract namespace if
+// starts with '@'.  Returns 0 or -1 if the name is too long.
+static inline int collector_addr(
+    const char *name, struct sockaddr_un *addr, socklen_t *addrlen
+) {
+    size_t len = strlen(name);
+    if (len >= sizeof addr->sun_path) return -1;
+    memset(addr, 0, sizeof *addr);
+    addr->sun_family = AF_UNIX;
+    memcpy(addr->sun_path, name, len);
+    if (name[0] == '@') {
+        addr->sun_path[0] = 0;
+        *addrlen = offsetof(struct sockaddr_un, sun_path) + len;
+    } else {
+        *addrlen = sizeof *addr;
+    }
+    return 0;
+}
@@ -0,0 +1,56 @@
+// The instruction is used through a function compiled for SSE4.2, picked
+// at the first call by a CPU check, so that the build doesn't need
+// -msse4.2.  A single dependency chain of 8 byte steps runs at several
+// GB/s, as fast as captures are written.
+#include <string.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#include "crc32c.h"
+
+// Reflected polynomial.
+#define POLY 0x82f63b78
+
+static uint32_t table[256];
+
+static uint32_t crc32c_table(uint32_t crc, const void *data, size_t len) {
+    const unsigned char *p = data;
+    unsigned i, k;
+    uint32_t c;
+    if (!table[1]) {
+        for (i = 0; i < 256; ++i) {
+            for (c = i, k = 0; k < 8; ++k) c = c & 1 ? c >> 1 ^ POLY : c >> 1;
+            table[i] = c;
+        }
+    }
+    crc = ~crc;
+    while (len--) crc = table[(crc ^ *p++) & 0xff] ^ crc >> 8;
+    return ~crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const void *data, size_t len) {
+    const unsigned char *p = data;
+    uint64_t c = ~crc & 0xffffffff, v;
+    for (; len >= 8; len -= 8, p += 8) {
+        memcpy(&v, p, 8);
+        c = _mm_crc32_u64(c, v);
+    }
+    for (; len; --len) c = _mm_crc32_u8(c, *p++);
+    return ~c;
+}
+#endif
+
+static uint32_t (*impl)(uint32_t, const void *, size_t);
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t len) {
+    if (!impl) {
+        impl = crc32c_table;
+#if defined(__x86_64__)
+        if (__builtin_cpu_supports("sse4.2")) impl = crc32c_sse42;
+#endif
+    }
+    return impl(crc, data, len);
+}
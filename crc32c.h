@@ -0,0 +1,9 @@
+// CRC32C (Castagnoli), as used by iSCSI and ext4: with the SSE4.2 crc32
+// instruction if the CPU has it, a table otherwise.
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Continue @crc (0 initially) over @len bytes at @data.
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
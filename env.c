@@ -0,0 +1,134 @@
+// The helper's variables replace those of the environment, if any, so
+// that a capture started under another one doesn't talk to the outer
+// master.  LD_PRELOAD keeps the libraries preloaded already, after the
+// helper.
+#define _GNU_SOURCE 1
+#include <errno.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "env.h"
+
+// Variables set at most: LD_PRELOAD and the helper's.
+#define ENV_VARS 6
+
+static const char *const helper_names[] = {
+    "STDIOSOCK=", "STDIOPIECES=", "STDIOPIPE=", "STDIOHOOK=", "STDIOSTATS="
+};
+
+int env_socket(struct sockaddr_un *addr, socklen_t *addrlen) {
+    int sock = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (sock == -1) return -1;
+    addr->sun_family = AF_UNIX;
+    *addrlen = sizeof *addr;
+    if (
+        bind(
+            sock, (struct sockaddr *)addr,
+            offsetof(struct sockaddr_un, sun_path)
+        ) != 0 ||
+        getsockname(sock, (struct sockaddr *)addr, addrlen) != 0
+    ) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// Whether @list, LD_PRELOAD, has @path.
+static int preload_has(const char *list, const char *path) {
+    const size_t len = strlen(path);
+    while (*list) {
+        if (!strncmp(list, path, len) && strchr(": ", list[len])) return 1;
+        list += strcspn(list, ": ");
+        list += strspn(list, ": ");
+    }
+    return 0;
+}
+
+// Whether @var is set by one of @vars, "NAME=value" each, or is one of
+// the helper's if @all.
+static int env_skip(const char *var, char **vars, size_t count, int all) {
+    size_t i;
+    for (i = 0; i < count; ++i) {
+        if (!strncmp(var, vars[i], strchr(vars[i], '=') - vars[i] + 1)) {
+            return 1;
+        }
+    }
+    for (i = 0; all && i < sizeof helper_names / sizeof *helper_names; ++i) {
+        if (!strncmp(var, helper_names[i], strlen(helper_names[i]))) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Append a variable formatted as @fmt to @vars.  Returns 0 or -1.
+static int add(char **vars, size_t *count, const char *fmt, ...) {
+    va_list ap;
+    int rc;
+    va_start(ap, fmt);
+    rc = vasprintf(&vars[*count], fmt, ap);
+    va_end(ap);
+    if (rc == -1) return -1;
+    ++*count;
+    return 0;
+}
+
+char **env_make(char *const *envp, const struct env_vars *v) {
+    char *vars[ENV_VARS], **env = NULL, *p;
+    const char *preload = NULL;
+    size_t n, count = 0, size = 0, i, j = 0;
+    int err;
+    for (n = 0; envp[n]; ++n) {
+        if (!strncmp(envp[n], "LD_PRELOAD=", 11)) preload = envp[n] + 11;
+    }
+    if (v->helper && !(preload && preload_has(preload, v->helper))) {
+        if (
+            add(
+                vars, &count, "LD_PRELOAD=%s%s%s", v->helper,
+                preload ? ":" : "", preload ? preload : ""
+            ) != 0
+        ) {
+            goto done;
+        }
+    }
+    if (
+        // Autobound name in abstract namespace.
+        (v->addr && add(
+            vars, &count, "STDIOSOCK=%.*s",
+            (int)(v->addrlen - offsetof(struct sockaddr_un, sun_path) - 1),
+            v->addr->sun_path + 1
+        ) != 0) ||
+        (v->pieces && add(vars, &count, "STDIOPIECES=1") != 0) ||
+        (v->pipe && add(vars, &count, "STDIOPIPE=%s", v->pipe) != 0) ||
+        (v->hook && add(vars, &count, "STDIOHOOK=%s", v->hook) != 0) ||
+        (v->stats && add(vars, &count, "STDIOSTATS=%u", v->stats) != 0)
+    ) {
+        goto done;
+    }
+
+    // The pointers, and then the strings set.
+    for (i = 0; i < count; ++i) size += strlen(vars[i]) + 1;
+    if (!(env = malloc((n + count + 1) * sizeof *env + size))) goto done;
+    p = (char *)(env + n + count + 1);
+    for (i = 0; i < n; ++i) {
+        if (!env_skip(envp[i], vars, count, v->addr != NULL)) {
+            env[j++] = envp[i];
+        }
+    }
+    for (i = 0; i < count; ++i) {
+        env[j++] = p;
+        p = stpcpy(p, vars[i]) + 1;
+    }
+    env[j] = NULL;
+
+done:
+    err = errno;
+    for (i = 0; i < count; ++i) free(vars[i]);
+    errno = err;
+    return env;
+}
@@ -0,0 +1,28 @@
+// Starting a child under the helper, for out+err and libouterr alike:
+// the sockets, and the helper's variables in the child's environment,
+// see helper.h.
+#pragma once
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+struct env_vars {
+    const char *helper; // LD_PRELOAD, NULL - as is
+    // STDIOSOCK, the master socket; NULL - keep the helper's variables
+    // of the environment not set here, i.e. those of an outer master.
+    const struct sockaddr_un *addr;
+    socklen_t addrlen;
+    int pieces;         // STDIOPIECES
+    const char *pipe;   // STDIOPIPE, NULL - none
+    const char *hook;   // STDIOHOOK, NULL - none
+    unsigned stats;     // STDIOSTATS, 0 - none
+};
+
+// A datagram socket, close-on-exec, bound to an autobound name stored
+// in @addr and @addrlen.  Returns it, or -1 (errno set).
+int env_socket(struct sockaddr_un *addr, socklen_t *addrlen);
+
+// @envp with the helper's variables set as @vars says.  The result is
+// a single allocation, freed with free().  Returns NULL (errno set) on
+// failure.
+char **env_make(char *const *envp, const struct env_vars *vars);
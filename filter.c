@@ -0,0 +1,192 @@
+// An Aho-Corasick automaton over all the strings, turned into a DFA:
+// failure links are resolved at compile time, so that every state has a
+// transition on every byte and scanning costs a table lookup per byte.
+// Bytes in none of the strings share a class, keeping rows short.  A
+// transition is the target's row offset shifted left by 2, ORed with
+// the strings found on reaching it (FOUND_INCLUDE, FOUND_EXCLUDE), so
+// finding one costs no extra lookup.
+//
+// In the start state, bytes starting none of the strings are skipped 16
+// at a time with SSE2, if there are at most PREFILTER_MAX such first
+// bytes, e.g. a few strings; otherwise they cost a lookup each like the
+// rest.  On log lines, that's ~1.5 GB/s with 5 strings, ~400 MB/s
+// without skipping.
+#define _GNU_SOURCE 1
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "filter.h"
+
+#define FOUND_INCLUDE 1
+#define FOUND_EXCLUDE 2
+
+// First bytes compared at once when skipping.
+#define PREFILTER_MAX 8
+
+int filter_enabled;
+
+static struct { const char *str; int exclude; } *strs;
+static unsigned nstrs, strs_size;
+static int any_include, any_exclude;
+
+static uint16_t classes[256];
+static size_t nclasses;
+static uint32_t *next;
+static int prefilter;
+#ifdef __SSE2__
+static __m128i firsts[PREFILTER_MAX];
+#endif
+
+static void fail(const char *msg) __attribute__((noreturn));
+static void fail(const char *msg) {
+    fprintf(
+        stderr, "%s: %s: %s\n",
+        program_invocation_name, msg, strerror(errno)
+    );
+    exit(EXIT_FAILURE);
+}
+
+void filter_add(const char *str, int exclude) {
+    if (nstrs == strs_size) {
+        strs_size = strs_size ? 2 * strs_size : 16;
+        if (!(strs = realloc(strs, strs_size * sizeof *strs))) {
+            fail("malloc");
+        }
+    }
+    strs[nstrs].str = str;
+    strs[nstrs++].exclude = exclude;
+    any_include |= !exclude;
+    any_exclude |= exclude;
+}
+
+void filter_compile(void) {
+    size_t total = 1, states = 1, head = 0, tail = 0, s, t, c, i;
+    const unsigned char *p;
+    unsigned char first[PREFILTER_MAX];
+    unsigned nfirst = 0;
+    uint32_t *link, *queue;
+    uint8_t *found;
+
+    // Byte classes, 0 for bytes in none of the strings.
+    nclasses = 1;
+    for (i = 0; i < nstrs; ++i) {
+        for (p = (const unsigned char *)strs[i].str; *p; ++p, ++total) {
+            if (!classes[*p]) classes[*p] = nclasses++;
+        }
+    }
+    if (total * nclasses >= UINT32_MAX >> 2) {
+        errno = E2BIG;
+        fail("filter");
+    }
+    if (
+        !(next = calloc(total * nclasses, sizeof *next)) ||
+        !(found = calloc(total, sizeof *found)) ||
+        !(link = malloc(total * sizeof *link)) ||
+        !(queue = malloc(total * sizeof *queue))
+    ) {
+        fail("malloc");
+    }
+
+    // The trie, transitions being state numbers for now, 0 - none.
+    for (i = 0; i < nstrs; ++i) {
+        s = 0;
+        for (p = (const unsigned char *)strs[i].str; *p; ++p) {
+            uint32_t *e = &next[s * nclasses + classes[*p]];
+            if (!*e) *e = states++;
+            s = *e;
+        }
+        found[s] |= strs[i].exclude ? FOUND_EXCLUDE : FOUND_INCLUDE;
+    }
+
+    // Breadth first, the failure link of a state and its row are done
+    // before those of deeper states.  Missing transitions of the start
+    // state stay in it.
+    for (c = 0; c < nclasses; ++c) {
+        if ((t = next[c])) {
+            link[t] = 0;
+            queue[tail++] = t;
+        }
+    }
+    while (head < tail) {
+        s = queue[head++];
+        found[s] |= found[link[s]];
+        for (c = 0; c < nclasses; ++c) {
+            uint32_t *e = &next[s * nclasses + c];
+            if ((t = *e)) {
+                link[t] = next[link[s] * nclasses + c];
+                queue[tail++] = t;
+            } else {
+                *e = next[link[s] * nclasses + c];
+            }
+        }
+    }
+
+    for (c = 0; c < 256; ++c) {
+        if (next[classes[c]] && nfirst++ < PREFILTER_MAX) {
+            first[nfirst - 1] = c;
+        }
+    }
+    prefilter = nfirst && nfirst <= PREFILTER_MAX;
+#ifdef __SSE2__
+    for (i = 0; prefilter && i < PREFILTER_MAX; ++i) {
+        firsts[i] = _mm_set1_epi8(first[i % nfirst]);
+    }
+#else
+    prefilter = 0;
+#endif
+
+    for (i = 0; i < states * nclasses; ++i) {
+        next[i] = next[i] * nclasses << 2 | found[next[i]];
+    }
+    free(found);
+    free(link);
+    free(queue);
+    filter_enabled = 1;
+}
+
+// The next byte starting a string, or @end.
+static const unsigned char *skip(
+    const unsigned char *p, const unsigned char *end
+) {
+#ifdef __SSE2__
+    __m128i v, m;
+    unsigned mask;
+    int i;
+    while (end - p >= 16) {
+        v = _mm_loadu_si128((const __m128i *)p);
+        m = _mm_cmpeq_epi8(v, firsts[0]);
+        for (i = 1; i < PREFILTER_MAX; ++i) {
+            m = _mm_or_si128(m, _mm_cmpeq_epi8(v, firsts[i]));
+        }
+        if ((mask = _mm_movemask_epi8(m))) return p + __builtin_ctz(mask);
+        p += 16;
+    }
+#endif
+    while (p < end && !next[classes[*p]]) ++p;
+    return p;
+}
+
+int filter_check(const struct iovec *iov, int iovcnt) {
+    const unsigned char *p, *end;
+    uint32_t e = 0;
+    int found = 0, i;
+    for (i = 0; i < iovcnt; ++i) {
+        p = iov[i].iov_base;
+        end = p + iov[i].iov_len;
+        while (p < end) {
+            if (!(e >> 2) && prefilter && (p = skip(p, end)) == end) break;
+            e = next[(e >> 2) + classes[*p++]];
+            if (!(e & 3)) continue;
+            found |= e & 3;
+            if (found & FOUND_EXCLUDE) return 0;
+            if (!any_exclude) return 1;
+        }
+    }
+    return !any_include || found;
+}
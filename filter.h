@@ -0,0 +1,19 @@
+// Filtering chunks or lines by fixed strings (--include, --exclude),
+// before they are written.  The strings are compiled once into a single
+// automaton, a chunk is scanned once whatever their number.
+#pragma once
+
+#include <sys/uio.h>
+
+// Nonzero once filter_compile() was called.
+extern int filter_enabled;
+
+// Add a string, before filter_compile().  If any are included, only
+// chunks containing one of them are kept; chunks containing a string
+// excluded are dropped.
+void filter_add(const char *str, int exclude);
+
+void filter_compile(void);
+
+// Whether to keep a chunk, the concatenation of @iovcnt parts.
+int filter_check(const struct iovec *iov, int iovcnt);
@@ -6,25 +6,199 @@
 //
 // * binary-patches write() and writev() to retry calls with a smaller
 //   data chunk if failed with EMSGSIZE. The failure happens when
-//   write() is called with a UNIX dgram socket used for stdin/stderr.
+//   write() is called with a UNIX dgram socket used for stdin/stderr;
+//
+// * or, per function as asked with STDIOHOOK, rewrites GOT entries
+//   instead (plt.h), leaving libc text pages shared.  Only the stdio
+//   write function, calling write() from within libc, is then patched,
+//   see helper.h;
+//
+// * hooks sendfile(), splice() and copy_file_range() to the master
+//   (the socket or a capture pipe) to forward the data as writes, see
+//   forward();
+//
+// * if the master reassembles pieces, splits large writes up front
+//   instead, see helper.h;
+//
+// * with the pipe transport, frames writes to the stdout and stderr
+//   pipes, see helper.h;
+//
+// * stays out if another copy of it was loaded first, e.g. from another
+//   path by a nested out+err;
+//
+// * if asked by the master, counts split writes and writes blocked
+//   because the master is slow, and reports counters to the master, see
+//   helper.h.  A write blocks if a non-blocking attempt fails with
+//   EAGAIN.
 #define _GNU_SOURCE 1
+#include <dlfcn.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/uio.h>
 #include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "helper.h"
 #include "hook_engine/hook_engine.h"
+#include "plt.h"
+#include "probes.h"
+
+// Found by other copies of the helper, see init().  Protected, so that
+// its address here is this copy's own.
+__attribute__((visibility("protected"))) int outerr_helper_loaded;
 
 static struct sockaddr_un master_addr;
 static socklen_t master_addrlen;
 static unsigned send_buf_size;
 
+// Stats: report interval (0 - not counting), stdout and stderr being
+// connected to the master, counters updated atomically.
+static unsigned stats_interval;
+static int capture_fd[3];
+static struct helper_stats stats;
+static uint64_t next_report; // ms
+
+// Pieces: whether the master reassembles them, the socket of the
+// calling thread (closed at thread exit) and its inode, as COMMAND may
+// close it, e.g. when daemonizing.
+#define PIECE_IOV_MAX 64
+#define PIECE_CHUNK_MAX ((size_t)1 << 30) // capture.h: CAPTURE_CHUNK_MAX
+static int pieces_enabled;
+static size_t piece_max;
+static __thread int piece_sock = -1;
+static __thread dev_t piece_dev;
+static __thread ino_t piece_ino;
+static pthread_key_t piece_key;
+
+// Pipe transport: the page shared with the master, if mapped.
+static struct helper_pipe_page *pipe_page;
+
+// Hooks: the backend of every function, the original functions
+// (trampolines when patching the code of write() and writev(), bare
+// syscalls for the rest), text pages dirtied by patching.
+enum {
+    HOOK_WRITE, HOOK_WRITEV, HOOK_SENDFILE, HOOK_SPLICE,
+    HOOK_COPY_FILE_RANGE, HOOK_COUNT
+};
+enum { BACKEND_CODE, BACKEND_PLT };
+#define TEXT_PAGES_MAX 8
+static int hook_backend[HOOK_COUNT];
+static ssize_t (*orig_write)(int fd, const void *buf, size_t count);
+static ssize_t (*orig_writev)(int fd, const struct iovec *iov, int iovcnt);
+static ssize_t (*orig_sendfile)(
+    int out_fd, int in_fd, off_t *offset, size_t count
+);
+static ssize_t (*orig_splice)(
+    int fd_in, loff_t *off_in, int fd_out, loff_t *off_out, size_t len,
+    unsigned flags
+);
+static ssize_t (*orig_copy_file_range)(
+    int fd_in, loff_t *off_in, int fd_out, loff_t *off_out, size_t len,
+    unsigned flags
+);
+static uintptr_t text_page[TEXT_PAGES_MAX];
+
+static uint64_t now_ns(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+static void count(uint64_t *counter, uint64_t v) {
+    __atomic_fetch_add(counter, v, __ATOMIC_RELAXED);
+}
+
+static void count_split(uint64_t pieces) {
+    uint64_t max = __atomic_load_n(&stats.split_pieces_max, __ATOMIC_RELAXED);
+    count(&stats.split_writes, 1);
+    count(&stats.split_pieces, pieces);
+    while (pieces > max && !__atomic_compare_exchange_n(
+        &stats.split_pieces_max, &max, pieces, 1,
+        __ATOMIC_RELAXED, __ATOMIC_RELAXED
+    ));
+}
+
+static void report(void) {
+    const int errno_old = errno;
+    struct helper_stats msg = {
+        .magic = HELPER_STATS_MAGIC,
+        .pid = getpid(),
+        .writes = __atomic_load_n(&stats.writes, __ATOMIC_RELAXED),
+        .split_writes = __atomic_load_n(&stats.split_writes, __ATOMIC_RELAXED),
+        .split_pieces = __atomic_load_n(&stats.split_pieces, __ATOMIC_RELAXED),
+        .split_pieces_max =
+            __atomic_load_n(&stats.split_pieces_max, __ATOMIC_RELAXED),
+        .blocked = __atomic_load_n(&stats.blocked, __ATOMIC_RELAXED),
+        .blocked_ns = __atomic_load_n(&stats.blocked_ns, __ATOMIC_RELAXED),
+        .text_pages = stats.text_pages,
+        .got_pages = stats.got_pages,
+    };
+    int sock = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (sock != -1) {
+        sendto(
+            sock, &msg, sizeof msg, MSG_DONTWAIT,
+            (struct sockaddr *)&master_addr, master_addrlen
+        );
+        close(sock);
+    }
+    errno = errno_old;
+}
+
+static void maybe_report(void) {
+    uint64_t now = now_ns(CLOCK_MONOTONIC_COARSE) / 1000000;
+    uint64_t next = __atomic_load_n(&next_report, __ATOMIC_RELAXED);
+    if (now >= next && __atomic_compare_exchange_n(
+            &next_report, &next, now + stats_interval, 0,
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED
+        )
+    ) {
+        report();
+    }
+}
+
+// Write to the master, counting the time blocked.
+static ssize_t send_counted(int fd, const struct iovec *iov, int iovcnt) {
+    struct msghdr mh = {
+        .msg_iov = (struct iovec *)iov, .msg_iovlen = iovcnt
+    };
+    uint64_t start;
+    ssize_t rc = sendmsg(fd, &mh, MSG_DONTWAIT);
+    if (rc == -1 && errno == ENOTSOCK) {
+        // Redirected by COMMAND.
+        capture_fd[fd] = 0;
+        return orig_writev(fd, iov, iovcnt);
+    }
+    if (rc == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        start = now_ns(CLOCK_MONOTONIC);
+        rc = orig_writev(fd, iov, iovcnt);
+        count(&stats.blocked, 1);
+        count(&stats.blocked_ns, now_ns(CLOCK_MONOTONIC) - start);
+    }
+    count(&stats.writes, 1);
+    maybe_report();
+    return rc;
+}
+
+static int counting(int fd) {
+    return stats_interval && fd >= 0 && fd <= 2 && capture_fd[fd];
+}
+
 static int check_socket(int fd) {
     struct sockaddr_un peer_addr;
     socklen_t peer_addrlen = sizeof peer_addr;
@@ -39,19 +213,280 @@ static int check_socket(int fd) {
     return 0;
 }
 
+// Whether piece_sock is still the socket made, as COMMAND may have
+// closed it, the number being another file's now.
+static int piece_sock_ours(void) {
+    struct stat st;
+    return (
+        piece_sock != -1 && fstat(piece_sock, &st) == 0 &&
+        st.st_dev == piece_dev && st.st_ino == piece_ino
+    );
+}
+
+// At thread exit: the thread's variables are still there.
+static void piece_sock_close(void *v) {
+    if (piece_sock_ours()) close(piece_sock);
+    piece_sock = -1;
+}
+
+static int get_piece_sock(void) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    struct stat st;
+    int sock;
+    if (piece_sock_ours()) return piece_sock;
+    if (piece_sock != -1) {
+        piece_sock = -1;
+        pthread_setspecific(piece_key, NULL);
+    }
+    if ((sock = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0)) == -1) {
+        return -1;
+    }
+    // Autobind, the master tells writes apart by the sender address.
+    if (
+        bind(sock, (struct sockaddr *)&addr, sizeof(sa_family_t)) != 0 ||
+        connect(sock, (struct sockaddr *)&master_addr, master_addrlen) != 0 ||
+        fstat(sock, &st) != 0
+    ) {
+        close(sock);
+        return -1;
+    }
+    piece_dev = st.st_dev;
+    piece_ino = st.st_ino;
+    pthread_setspecific(piece_key, (void *)(intptr_t)(sock + 1));
+    return piece_sock = sock;
+}
+
+static ssize_t send_piece(int sock, const struct msghdr *mh) {
+    uint64_t start;
+    ssize_t rc;
+    if (!stats_interval) return sendmsg(sock, mh, 0);
+    rc = sendmsg(sock, mh, MSG_DONTWAIT);
+    if (rc == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        start = now_ns(CLOCK_MONOTONIC);
+        rc = sendmsg(sock, mh, 0);
+        count(&stats.blocked, 1);
+        count(&stats.blocked_ns, now_ns(CLOCK_MONOTONIC) - start);
+    }
+    return rc;
+}
+
+// Whether a write of @count bytes to @fd is to be sent as pieces.
+static int use_pieces(int fd, size_t count) {
+    const int errno_old = errno;
+    int rc = pieces_enabled && count > piece_max && check_socket(fd) == 0;
+    errno = errno_old;
+    return rc;
+}
+
+// Send a write of @total bytes to the master as pieces.  Returns the
+// bytes sent, -1 if none, or -2 to write as usual instead.
+static ssize_t send_pieces(
+    int fd, const struct iovec *iov, int iovcnt, size_t total
+) {
+    struct helper_piece header = { .magic = HELPER_PIECE_MAGIC };
+    struct iovec piov[1 + PIECE_IOV_MAX] = { { &header, sizeof header } };
+    struct msghdr mh = { .msg_iov = piov };
+    struct sockaddr_un addr;
+    socklen_t addrlen = sizeof addr;
+    size_t sent = 0, chunk = 0, off = 0, len, n;
+    uint64_t pieces = 0;
+    ssize_t rc;
+    int sock = get_piece_sock();
+    if (
+        sock == -1 ||
+        getsockname(fd, (struct sockaddr *)&addr, &addrlen) != 0 ||
+        addrlen - offsetof(struct sockaddr_un, sun_path) >
+            HELPER_PIECE_NAME_MAX
+    ) {
+        return -2;
+    }
+    header.name_len = addrlen - offsetof(struct sockaddr_un, sun_path);
+    memcpy(header.name, addr.sun_path, header.name_len);
+    while (sent < total) {
+        mh.msg_iovlen = 1;
+        len = 0;
+        while (len < piece_max && mh.msg_iovlen <= PIECE_IOV_MAX && iovcnt) {
+            n = iov->iov_len - off < piece_max - len ?
+                iov->iov_len - off : piece_max - len;
+            piov[mh.msg_iovlen].iov_base = (char *)iov->iov_base + off;
+            piov[mh.msg_iovlen++].iov_len = n;
+            len += n;
+            if ((off += n) == iov->iov_len) {
+                ++iov;
+                --iovcnt;
+                off = 0;
+            }
+        }
+        // Chunks are limited in size, a write may become several.
+        header.flags = sent + len < total && chunk + len + piece_max <=
+            PIECE_CHUNK_MAX ? HELPER_PIECE_MORE : 0;
+        while ((rc = send_piece(sock, &mh)) == -1 && errno == EINTR);
+        if (rc == -1) break;
+        sent += len;
+        ++pieces;
+        chunk = header.flags ? chunk + len : 0;
+    }
+    if (chunk) {
+        // Failed midway, end the chunk, best effort.
+        const int errno_old = errno;
+        header.flags = 0;
+        mh.msg_iovlen = 1;
+        send_piece(sock, &mh);
+        errno = errno_old;
+    }
+    PROBE3(helper_split, fd, sent, pieces);
+    if (stats_interval) {
+        count_split(pieces);
+        count(&stats.writes, 1);
+        maybe_report();
+    }
+    return sent ? (ssize_t)sent : -1;
+}
+
+static int capture_pipe(int fd) {
+    const int errno_old = errno;
+    struct stat st;
+    int rc = fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode) &&
+        st.st_dev == pipe_page->dev &&
+        (st.st_ino == pipe_page->ino[0] || st.st_ino == pipe_page->ino[1]);
+    errno = errno_old;
+    return rc;
+}
+
+// Write @iov whole, or fail.  A short frame would corrupt the pipe.
+static ssize_t writev_all(int fd, struct iovec *iov, int iovcnt) {
+    struct pollfd pfd = { fd, POLLOUT };
+    size_t total = 0;
+    ssize_t rc;
+    while (iovcnt) {
+        if ((rc = orig_writev(fd, iov, iovcnt)) < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // O_NONBLOCK set by COMMAND.
+                poll(&pfd, 1, -1);
+                continue;
+            }
+            if (errno == EINTR) continue;
+            return total ? (ssize_t)total : -1;
+        }
+        total += rc;
+        while (iovcnt && (size_t)rc >= iov->iov_len) {
+            rc -= iov->iov_len;
+            ++iov;
+            --iovcnt;
+        }
+        if (iovcnt) {
+            iov->iov_base = (char *)iov->iov_base + rc;
+            iov->iov_len -= rc;
+        }
+    }
+    return total;
+}
+
+// Write to a capture pipe as frames, see helper.h.  Signals are
+// blocked while holding the lock, so that a handler writing can't
+// deadlock or tear a frame.  Returns the bytes written or -1.
+static ssize_t write_frames(int fd, const struct iovec *iov, int iovcnt) {
+    struct helper_frame frame = { .magic = HELPER_FRAME_MAGIC };
+    struct iovec fiov[IOV_MAX];
+    sigset_t all, old;
+    size_t sent = 0, off = 0, len, n;
+    ssize_t rc;
+    int cnt;
+    sigfillset(&all);
+    do {
+        fiov[0].iov_base = &frame;
+        fiov[0].iov_len = sizeof frame;
+        cnt = 1;
+        len = 0;
+        while (len < PIECE_CHUNK_MAX && cnt < IOV_MAX && iovcnt) {
+            n = iov->iov_len - off < PIECE_CHUNK_MAX - len ?
+                iov->iov_len - off : PIECE_CHUNK_MAX - len;
+            fiov[cnt].iov_base = (char *)iov->iov_base + off;
+            fiov[cnt++].iov_len = n;
+            len += n;
+            if ((off += n) == iov->iov_len) {
+                ++iov;
+                --iovcnt;
+                off = 0;
+            }
+        }
+        frame.len = len;
+        pthread_sigmask(SIG_BLOCK, &all, &old);
+        if (pthread_mutex_lock(&pipe_page->lock) == EOWNERDEAD) {
+            // A writer died holding it, maybe midway through a frame.
+            pthread_mutex_consistent(&pipe_page->lock);
+        }
+        frame.seq = pipe_page->seq;
+        rc = writev_all(fd, fiov, cnt);
+        if (rc > 0) pipe_page->seq = frame.seq + 1;
+        pthread_mutex_unlock(&pipe_page->lock);
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+        if (rc < (ssize_t)(sizeof frame + len)) break;
+        sent += len;
+    } while (iovcnt);
+    if (stats_interval) {
+        count(&stats.writes, 1);
+        maybe_report();
+    }
+    return sent || rc >= 0 ? (ssize_t)sent : -1;
+}
+
+// Map the page shared with the master, see helper.h.
+static void map_pipe_page(const char *path) {
+    struct helper_pipe_page *page;
+    int fd;
+    if ((fd = open(path, O_RDWR | O_CLOEXEC)) == -1) goto fail;
+    page = mmap(
+        NULL, sizeof *page, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0
+    );
+    close(fd);
+    if (page == MAP_FAILED) goto fail;
+    if (page->magic != HELPER_PIPE_MAGIC) {
+        munmap(page, sizeof *page);
+        errno = EINVAL;
+        goto fail;
+    }
+    pipe_page = page;
+    return;
+fail:
+    fprintf(
+        stderr, "%s: %s: %s, output order is lost\n",
+        program_invocation_name, path, strerror(errno)
+    );
+}
+
 ssize_t __real__write(int fd, const void *buf, size_t count);
 HOOK_DEFINE_TRAMPOLINE(__real__write);
 
+static ssize_t real_write(int fd, const void *buf, size_t count) {
+    struct iovec iov = { (void *)buf, count };
+    return counting(fd) ?
+        send_counted(fd, &iov, 1) : orig_write(fd, buf, count);
+}
+
 static ssize_t __wrap__write(int fd, const void *buf, size_t count) {
-    ssize_t rc = __real__write(fd, buf, count);
+    ssize_t rc;
+    if (pipe_page && capture_pipe(fd)) {
+        struct iovec iov = { (void *)buf, count };
+        return write_frames(fd, &iov, 1);
+    }
+    if (use_pieces(fd, count)) {
+        struct iovec iov = { (void *)buf, count };
+        if ((rc = send_pieces(fd, &iov, 1, count)) != -2) return rc;
+    }
+    rc = real_write(fd, buf, count);
     if (rc == -1 && errno == EMSGSIZE && check_socket(fd) == 0) {
         const void *p = buf;
-        while (count && (rc = __real__write(
+        uint64_t pieces = 0;
+        while (count && (rc = real_write(
             fd, p, count <= send_buf_size / 2 ? count : send_buf_size / 2)
         ) > 0) {
             p += rc;
             count -= rc;
+            ++pieces;
         }
+        PROBE3(helper_split, fd, p - buf, pieces);
+        if (stats_interval) count_split(pieces);
         return p==buf ? rc : p - buf;
     }
     return rc;
@@ -66,23 +501,46 @@ static int iov_copy(
 ssize_t __real__writev(int fd, const struct iovec *iov, int iovcnt);
 HOOK_DEFINE_TRAMPOLINE(__real__writev);
 
+static ssize_t real_writev(int fd, const struct iovec *iov, int iovcnt) {
+    return counting(fd) ?
+        send_counted(fd, iov, iovcnt) : orig_writev(fd, iov, iovcnt);
+}
+
 static ssize_t __wrap__writev(int fd, const struct iovec *iov, int iovcnt) {
-    ssize_t rc = __real__writev(fd, iov, iovcnt);
+    ssize_t rc;
+    size_t total = 0;
+    int i;
+    if (pipe_page && capture_pipe(fd)) return write_frames(fd, iov, iovcnt);
+    if (pieces_enabled) {
+        for (i = 0; i < iovcnt; ++i) total += iov[i].iov_len;
+        if (
+            use_pieces(fd, total) &&
+            (rc = send_pieces(fd, iov, iovcnt, total)) != -2
+        ) {
+            return rc;
+        }
+    }
+    rc = real_writev(fd, iov, iovcnt);
     if (rc == -1 && errno == EMSGSIZE && iovcnt && check_socket(fd) == 0) {
         size_t total = 0;
         size_t offset = 0;
+        uint64_t pieces = 0;
         struct iovec iovcopy[IOV_COUNT];
-        while ((rc = __real__writev(
+        while ((rc = real_writev(
             fd, iovcopy, iov_copy(iovcopy, iov, iovcnt, offset))
         ) > 0) {
             total += rc;
             offset += rc;
-            while (iov[0].iov_len >= offset) {
+            ++pieces;
+            while (iov[0].iov_len <= offset) {
                 offset -= iov[0].iov_len;
                 ++iov;
-                if (!--iovcnt) return total;
+                if (!--iovcnt) goto done;
             }
         }
+done:
+        PROBE3(helper_split, fd, total, pieces);
+        if (stats_interval) count_split(pieces);
         return total ? (ssize_t)total : rc;
     }
     return rc;
@@ -168,13 +626,308 @@ static size_t __wrap__stdio_write(
         iov[0].iov_len -= cnt;
     }
 }
+#else
+// glibc stdio writes with __write(), called from within libc, not
+// through the GOT.  With write() hooked in the GOT, the function stdio
+// calls instead is replaced as a whole.
+ssize_t _IO_file_write(FILE *f, const void *data, ssize_t n);
+
+// https://sourceware.org/git/?p=glibc.git;a=blob;f=libio/fileops.c;hb=glibc-2.36
+// (_IO_new_file_write)
+static ssize_t __wrap__IO_file_write(FILE *f, const void *data, ssize_t n) {
+    ssize_t to_do = n, cnt;
+    while (to_do > 0) {
+        if ((cnt = __wrap__write(f->_fileno, data, to_do)) < 0) {
+            f->_flags |= _IO_ERR_SEEN;
+            break;
+        }
+        to_do -= cnt;
+        data = (const char *)data + cnt;
+    }
+    n -= to_do;
+    if (f->_offset >= 0) f->_offset += n;
+    return n;
+}
+#endif
+
+// Data moved by sendfile(), splice() or copy_file_range() to the master
+// would be sent as datagrams the kernel chooses (64K, or a page before
+// Linux 6.5), EMSGSIZE once over the send buffer, and would bypass the
+// frames of the pipe transport.  copy_file_range() fails with EINVAL,
+// and callers fall back to reading and writing in small buffers.  So
+// the data is read in and written as by write() instead: a call
+// becomes a chunk, sent as pieces or framed as a write is.  Calls move
+// up to FORWARD_MAX bytes, returning a short count as they may.
+#define FORWARD_MAX ((size_t)1 << 20)
+
+// Whether @fd is connected to the master, a socket or a capture pipe.
+// Costs a syscall or two for other descriptors, little next to moving
+// file data.
+static int capture_dest(int fd) {
+    const int errno_old = errno;
+    int rc = (pipe_page && capture_pipe(fd)) ||
+        (master_addrlen && check_socket(fd) == 0);
+    errno = errno_old;
+    return rc;
+}
+
+// Forward up to @count bytes from @in, at *@offset if not NULL, to the
+// capture @fd.  Data not written is given back to a seekable @in, lost
+// if it is a pipe, as in a failed write().
+static ssize_t forward(int fd, int in, off_t *offset, size_t count) {
+    size_t done = 0;
+    ssize_t n, rc = 0;
+    int errno_old;
+    char *buf;
+    if (count > FORWARD_MAX) count = FORWARD_MAX;
+    if (!count) return 0;
+    if (!(buf = malloc(count))) return -1;
+    n = offset ? pread(in, buf, count, *offset) : read(in, buf, count);
+    while (n > 0 && done < (size_t)n) {
+        if ((rc = __wrap__write(fd, buf + done, n - done)) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        done += rc;
+    }
+    errno_old = errno;
+    free(buf);
+    if (n > 0 && offset) {
+        *offset += done;
+    } else if (n > 0 && done < (size_t)n) {
+        lseek(in, (off_t)done - n, SEEK_CUR);
+    }
+    errno = errno_old;
+    if (n <= 0) return n;
+    return done ? (ssize_t)done : rc;
+}
+
+static ssize_t sys_sendfile(
+    int out_fd, int in_fd, off_t *offset, size_t count
+) {
+    return syscall(SYS_sendfile, out_fd, in_fd, offset, count);
+}
+
+static ssize_t sys_splice(
+    int fd_in, loff_t *off_in, int fd_out, loff_t *off_out, size_t len,
+    unsigned flags
+) {
+    return syscall(SYS_splice, fd_in, off_in, fd_out, off_out, len, flags);
+}
+
+static ssize_t sys_copy_file_range(
+    int fd_in, loff_t *off_in, int fd_out, loff_t *off_out, size_t len,
+    unsigned flags
+) {
+    return syscall(
+        SYS_copy_file_range, fd_in, off_in, fd_out, off_out, len, flags
+    );
+}
+
+static ssize_t __wrap__sendfile(
+    int out_fd, int in_fd, off_t *offset, size_t count
+) {
+    if (!capture_dest(out_fd)) {
+        return orig_sendfile(out_fd, in_fd, offset, count);
+    }
+    return forward(out_fd, in_fd, offset, count);
+}
+
+static ssize_t __wrap__splice(
+    int fd_in, loff_t *off_in, int fd_out, loff_t *off_out, size_t len,
+    unsigned flags
+) {
+    if (!capture_dest(fd_out)) {
+        return orig_splice(fd_in, off_in, fd_out, off_out, len, flags);
+    }
+    if (off_out) {
+        errno = ESPIPE;
+        return -1;
+    }
+    return forward(fd_out, fd_in, off_in, len);
+}
+
+static ssize_t __wrap__copy_file_range(
+    int fd_in, loff_t *off_in, int fd_out, loff_t *off_out, size_t len,
+    unsigned flags
+) {
+    if (!capture_dest(fd_out)) {
+        return orig_copy_file_range(
+            fd_in, off_in, fd_out, off_out, len, flags
+        );
+    }
+    if (flags || off_out) {
+        errno = flags ? EINVAL : ESPIPE;
+        return -1;
+    }
+    return forward(fd_out, fd_in, off_in, len);
+}
+
+// Parse STDIOHOOK, see helper.h.  Returns 0 or -1 if malformed.
+static int parse_stdiohook(const char *spec) {
+    static const char *const names[HOOK_COUNT] = {
+        "write", "writev", "sendfile", "splice", "copy_file_range"
+    };
+    const char *item = spec, *value, *end;
+    int i, backend, matched;
+    while (*item) {
+        end = item + strcspn(item, ",");
+        value = memchr(item, '=', end - item);
+        value = value ? value + 1 : item;
+        if (end - value == 4 && !memcmp(value, "code", 4)) {
+            backend = BACKEND_CODE;
+        } else if (end - value == 3 && !memcmp(value, "plt", 3)) {
+            backend = BACKEND_PLT;
+        } else {
+            return -1;
+        }
+        matched = 0;
+        for (i = 0; i < HOOK_COUNT; ++i) {
+            if (
+                value == item || (
+                    (size_t)(value - 1 - item) == strlen(names[i]) &&
+                    !memcmp(item, names[i], value - 1 - item)
+                )
+            ) {
+                hook_backend[i] = backend;
+                matched = 1;
+            }
+        }
+        if (!matched) return -1;
+        item = *end ? end + 1 : end;
+    }
+    return 0;
+}
+
+// Patch the code of @fn, counting the text pages dirtied, the
+// trampoline's included.
+static int patch(void *fn, void *replacement, void *trampoline) {
+    const uintptr_t page_mask = sysconf(_SC_PAGESIZE) - 1;
+    const uintptr_t range[2][2] = {
+        { (uintptr_t)fn, (uintptr_t)fn + HOOK_INITIAL_JUMP_LEN },
+        {
+            (uintptr_t)trampoline,
+            (uintptr_t)trampoline + HOOK_TRAMPOLINE_LEN
+        },
+    };
+    uintptr_t page;
+    unsigned i, r;
+    if (hook_install(fn, replacement, trampoline) != 0) return -1;
+    for (r = 0; r < (trampoline ? 2 : 1); ++r) {
+        for (
+            page = range[r][0] & ~page_mask; page < range[r][1];
+            page += page_mask + 1
+        ) {
+            for (
+                i = 0; i < stats.text_pages && i < TEXT_PAGES_MAX &&
+                    text_page[i] != page;
+                ++i
+            );
+            if (i < stats.text_pages) continue;
+            if (i < TEXT_PAGES_MAX) text_page[i] = page;
+            ++stats.text_pages;
+        }
+    }
+    return 0;
+}
+
+// Hook the functions with the backends asked for.
+static void install_hooks(void) {
+    struct plt_hook plt[HOOK_COUNT + 1];
+    unsigned got_pages = 0;
+    int n = 0;
+    orig_write = __real__write;
+    orig_writev = __real__writev;
+    if (hook_begin() != 0) goto fail;
+    if (hook_backend[HOOK_WRITE] == BACKEND_PLT) {
+        orig_write = dlsym(RTLD_NEXT, "write");
+        plt[n++] = (struct plt_hook){ "write", __wrap__write };
+    } else if (patch(write, __wrap__write, __real__write) != 0) {
+        goto fail;
+    }
+    if (hook_backend[HOOK_WRITEV] == BACKEND_PLT) {
+        orig_writev = dlsym(RTLD_NEXT, "writev");
+        plt[n++] = (struct plt_hook){ "writev", __wrap__writev };
+    } else if (patch(writev, __wrap__writev, __real__writev) != 0) {
+        goto fail;
+    }
+    // The originals are bare syscalls when patching, no trampolines to
+    // build.  sendfile64() is sendfile() on 64-bit.
+    orig_sendfile = sys_sendfile;
+    orig_splice = sys_splice;
+    orig_copy_file_range = sys_copy_file_range;
+    if (hook_backend[HOOK_SENDFILE] == BACKEND_PLT) {
+        orig_sendfile = dlsym(RTLD_NEXT, "sendfile");
+        plt[n++] = (struct plt_hook){ "sendfile", __wrap__sendfile };
+        plt[n++] = (struct plt_hook){ "sendfile64", __wrap__sendfile };
+    } else if (patch(sendfile, __wrap__sendfile, NULL) != 0) {
+        goto fail;
+    }
+    if (hook_backend[HOOK_SPLICE] == BACKEND_PLT) {
+        orig_splice = dlsym(RTLD_NEXT, "splice");
+        plt[n++] = (struct plt_hook){ "splice", __wrap__splice };
+    } else if (patch(splice, __wrap__splice, NULL) != 0) {
+        goto fail;
+    }
+    if (hook_backend[HOOK_COPY_FILE_RANGE] == BACKEND_PLT) {
+        orig_copy_file_range = dlsym(RTLD_NEXT, "copy_file_range");
+        plt[n++] = (struct plt_hook){
+            "copy_file_range", __wrap__copy_file_range
+        };
+    } else if (
+        patch(copy_file_range, __wrap__copy_file_range, NULL) != 0
+    ) {
+        goto fail;
+    }
+    if (
+#ifdef MUSL
+        patch(__stdio_write, __wrap__stdio_write, NULL) != 0
+#else
+        hook_backend[HOOK_WRITE] == BACKEND_PLT &&
+        patch(_IO_file_write, __wrap__IO_file_write, NULL) != 0
 #endif
+    ) {
+        goto fail;
+    }
+    hook_end();
+    if (n && plt_hook(plt, n, (const void *)install_hooks, &got_pages) < 0) {
+        fprintf(
+            stderr, "%s: Rewrite GOT: %s\n",
+            program_invocation_name, strerror(errno)
+        );
+        exit(EXIT_FAILURE);
+    }
+    stats.got_pages = got_pages;
+    return;
+fail:
+    fprintf(stderr, "%s: %s\n", program_invocation_name, hook_last_error());
+    exit(EXIT_FAILURE);
+}
+
+// Counters and piece sockets are per process, hooks are inherited.
+static void atfork_child(void) {
+    const uint64_t text_pages = stats.text_pages;
+    const uint64_t got_pages = stats.got_pages;
+    memset(&stats, 0, sizeof stats);
+    stats.text_pages = text_pages;
+    stats.got_pages = got_pages;
+    if (piece_sock != -1) {
+        if (piece_sock_ours()) close(piece_sock);
+        piece_sock = -1;
+        pthread_setspecific(piece_key, NULL);
+    }
+}
 
 void init(void) {
-    int sock = socket(AF_UNIX, SOCK_DGRAM, 0);
     socklen_t len = sizeof send_buf_size;
-    char *stdiosock;
+    char *stdiosock, *stdiostats, *stdiopipe, *stdiohook;
     size_t stdiosock_len;
+    int sock, fd;
+    // Hooked already by the copy loaded first.
+    if (dlsym(RTLD_DEFAULT, "outerr_helper_loaded") != &outerr_helper_loaded) {
+        return;
+    }
+    sock = socket(AF_UNIX, SOCK_DGRAM, 0);
     if (
         sock == -1 ||
         getsockopt(sock, SOL_SOCKET, SO_SNDBUF, &send_buf_size, &len) != 0
@@ -186,6 +939,7 @@ void init(void) {
         send_buf_size = 0x8000;
     }
     if (sock != -1) close(sock);
+    if ((stdiopipe = getenv("STDIOPIPE"))) map_pipe_page(stdiopipe);
     if (
         (stdiosock = getenv("STDIOSOCK")) &&
         (stdiosock_len = strlen(stdiosock)) <= sizeof(struct sockaddr_un)
@@ -196,20 +950,38 @@ void init(void) {
         memcpy(master_addr.sun_path + 1, stdiosock, stdiosock_len);
         master_addrlen =
             offsetof(struct sockaddr_un, sun_path) + 1 + stdiosock_len;
+        if ((stdiostats = getenv("STDIOSTATS"))) {
+            stats_interval = strtoul(stdiostats, NULL, 10);
+            for (fd = 1; fd <= 2; ++fd) {
+                capture_fd[fd] = check_socket(fd) == 0;
+            }
+            next_report =
+                now_ns(CLOCK_MONOTONIC_COARSE) / 1000000 + stats_interval;
+        }
+        if (
+            getenv("STDIOPIECES") &&
+            pthread_key_create(&piece_key, piece_sock_close) == 0
+        ) {
+            piece_max = send_buf_size / 2 - sizeof(struct helper_piece);
+            pieces_enabled = 1;
+        }
+        pthread_atfork(NULL, NULL, atfork_child);
     }
     if (
-        hook_begin() != 0 ||
-        hook_install(write,  __wrap__write,  __real__write ) != 0 ||
-        hook_install(writev, __wrap__writev, __real__writev) != 0
-#ifdef MUSL
-        || hook_install(__stdio_write, __wrap__stdio_write, NULL) != 0
-#endif
+        (stdiohook = getenv("STDIOHOOK")) &&
+        parse_stdiohook(stdiohook) != 0
     ) {
         fprintf(
-            stderr, "%s: %s\n", program_invocation_name, hook_last_error()
+            stderr, "%s: Bad STDIOHOOK: %s\n",
+            program_invocation_name, stdiohook
         );
         exit(EXIT_FAILURE);
     }
-    hook_end();
+    install_hooks();
+    PROBE3(helper_hooked, getpid(), stats.text_pages, stats.got_pages);
     setvbuf(stdout, NULL, _IOLBF, 0);
 }
+
+void fini(void) {
+    if (stats_interval && stats.writes) report();
+}
@@ -0,0 +1,102 @@
+// Protocol between the helper and the master.
+//
+// With STDIOSTATS=MS in the environment, the helper keeps write path
+// counters and sends them to the master every MS milliseconds (checked
+// when writing) and at exit, as a datagram to the STDIOSOCK address
+// from an unbound socket.  Counters are per process and cumulative, the
+// latest report of a PID supersedes earlier ones.
+//
+// With STDIOPIECES=1, writes to stdout or stderr larger than a datagram
+// are split by the helper up front.  The pieces are sent from a socket
+// of the writing thread, each starting with struct helper_piece naming
+// the socket written to; all but the last one have HELPER_PIECE_MORE.
+// The master reassembles them into a single chunk.  Pieces of a write
+// are sent one after another from their socket, so there is no need to
+// tell writes apart.
+//
+// With STDIOPIPE=PATH (out+err --transport=pipe), stdout and stderr are
+// pipes instead, and PATH names a memfd holding struct helper_pipe_page,
+// shared by all writers and the master.  The helper writes every write
+// to either pipe as frames, struct helper_frame followed by the data,
+// each stamped with the next sequence number and written whole under
+// the page lock.  Once the master sees a frame, all the earlier ones are
+// complete in their pipes, so it merges the pipes by sequence number.
+//
+// STDIOHOOK=SPEC (out+err --hook) chooses how write(), writev(),
+// sendfile(), splice() and copy_file_range() are hooked: "code" patches
+// the functions (the default), "plt" rewrites GOT entries of the
+// objects loaded at startup instead, leaving libc text pages shared.
+// SPEC is a backend for all, or a comma separated list of
+// FUNCTION=BACKEND, e.g. "write=plt,writev=code".  Calls from
+// within libc don't go through the GOT: with write() hooked in the GOT,
+// the glibc stdio write function is still patched (musl's always is),
+// other libc internal writes are not hooked.
+//
+// A nested out+err, run by a COMMAND with no -o, i.e. capturing to a
+// socket of the outer capture, hands the capture of its own COMMAND
+// over to the outer master rather than receiving it and writing it out
+// again: it connects a socket per stream to STDIOSOCK, sends struct
+// helper_nest from each, naming its stdout socket and its format, and
+// waits for the master to send it back.  The master then stores every
+// chunk from those sockets (and pieces naming them) as the record the
+// nested out+err would have written, in its format, to the stream of
+// its stdout.  Without an answer, e.g. under out+err-collector, the
+// nested out+err captures as usual.  A helper loaded twice, from two
+// paths, hooks writes once.
+#pragma once
+
+#include <pthread.h>
+#include <stdint.h>
+
+#define HELPER_STATS_MAGIC UINT32_C(0x4f455354) // "OEST"
+
+#define HELPER_PIECE_MAGIC UINT32_C(0x4f455043) // "OEPC"
+#define HELPER_PIECE_MORE 1
+#define HELPER_PIECE_NAME_MAX 10
+
+struct helper_piece {
+    uint32_t magic;
+    uint8_t flags;
+    uint8_t name_len;                  // sun_path bytes
+    char name[HELPER_PIECE_NAME_MAX];  // abstract, autobound
+};
+
+#define HELPER_NEST_MAGIC UINT32_C(0x4f454e53) // "OENS"
+
+struct helper_nest {
+    uint32_t magic;
+    uint8_t stream;                    // of the nested COMMAND
+    uint8_t format;                    // capture.h
+    uint8_t name_len;                  // sun_path bytes
+    char name[HELPER_PIECE_NAME_MAX];  // the nested out+err's stdout
+};
+
+#define HELPER_PIPE_MAGIC UINT32_C(0x4f455050)  // "OEPP"
+#define HELPER_FRAME_MAGIC UINT32_C(0x4f454652) // "OEFR"
+
+struct helper_pipe_page {
+    uint32_t magic;
+    pthread_mutex_t lock; // process-shared, robust
+    uint64_t seq;         // of the next frame
+    uint64_t dev;         // the pipes
+    uint64_t ino[2];      // stdout, stderr
+};
+
+struct helper_frame {
+    uint32_t magic;
+    uint32_t len;         // data bytes following
+    uint64_t seq;
+};
+
+struct helper_stats {
+    uint32_t magic;
+    uint32_t pid;
+    uint64_t writes;       // write() and writev() calls to the master
+    uint64_t split_writes; // calls split into pieces
+    uint64_t split_pieces; // datagrams the split calls became
+    uint64_t split_pieces_max;
+    uint64_t blocked;      // calls that blocked, the master being slow
+    uint64_t blocked_ns;   // time spent blocked
+    uint64_t text_pages;   // text pages made private by patching code
+    uint64_t got_pages;    // GOT pages written
+};
@@ -211,6 +211,11 @@ int hook_install(void *fn, void *replacement, void *trampoline)
 
         rip += s.len;
 
+        // Without a trampoline, @fn is replaced as a whole and nothing
+        // needs to be relocated.
+        if (!trampoline)
+            continue;
+
         switch (s.opcode) {
 
         case 0xCC:
@@ -0,0 +1,119 @@
+// Histograms are HDR-style: log-linear buckets, 2^LATENCY_SUB_BITS per
+// power of two, so that any value is within 1/32 (about 3%) of its
+// bucket bounds, with a fixed memory footprint.
+//
+// The report is plain text, "name value" lines per stream and stage,
+// times in nanoseconds, percentiles being bucket upper bounds:
+//
+//   stdout_written_count 1000
+//   stdout_written_p50_ns 48127
+//   stdout_written_p90_ns ...
+//   stdout_written_p99_ns ...
+//   stdout_written_p999_ns ...
+//   stdout_written_max_ns 1210000
+//
+// Send time is the kernel timestamp of the datagram, taken once write()
+// has queued it: time blocked in write() because the master is slow is
+// not included, see helper_*_blocked_ns in stats instead.
+#define _GNU_SOURCE 1
+#include <stdio.h>
+#include <time.h>
+
+#include "latency.h"
+
+#define LATENCY_SUB_BITS 5
+#define LATENCY_SUB (1 << LATENCY_SUB_BITS)
+#define LATENCY_BUCKETS ((64 - LATENCY_SUB_BITS + 1) * LATENCY_SUB)
+
+struct histogram {
+    uint64_t count, max;
+    uint64_t bucket[LATENCY_BUCKETS];
+};
+
+int latency_enabled;
+
+static const char *path;
+static struct histogram hist[2][LATENCY_STAGES];
+
+static unsigned bucket_index(uint64_t v) {
+    unsigned e;
+    if (v < LATENCY_SUB) return v;
+    e = 63 - __builtin_clzll(v);
+    return (e - LATENCY_SUB_BITS + 1) * LATENCY_SUB +
+        ((v >> (e - LATENCY_SUB_BITS)) & (LATENCY_SUB - 1));
+}
+
+// The largest value in bucket @i.
+static uint64_t bucket_max(unsigned i) {
+    unsigned e = i / LATENCY_SUB + LATENCY_SUB_BITS - 1;
+    uint64_t sub = i % LATENCY_SUB;
+    if (i < LATENCY_SUB) return i;
+    return ((LATENCY_SUB + sub + 1) << (e - LATENCY_SUB_BITS)) - 1;
+}
+
+void latency_start(const char *p) {
+    path = p;
+    latency_enabled = 1;
+}
+
+uint64_t latency_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+void latency_record(int stream, int stage, uint64_t sent, uint64_t now) {
+    struct histogram *h = &hist[stream][stage];
+    // The clock may step back.
+    uint64_t v = now > sent ? now - sent : 0;
+    ++h->count;
+    ++h->bucket[bucket_index(v)];
+    if (v > h->max) h->max = v;
+}
+
+static uint64_t percentile(const struct histogram *h, unsigned permille) {
+    uint64_t rank = (h->count * permille + 999) / 1000, seen = 0;
+    unsigned i;
+    for (i = 0; i < LATENCY_BUCKETS; ++i) {
+        if ((seen += h->bucket[i]) >= rank) {
+            return bucket_max(i) < h->max ? bucket_max(i) : h->max;
+        }
+    }
+    return h->max;
+}
+
+int latency_report(void) {
+    static const char *const streams[2] = { "stdout", "stderr" };
+    static const char *const stages[LATENCY_STAGES] = {
+        "received", "written"
+    };
+    static const struct { const char *name; unsigned permille; } pcts[] = {
+        { "p50", 500 }, { "p90", 900 }, { "p99", 990 }, { "p999", 999 }
+    };
+    FILE *f;
+    int i, j;
+    unsigned k;
+    if (!(f = fopen(path, "we"))) return -1;
+    for (i = 0; i < 2; ++i) {
+        for (j = 0; j < LATENCY_STAGES; ++j) {
+            const struct histogram *h = &hist[i][j];
+            fprintf(
+                f, "%s_%s_count %llu\n",
+                streams[i], stages[j], (unsigned long long)h->count
+            );
+            if (!h->count) continue;
+            for (k = 0; k < sizeof pcts / sizeof pcts[0]; ++k) {
+                fprintf(
+                    f, "%s_%s_%s_ns %llu\n",
+                    streams[i], stages[j], pcts[k].name,
+                    (unsigned long long)percentile(h, pcts[k].permille)
+                );
+            }
+            fprintf(
+                f, "%s_%s_max_ns %llu\n",
+                streams[i], stages[j], (unsigned long long)h->max
+            );
+        }
+    }
+    return fclose(f);
+}
@@ -0,0 +1,24 @@
+// Capture latency: time from COMMAND's write() until a chunk is
+// received by the master, and until it is written to the capture file.
+// A histogram per stream and stage, reported at exit.
+#pragma once
+
+#include <stdint.h>
+
+enum { LATENCY_RECEIVED, LATENCY_WRITTEN, LATENCY_STAGES };
+
+// Nonzero once latency_start() was called.
+extern int latency_enabled;
+
+// Start measuring, the report goes to @path.
+void latency_start(const char *path);
+
+// Wall clock time in ns, as datagram timestamps (SO_TIMESTAMPNS).
+uint64_t latency_now(void);
+
+// Record a chunk of @stream, sent at @sent, reaching @stage at @now.
+// A stage is recorded by a single thread.
+void latency_record(int stream, int stage, uint64_t sent, uint64_t now);
+
+// Write the report.  Returns 0 or -1 (errno set).
+int latency_report(void);
@@ -0,0 +1,225 @@
+// A stream over its rate (a token bucket holding a second's worth) or
+// its total size is in a flood, its chunks are dropped, except:
+//
+// * the first `keep` bytes of the flood;
+// * every `sample`th chunk;
+// * the last `keep` bytes, copied and held back until the flood ends.
+//
+// Chunks of a flood, dropped or not, still take tokens, down to an
+// empty bucket: a rate flood ends once the bucket is full again, i.e.
+// the stream kept within the rate for a second, with the next chunk of
+// either stream; a size flood lasts until exit.  At the end, a summary of the chunks and
+// bytes dropped is written in-band (a CAPTURE_DROPPED record, or a line
+// of text in a classic capture), followed by the held back chunks: they
+// come after chunks of the other stream received meanwhile.
+//
+// The clock is read through the vDSO, checks cost no syscalls.
+#define _GNU_SOURCE 1
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "capture.h"
+#include "limit.h"
+#include "output.h"
+
+// Chunks held back at the end of a flood, at most.
+#define TAIL_CHUNKS_MAX 4096
+
+struct limit {
+    uint64_t rate, size;
+    double tokens;           // bytes, negative after a large chunk
+    uint64_t refilled;       // ns
+    uint64_t written;
+    int flood;
+    size_t head_left;
+    uint64_t seen;           // chunks of the flood, for sampling
+    struct capture_dropped dropped;
+    // Held back chunks: a ring of `keep` bytes, and their lengths.
+    char *tail;
+    size_t tail_start, tail_len;
+    uint32_t *lens;
+    unsigned lens_start, lens_count;
+    // The summary and the held back chunks, while being written.
+    char summary[CAPTURE_DROPPED_TEXT_MAX];
+    char *linear;
+};
+
+int limit_enabled;
+
+static struct limit limits[2];
+static size_t keep;
+static unsigned sample;
+static int format;
+
+static void fail(const char *msg) __attribute__((noreturn));
+static void fail(const char *msg) {
+    fprintf(
+        stderr, "%s: %s: %s\n",
+        program_invocation_name, msg, strerror(errno)
+    );
+    exit(EXIT_FAILURE);
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+void limit_start(const struct limit_opts *opts, int f) {
+    struct limit *l;
+    int i;
+    keep = opts->keep;
+    sample = opts->sample;
+    format = f;
+    for (i = 0; i < 2; ++i) {
+        l = &limits[i];
+        l->rate = opts->rate[i];
+        l->size = opts->size[i];
+        l->tokens = l->rate;
+        l->refilled = now_ns();
+        l->dropped.stream = i;
+        if (
+            keep && (l->rate || l->size) && (
+                !(l->tail = malloc(keep)) || !(l->linear = malloc(keep)) ||
+                !(l->lens = malloc(TAIL_CHUNKS_MAX * sizeof *l->lens))
+            )
+        ) {
+            fail("malloc");
+        }
+    }
+    limit_enabled = 1;
+}
+
+static void refill(struct limit *l, uint64_t now) {
+    if (!l->rate) return;
+    l->tokens += (now - l->refilled) * 1e-9 * l->rate;
+    if (l->tokens > l->rate) l->tokens = l->rate;
+    l->refilled = now;
+}
+
+static void flood_end(struct limit *l) {
+    const int stream = l->dropped.stream;
+    size_t off = 0, n;
+    unsigned i;
+    if (l->dropped.chunks || l->dropped.bytes) {
+        if (format == CAPTURE_COMPACT) {
+            output_control(
+                l->summary, capture_dropped_encode(l->summary, &l->dropped)
+            );
+        } else {
+            n = capture_dropped_text(l->summary, &l->dropped);
+            output_chunk(stream, l->summary, n);
+        }
+    }
+    if (l->tail_len) {
+        n = keep - l->tail_start < l->tail_len ?
+            keep - l->tail_start : l->tail_len;
+        memcpy(l->linear, l->tail + l->tail_start, n);
+        memcpy(l->linear + n, l->tail, l->tail_len - n);
+        for (i = 0; i < l->lens_count; ++i) {
+            n = l->lens[(l->lens_start + i) % TAIL_CHUNKS_MAX];
+            output_chunk(stream, l->linear + off, n);
+            off += n;
+        }
+        l->written += l->tail_len;
+    }
+    // The buffers are reused by the next flood.
+    output_flush();
+    l->flood = 0;
+    l->dropped.chunks = l->dropped.bytes = 0;
+    l->tail_start = l->tail_len = 0;
+    l->lens_start = l->lens_count = 0;
+}
+
+int limit_check(int stream, size_t len) {
+    struct limit *l = &limits[stream];
+    const uint64_t now = now_ns();
+    int i;
+    for (i = 0; i < 2; ++i) {
+        refill(&limits[i], now);
+        if (
+            limits[i].flood && limits[i].rate &&
+            limits[i].tokens >= limits[i].rate &&
+            (!limits[i].size || limits[i].written < limits[i].size)
+        ) {
+            flood_end(&limits[i]);
+        }
+    }
+    if (!l->rate && !l->size) return 1;
+    if (!l->flood) {
+        // A full bucket lets a chunk over a second's worth through.
+        if (
+            (!l->rate || l->tokens >= len || l->tokens >= l->rate) &&
+            (!l->size || l->written + len <= l->size)
+        ) {
+            l->tokens -= len;
+            l->written += len;
+            return 1;
+        }
+        l->flood = 1;
+        l->head_left = keep;
+        l->seen = 0;
+    }
+    // Not a debt to pay back, the flood lasts while it's over the rate.
+    if (l->rate) l->tokens = l->tokens > len ? l->tokens - len : 0;
+    ++l->seen;
+    if (len <= l->head_left) {
+        l->head_left -= len;
+        l->written += len;
+        return 1;
+    }
+    l->head_left = 0;
+    if (sample && l->seen % sample == 0) {
+        l->written += len;
+        return 1;
+    }
+    return 0;
+}
+
+// Drop the oldest held back chunk after all.
+static void tail_pop(struct limit *l) {
+    const uint32_t len = l->lens[l->lens_start];
+    l->lens_start = (l->lens_start + 1) % TAIL_CHUNKS_MAX;
+    --l->lens_count;
+    l->tail_start = (l->tail_start + len) % keep;
+    l->tail_len -= len;
+    ++l->dropped.chunks;
+    l->dropped.bytes += len;
+}
+
+void limit_drop(int stream, const char *p, size_t len) {
+    struct limit *l = &limits[stream];
+    size_t end, n;
+    if (!keep || !len) {
+        ++l->dropped.chunks;
+        l->dropped.bytes += len;
+        return;
+    }
+    if (len > keep) {
+        // Only its end is kept.
+        while (l->lens_count) tail_pop(l);
+        l->dropped.bytes += len - keep;
+        p += len - keep;
+        len = keep;
+    }
+    while (l->tail_len + len > keep || l->lens_count == TAIL_CHUNKS_MAX) {
+        tail_pop(l);
+    }
+    end = (l->tail_start + l->tail_len) % keep;
+    n = keep - end < len ? keep - end : len;
+    memcpy(l->tail + end, p, n);
+    memcpy(l->tail, p + n, len - n);
+    l->lens[(l->lens_start + l->lens_count++) % TAIL_CHUNKS_MAX] = len;
+    l->tail_len += len;
+}
+
+void limit_finish(void) {
+    int i;
+    for (i = 0; i < 2; ++i) {
+        if (limits[i].flood) flood_end(&limits[i]);
+    }
+}
@@ -0,0 +1,30 @@
+// Output limits per stream (--rate-limit, --size-limit), for a child
+// flooding its output.  Checking a chunk costs no syscalls.
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct limit_opts {
+    uint64_t rate[2]; // bytes per second, per stream, 0 - unlimited
+    uint64_t size[2]; // bytes in total
+    size_t keep;      // bytes kept at the start and end of a flood
+    unsigned sample;  // keep every Nth chunk of a flood, 0 - none
+};
+
+// Nonzero once limit_start() was called.
+extern int limit_enabled;
+
+// Start limiting, records are written in @format (capture.h).
+void limit_start(const struct limit_opts *opts, int format);
+
+// Whether to write a chunk of @stream, @len bytes long.  If not, it is
+// to be passed to limit_drop().  Writes a flood's summary and end as it
+// ends, before the chunk.
+int limit_check(int stream, size_t len);
+
+// Drop a chunk, keeping its copy if it's among the last of a flood.
+void limit_drop(int stream, const char *p, size_t len);
+
+// End floods, at exit.
+void limit_finish(void);
@@ -0,0 +1,110 @@
+// Newlines are found 64 bytes at a time with SSE2, yielding a bit mask;
+// set bits are then consumed one line at a time.  Short lines cost a
+// few instructions each, long lines a compare per 16 bytes.
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "lines.h"
+
+void lines_init(struct lines *l, lines_fn *fn, void *ctx) {
+    memset(l, 0, sizeof *l);
+    l->fn = fn;
+    l->ctx = ctx;
+}
+
+// Newline positions in 64 bytes at @p.
+static inline uint64_t newlines(const char *p) {
+#ifdef __SSE2__
+    const __m128i nl = _mm_set1_epi8('\n');
+    uint64_t m0 = _mm_movemask_epi8(
+        _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), nl));
+    uint64_t m1 = _mm_movemask_epi8(
+        _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + 16)), nl));
+    uint64_t m2 = _mm_movemask_epi8(
+        _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + 32)), nl));
+    uint64_t m3 = _mm_movemask_epi8(
+        _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + 48)), nl));
+    return m0 | m1 << 16 | m2 << 32 | m3 << 48;
+#else
+    uint64_t m = 0;
+    int i;
+    for (i = 0; i < 64; ++i) m |= (uint64_t)(p[i] == '\n') << i;
+    return m;
+#endif
+}
+
+static int partial_append(
+    struct lines *l, int stream, const char *data, size_t len
+) {
+    typeof(l->partial[0]) *part = &l->partial[stream];
+    if (part->len + len > part->size) {
+        size_t size = part->size ? part->size : 256;
+        char *buf;
+        while (size < part->len + len) size *= 2;
+        if (!(buf = realloc(part->buf, size))) return -1;
+        part->buf = buf;
+        part->size = size;
+    }
+    memcpy(part->buf + part->len, data, len);
+    part->len += len;
+    part->seq = ++l->seq;
+    return 0;
+}
+
+static void line(struct lines *l, int stream, const char *p, size_t len) {
+    typeof(l->partial[0]) *part = &l->partial[stream];
+    struct iovec iov[2] = {
+        { part->buf, part->len }, { (void *)p, len }
+    };
+    if (part->len) {
+        l->fn(l->ctx, stream, iov, 2);
+        part->len = 0;
+    } else {
+        l->fn(l->ctx, stream, iov + 1, 1);
+    }
+}
+
+int lines_feed(struct lines *l, int stream, const char *data, size_t len) {
+    const char *p = data, *start = data, *end = data + len;
+    char tail[64];
+    uint64_t mask;
+    while (p < end) {
+        if (end - p >= 64) {
+            mask = newlines(p);
+        } else if (((uintptr_t)p & 4095) <= 4096 - 64) {
+            // Reading past the end is harmless within a page.
+            mask = newlines(p) & ((UINT64_C(1) << (end - p)) - 1);
+        } else {
+            memcpy(tail, p, end - p);
+            mask = newlines(tail) & ((UINT64_C(1) << (end - p)) - 1);
+        }
+        while (mask) {
+            const char *nl = p + __builtin_ctzll(mask);
+            mask &= mask - 1;
+            line(l, stream, start, nl + 1 - start);
+            start = nl + 1;
+        }
+        p += 64;
+    }
+    return start == end ? 0 : partial_append(l, stream, start, end - start);
+}
+
+void lines_finish(struct lines *l) {
+    int first = l->partial[0].seq > l->partial[1].seq;
+    int i;
+    for (i = 0; i != 2; ++i) {
+        int stream = i ^ first;
+        if (l->partial[stream].len) {
+            line(l, stream, NULL, 0);
+        }
+    }
+}
+
+void lines_free(struct lines *l) {
+    free(l->partial[0].buf);
+    free(l->partial[1].buf);
+}
@@ -0,0 +1,38 @@
+// Reassembling lines from chunks.
+//
+// A line may span many chunks of a stream, while chunks of the other
+// stream come in between.  Lines are reported in the order they are
+// completed, i.e. by the chunk with the terminating newline.
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+// Called for every line, including the newline.  The line is the
+// concatenation of @iovcnt (1 or 2) parts, valid until return.
+typedef void lines_fn(
+    void *ctx, int stream, const struct iovec *iov, int iovcnt
+);
+
+struct lines {
+    lines_fn *fn;
+    void *ctx;
+    // Incomplete line of a stream.
+    struct {
+        char *buf;
+        size_t len, size;
+        uint64_t seq; // when last appended to
+    } partial[2];
+    uint64_t seq;
+};
+
+void lines_init(struct lines *l, lines_fn *fn, void *ctx);
+
+// Feed a chunk.  Returns 0 or -1 (errno set).
+int lines_feed(struct lines *l, int stream, const char *data, size_t len);
+
+// Report incomplete lines, in the order last appended to.
+void lines_finish(struct lines *l);
+
+void lines_free(struct lines *l);
@@ -0,0 +1,369 @@
+// Usage: out+err-cat [-f text|classic|compact] [-m] [FILE]...
+//
+// Print captures (stdin by default) as text, every line of output
+// prefixed with "[out] " or "[err] ", in the order lines were completed
+// by COMMAND.  Lines split between chunks are reassembled; a final line
+// lacking a newline gets one.
+//
+// With -f classic or -f compact, convert captures to the format instead,
+// see capture.h.  With -m, adjacent chunks of a stream are merged
+// (compact only).
+//
+// Summaries of chunks dropped by out+err limits are printed as a line of
+// the stream, or kept as records when converting to compact.
+//
+// A split capture is read by naming its FILE.idx, the streams are read
+// from FILE.out and FILE.err next to it, and interleaved by the index.
+#define _GNU_SOURCE 1
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "lines.h"
+
+#define OUT_BUF_SIZE (1 << 20)
+
+#define FORMAT_TEXT (-1)
+
+static const char prefix[2][6] = { "[out] ", "[err] " };
+
+static char out_buf[OUT_BUF_SIZE];
+static size_t out_len;
+
+// Converting: the output format and flags, the pending merged chunk.
+static int format = FORMAT_TEXT, flags;
+static char run_buf[OUT_BUF_SIZE];
+static size_t run_len;
+static int run_stream;
+
+static void usage(void) {
+    fprintf(
+        stderr, "Usage: %s [-f text|classic|compact] [-m] [FILE]...\n",
+        program_invocation_name
+    );
+    exit(EXIT_FAILURE);
+}
+
+static void fail(const char *msg) __attribute__((noreturn));
+static void fail(const char *msg) {
+    fprintf(
+        stderr, "%s: %s: %s\n",
+        program_invocation_name, msg, strerror(errno)
+    );
+    exit(EXIT_FAILURE);
+}
+
+static void write_all(struct iovec *iov, int iovcnt) {
+    ssize_t rc;
+    while (iovcnt) {
+        if ((rc = writev(STDOUT_FILENO, iov, iovcnt)) < 0) {
+            if (errno == EINTR) continue;
+            fail("write");
+        }
+        while (iovcnt && (size_t)rc >= iov->iov_len) {
+            rc -= iov->iov_len;
+            ++iov;
+            --iovcnt;
+        }
+        if (iovcnt) {
+            iov->iov_base += rc;
+            iov->iov_len -= rc;
+        }
+    }
+}
+
+static void flush(void) {
+    struct iovec iov = { out_buf, out_len };
+    write_all(&iov, 1);
+    out_len = 0;
+}
+
+static void print_line(
+    void *ctx, int stream, const struct iovec *iov, int iovcnt
+) {
+    size_t len = sizeof prefix[0] + iov[0].iov_len +
+        (iovcnt == 2 ? iov[1].iov_len : 0);
+    // The last part is empty for an incomplete line at the end.
+    const struct iovec *last = &iov[iov[iovcnt - 1].iov_len ? iovcnt - 1 : 0];
+    int nl = ((const char *)last->iov_base)[last->iov_len - 1] != '\n';
+    int i;
+    if (out_len + len + nl > OUT_BUF_SIZE) {
+        flush();
+        if (len + nl > OUT_BUF_SIZE) {
+            struct iovec parts[4] = {
+                { (void *)prefix[stream], sizeof prefix[0] },
+                iov[0], iovcnt == 2 ? iov[1] : (struct iovec){ 0 },
+                { "\n", nl }
+            };
+            write_all(parts, 4);
+            return;
+        }
+    }
+    memcpy(out_buf + out_len, prefix[stream], sizeof prefix[0]);
+    out_len += sizeof prefix[0];
+    for (i = 0; i < iovcnt; ++i) {
+        memcpy(out_buf + out_len, iov[i].iov_base, iov[i].iov_len);
+        out_len += iov[i].iov_len;
+    }
+    if (nl) out_buf[out_len++] = '\n';
+}
+
+static void put_chunk(int stream, const char *data, size_t len) {
+    char header[CAPTURE_HEADER_MAX];
+    struct iovec parts[2] = {
+        { header, capture_header(header, format, stream, len) },
+        { (void *)data, len }
+    };
+    if (out_len + parts[0].iov_len + len > OUT_BUF_SIZE) {
+        flush();
+        if (parts[0].iov_len + len > OUT_BUF_SIZE) {
+            write_all(parts, 2);
+            return;
+        }
+    }
+    memcpy(out_buf + out_len, header, parts[0].iov_len);
+    out_len += parts[0].iov_len;
+    memcpy(out_buf + out_len, data, len);
+    out_len += len;
+}
+
+static void put_run(void) {
+    if (run_len) put_chunk(run_stream, run_buf, run_len);
+    run_len = 0;
+}
+
+// A summary of dropped chunks, as a line of text or a record.
+static void dropped(const struct capture_chunk *chunk) {
+    struct capture_dropped d;
+    char text[CAPTURE_DROPPED_TEXT_MAX];
+    struct iovec iov;
+    if (capture_dropped_decode(chunk->data, chunk->len, &d) != 0) return;
+    if (format == CAPTURE_COMPACT) {
+        put_run();
+        put_chunk(CAPTURE_CONTROL, chunk->data, chunk->len);
+    } else if (format == CAPTURE_CLASSIC) {
+        put_run();
+        put_chunk(d.stream, text, capture_dropped_text(text, &d));
+    } else {
+        iov.iov_base = text;
+        iov.iov_len = capture_dropped_text(text, &d);
+        print_line(NULL, d.stream, &iov, 1);
+    }
+}
+
+static void convert(const struct capture_chunk *chunk) {
+    if (chunk->stream == CAPTURE_CONTROL) {
+        dropped(chunk);
+        return;
+    }
+    if (!(flags & CAPTURE_MERGED)) {
+        put_chunk(chunk->stream, chunk->data, chunk->len);
+        return;
+    }
+    if (chunk->stream != run_stream || run_len + chunk->len > OUT_BUF_SIZE) {
+        put_run();
+        run_stream = chunk->stream;
+    }
+    if (chunk->len > OUT_BUF_SIZE) {
+        put_chunk(chunk->stream, chunk->data, chunk->len);
+        return;
+    }
+    memcpy(run_buf + run_len, chunk->data, chunk->len);
+    run_len += chunk->len;
+}
+
+static int cat(const char *path, int fd) {
+    struct capture capture;
+    struct capture_chunk chunk;
+    struct lines lines;
+    int rc;
+    if (capture_open(&capture, fd) != 0) fail(path);
+    if (format != FORMAT_TEXT) {
+        while ((rc = capture_next_record(&capture, &chunk)) > 0) {
+            convert(&chunk);
+        }
+        put_run();
+    } else {
+        lines_init(&lines, print_line, NULL);
+        while ((rc = capture_next_record(&capture, &chunk)) > 0) {
+            if (chunk.stream == CAPTURE_CONTROL) {
+                dropped(&chunk);
+            } else if (
+                lines_feed(&lines, chunk.stream, chunk.data, chunk.len)
+            ) {
+                fail("lines");
+            }
+        }
+        lines_finish(&lines);
+        lines_free(&lines);
+    }
+    capture_close(&capture);
+    if (rc < 0) {
+        fprintf(
+            stderr, "%s: %s: %s\n",
+            program_invocation_name, path,
+            errno == EILSEQ ? "Truncated chunk" : strerror(errno)
+        );
+        return -1;
+    }
+    return 0;
+}
+
+// Map the file @path, open as @fd unless -1.  Returns NULL for an empty
+// file, fails on error.
+static const char *map(const char *path, int fd, size_t *len) {
+    struct stat st;
+    void *p;
+    int own = fd == -1;
+    if (own && (fd = open(path, O_RDONLY | O_CLOEXEC)) == -1) fail(path);
+    if (fstat(fd, &st) != 0) fail(path);
+    *len = st.st_size;
+    p = NULL;
+    if (
+        *len &&
+        (p = mmap(NULL, *len, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED
+    ) {
+        fail(path);
+    }
+    if (own) close(fd);
+    return p;
+}
+
+// Pass the data of @stream from @*pos up to @end on as chunks.
+static void split_run(
+    struct lines *lines, int stream, const char *data, uint64_t *pos,
+    uint64_t end
+) {
+    struct capture_chunk chunk = { stream };
+    while (*pos < end) {
+        chunk.data = data + *pos;
+        chunk.len = end - *pos;
+        if (chunk.len > CAPTURE_CHUNK_MAX) chunk.len = CAPTURE_CHUNK_MAX;
+        *pos += chunk.len;
+        if (format != FORMAT_TEXT) {
+            convert(&chunk);
+        } else if (lines_feed(lines, stream, chunk.data, chunk.len)) {
+            fail("lines");
+        }
+    }
+}
+
+// A split capture, by its index @path open as @fd.
+static int cat_split(const char *path, int fd) {
+    static const char *const suffixes[] = CAPTURE_SPLIT_SUFFIXES;
+    const size_t base_len = strlen(path) - strlen(suffixes[2]);
+    const char *index, *data[2];
+    size_t index_len, len[2], i;
+    uint64_t pos[2] = { 0, 0 }, offset;
+    struct lines lines;
+    char *name;
+    int stream, rc = 0;
+    if (
+        strlen(path) < strlen(suffixes[2]) ||
+        strcmp(path + base_len, suffixes[2])
+    ) {
+        fprintf(
+            stderr, "%s: %s: Index not named *%s\n",
+            program_invocation_name, path, suffixes[2]
+        );
+        return -1;
+    }
+    for (i = 0; i < 2; ++i) {
+        if (
+            asprintf(&name, "%.*s%s", (int)base_len, path, suffixes[i]) == -1
+        ) {
+            fail("malloc");
+        }
+        data[i] = map(name, -1, &len[i]);
+        free(name);
+    }
+    index = map(path, fd, &index_len);
+    if (format == FORMAT_TEXT) lines_init(&lines, print_line, NULL);
+    for (
+        i = CAPTURE_INDEX_HEADER_LEN;
+        i + CAPTURE_INDEX_ENTRY_LEN <= index_len;
+        i += CAPTURE_INDEX_ENTRY_LEN
+    ) {
+        capture_index_decode(index + i, &stream, &offset);
+        if (offset > len[stream]) {
+            rc = -1;
+            break;
+        }
+        split_run(&lines, stream, data[stream], &pos[stream], offset);
+    }
+    // Unindexed, e.g. written just before a crash.
+    for (stream = 0; stream < 2; ++stream) {
+        split_run(&lines, stream, data[stream], &pos[stream], len[stream]);
+    }
+    if (format != FORMAT_TEXT) {
+        put_run();
+    } else {
+        lines_finish(&lines);
+        lines_free(&lines);
+    }
+    munmap((void *)index, index_len);
+    for (i = 0; i < 2; ++i) munmap((void *)data[i], len[i]);
+    if (rc < 0) {
+        fprintf(
+            stderr, "%s: %s: Offset past the end of %s\n",
+            program_invocation_name, path, suffixes[stream]
+        );
+    }
+    return rc;
+}
+
+// Whether @fd is a split capture index.
+static int is_index(int fd) {
+    char buf[CAPTURE_INDEX_HEADER_LEN];
+    return pread(fd, buf, sizeof buf, 0) == sizeof buf &&
+        !memcmp(buf, CAPTURE_INDEX_MAGIC, sizeof buf);
+}
+
+int main(int argc, char **argv) {
+    int opt, fd, i, status = EXIT_SUCCESS;
+
+    while ((opt = getopt(argc, argv, "+f:m")) != -1) {
+        switch (opt) {
+        case 'f':
+            if (!strcmp(optarg, "text")) {
+                format = FORMAT_TEXT;
+            } else if (!strcmp(optarg, "classic")) {
+                format = CAPTURE_CLASSIC;
+            } else if (!strcmp(optarg, "compact")) {
+                format = CAPTURE_COMPACT;
+            } else {
+                usage();
+            }
+            break;
+        case 'm':
+            flags |= CAPTURE_MERGED;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (flags && format != CAPTURE_COMPACT) usage();
+    if (format == CAPTURE_COMPACT) {
+        out_len = capture_file_header(out_buf, flags);
+    }
+
+    if (optind == argc) {
+        if (cat("-", STDIN_FILENO) != 0) status = EXIT_FAILURE;
+    }
+    for (i = optind; i < argc; ++i) {
+        if ((fd = open(argv[i], O_RDONLY | O_CLOEXEC)) == -1) fail(argv[i]);
+        if ((is_index(fd) ? cat_split : cat)(argv[i], fd) != 0) {
+            status = EXIT_FAILURE;
+        }
+        close(fd);
+    }
+    flush();
+    return status;
+}
@@ -0,0 +1,424 @@
+// Usage: out+err-collector [-l MS] SOCKET STORE...
+//        out+err-collector -x TAG STORE
+//
+// Collect chunks from many `out+err --collector=SOCKET` instances into a
+// few append-only STORE files, see collector.h for the protocol and the
+// store format.  Jobs are assigned to stores in turn.  Chunks are
+// batched across jobs: a store is written to once its buffer fills up,
+// or MS milliseconds (200 by default) after the first chunk was
+// buffered.
+//
+// SOCKET is a path, or a name in the abstract namespace if it starts
+// with '@'.
+//
+// With -x, extract captures of the jobs tagged TAG from STORE to stdout,
+// in the capture file format.
+#define _GNU_SOURCE 1
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "collector.h"
+
+#define STORE_BUF_SIZE (4 << 20)
+
+// Datagrams received from a job per wakeup, for fairness.
+#define RECV_BATCH 64
+
+struct store {
+    int fd;
+    const char *path;
+    char *buf;
+    size_t len;
+    long since; // ms, when the first chunk was buffered
+};
+
+struct job {
+    struct collector_msg hello;
+    struct store *store;
+    int ctl_fd, data_fd;
+    size_t msg_size_max;
+    uint64_t truncated; // chunks longer than msg_size_max
+};
+
+static struct store *stores;
+static int store_count, store_next;
+static struct job **jobs; // by job number
+static uint32_t job_count;
+static int epoll_fd;
+static long flush_ms = 200;
+static volatile sig_atomic_t quit;
+
+static void usage(void) {
+    fprintf(
+        stderr,
+        "Usage: %s [-l MS] SOCKET STORE...\n"
+        "       %s -x TAG STORE\n",
+        program_invocation_name, program_invocation_name
+    );
+    exit(EXIT_FAILURE);
+}
+
+static void fail(const char *msg) __attribute__((noreturn));
+static void fail(const char *msg) {
+    fprintf(
+        stderr, "%s: %s: %s\n",
+        program_invocation_name, msg, strerror(errno)
+    );
+    exit(EXIT_FAILURE);
+}
+
+static void quit_handler(int sig) {
+    quit = 1;
+}
+
+static long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void write_all(int fd, const char *buf, size_t len, const char *what) {
+    ssize_t rc;
+    while (len) {
+        if ((rc = write(fd, buf, len)) < 0) {
+            if (errno == EINTR) continue;
+            fail(what);
+        }
+        buf += rc;
+        len -= rc;
+    }
+}
+
+static void store_flush(struct store *s) {
+    write_all(s->fd, s->buf, s->len, s->path);
+    s->len = 0;
+}
+
+// Make room for a @len bytes record.
+static char *store_reserve(struct store *s, size_t len) {
+    if (s->len + len > STORE_BUF_SIZE) store_flush(s);
+    if (!s->len) s->since = now_ms();
+    return s->buf + s->len;
+}
+
+static void store_header(char *p, uint32_t job, uint32_t stream, size_t len) {
+    const uint32_t header[2] = {
+        htonl(job), htonl((stream ? UINT32_C(0x80000000) : 0) | len)
+    };
+    memcpy(p, header, sizeof header);
+}
+
+// Job start (stream 0) or end (stream 1) record.
+static void store_job_record(
+    struct store *s, uint32_t job, int stream, const void *data, size_t len
+) {
+    char *p = store_reserve(s, 12 + len);
+    uint32_t job_be = htonl(job);
+    store_header(p, 0, stream, 4 + len);
+    memcpy(p + 8, &job_be, 4);
+    memcpy(p + 12, data, len);
+    s->len += 12 + len;
+}
+
+static void watch(int fd, uint64_t key) {
+    struct epoll_event ev = { .events = EPOLLIN, .data.u64 = key };
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) fail("epoll_ctl");
+}
+
+// Receive up to @budget chunks, or until drained if @budget is 0.
+static void job_recv(uint32_t id, int budget) {
+    struct job *job = jobs[id];
+    const struct collector_msg *h = &job->hello;
+    struct sockaddr_un addr;
+    socklen_t addrlen;
+    int stream, n = 0;
+    ssize_t rc;
+    char *p;
+    while (!budget || n++ < budget) {
+        p = store_reserve(job->store, 8 + job->msg_size_max);
+        addrlen = sizeof addr;
+        rc = recvfrom(
+            job->data_fd, p + 8, job->msg_size_max,
+            MSG_DONTWAIT | MSG_TRUNC, (struct sockaddr *)&addr, &addrlen
+        );
+        if (rc < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        // Kept as received, reported once the job ends.
+        if ((size_t)rc > job->msg_size_max) {
+            rc = job->msg_size_max;
+            ++job->truncated;
+        }
+        if (
+            addrlen == h->hello.output_addrlen &&
+            !memcmp(&addr, &h->hello.output_addr, addrlen)
+        ) {
+            stream = 0;
+        } else if (
+            addrlen == h->hello.error_addrlen &&
+            !memcmp(&addr, &h->hello.error_addr, addrlen)
+        ) {
+            stream = 1;
+        } else {
+            continue;
+        }
+        store_header(p, id, stream, rc);
+        job->store->len += 8 + rc;
+    }
+}
+
+static void job_accept(int listen_fd) {
+    int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+    struct job *job;
+    uint32_t id;
+    if (fd == -1) return;
+    for (id = 1; id < job_count && jobs[id]; ++id);
+    if (id == job_count) {
+        if (!(jobs = realloc(jobs, ++job_count * sizeof *jobs))) {
+            fail("realloc");
+        }
+    }
+    if (!(job = jobs[id] = calloc(1, sizeof *job))) fail("calloc");
+    job->ctl_fd = fd;
+    job->data_fd = -1;
+    watch(fd, (uint64_t)id << 1);
+}
+
+static void job_end(uint32_t id, int status, int ack) {
+    struct job *job = jobs[id];
+    struct collector_msg msg = { .type = COLLECTOR_ACK };
+    uint32_t status_be = htonl(status);
+    if (job->data_fd != -1) {
+        job_recv(id, 0);
+        store_job_record(job->store, id, 1, &status_be, 4);
+        store_flush(job->store);
+        close(job->data_fd);
+        if (job->truncated) {
+            fprintf(
+                stderr, "%s: %s: %llu chunks truncated\n",
+                program_invocation_name, job->hello.hello.tag,
+                (unsigned long long)job->truncated
+            );
+        }
+    }
+    if (ack) send(job->ctl_fd, &msg, sizeof msg, MSG_NOSIGNAL);
+    close(job->ctl_fd);
+    free(job);
+    jobs[id] = NULL;
+}
+
+static void job_hello(uint32_t id, const struct collector_msg *msg, int fd) {
+    struct job *job = jobs[id];
+    int v;
+    socklen_t len = sizeof v;
+    job->hello = *msg;
+    job->hello.hello.tag[COLLECTOR_TAG_MAX - 1] = 0;
+    job->data_fd = fd;
+    job->msg_size_max =
+        getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &v, &len) == 0 ? v : 0x8000;
+    // A chunk and its header have to fit the store buffer.
+    if (job->msg_size_max > STORE_BUF_SIZE - 8) {
+        job->msg_size_max = STORE_BUF_SIZE - 8;
+    }
+    job->store = &stores[store_next++ % store_count];
+    store_job_record(
+        job->store, id, 0, job->hello.hello.tag,
+        strlen(job->hello.hello.tag)
+    );
+    watch(fd, (uint64_t)id << 1 | 1);
+}
+
+static void job_ctl(uint32_t id) {
+    struct job *job = jobs[id];
+    struct collector_msg msg;
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { &msg, sizeof msg };
+    struct msghdr mh = {
+        .msg_iov = &iov, .msg_iovlen = 1,
+        .msg_control = cbuf, .msg_controllen = sizeof cbuf
+    };
+    struct cmsghdr *cmsg;
+    int fd = -1;
+    ssize_t rc = recvmsg(job->ctl_fd, &mh, MSG_CMSG_CLOEXEC);
+    if (rc < 0 && (errno == EINTR || errno == EAGAIN)) return;
+    if (
+        rc > 0 && (cmsg = CMSG_FIRSTHDR(&mh)) &&
+        cmsg->cmsg_type == SCM_RIGHTS
+    ) {
+        memcpy(&fd, CMSG_DATA(cmsg), sizeof fd);
+    }
+    if (rc == sizeof msg && msg.type == COLLECTOR_HELLO &&
+        job->data_fd == -1 && fd != -1
+    ) {
+        job_hello(id, &msg, fd);
+        return;
+    }
+    if (fd != -1) close(fd);
+    if (rc == sizeof msg && msg.type == COLLECTOR_EXIT) {
+        job_end(id, msg.status, 1);
+    } else {
+        // Gone, or protocol error.
+        job_end(id, -1, 0);
+    }
+}
+
+static int collect(const char *name, char **paths, int count) {
+    struct sockaddr_un addr;
+    socklen_t addrlen;
+    struct epoll_event events[64];
+    int listen_fd, i, n;
+    long timeout;
+
+    if (collector_addr(name, &addr, &addrlen) != 0) {
+        errno = ENAMETOOLONG;
+        fail(name);
+    }
+    if (
+        (listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) == -1
+    ) {
+        fail("socket");
+    }
+    if (addr.sun_path[0]) unlink(addr.sun_path);
+    if (
+        bind(listen_fd, (struct sockaddr *)&addr, addrlen) != 0 ||
+        listen(listen_fd, SOMAXCONN) != 0
+    ) {
+        fail(name);
+    }
+
+    store_count = count;
+    if (!(stores = calloc(count, sizeof *stores))) fail("calloc");
+    for (i = 0; i < count; ++i) {
+        stores[i].path = paths[i];
+        stores[i].fd = open(
+            paths[i], O_CREAT | O_WRONLY | O_APPEND | O_CLOEXEC, 0600
+        );
+        if (stores[i].fd == -1) fail(paths[i]);
+        if (!(stores[i].buf = malloc(STORE_BUF_SIZE))) fail("malloc");
+    }
+
+    if (!(jobs = calloc(job_count = 1, sizeof *jobs))) fail("calloc");
+    if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1) fail("epoll");
+    watch(listen_fd, 0);
+
+    signal(SIGINT, quit_handler);
+    signal(SIGTERM, quit_handler);
+
+    while (!quit) {
+        // Sleep until the oldest buffered chunk is due.
+        timeout = -1;
+        for (i = 0; i < count; ++i) {
+            if (stores[i].len) {
+                long left = stores[i].since + flush_ms - now_ms();
+                if (left <= 0) {
+                    store_flush(&stores[i]);
+                } else if (timeout == -1 || left < timeout) {
+                    timeout = left;
+                }
+            }
+        }
+        if ((n = epoll_wait(epoll_fd, events, 64, timeout)) < 0) {
+            if (errno == EINTR) continue;
+            fail("epoll_wait");
+        }
+        for (i = 0; i < n; ++i) {
+            uint64_t key = events[i].data.u64;
+            if (!key) {
+                job_accept(listen_fd);
+            } else if (jobs[key >> 1]) {
+                if (key & 1) {
+                    job_recv(key >> 1, RECV_BATCH);
+                } else {
+                    job_ctl(key >> 1);
+                }
+            }
+        }
+    }
+
+    for (i = 0; i < count; ++i) store_flush(&stores[i]);
+    if (addr.sun_path[0]) unlink(addr.sun_path);
+    return EXIT_SUCCESS;
+}
+
+static int extract(const char *tag, const char *path) {
+    uint8_t *match = NULL;
+    uint32_t match_count = 0;
+    const size_t tag_len = strlen(tag);
+    const char *p, *end;
+    struct stat st;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1 || fstat(fd, &st)) {
+        fail(path);
+    }
+    if (!st.st_size) return EXIT_SUCCESS;
+    p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED) fail(path);
+    end = p + st.st_size;
+
+    while (end - p >= 8) {
+        uint32_t header[2], job;
+        size_t len;
+        memcpy(header, p, 8);
+        job = ntohl(header[0]);
+        len = ntohl(header[1]) & UINT32_C(0x7fffffff);
+        if ((size_t)(end - p - 8) < len) break; // torn record
+        if (!job && len >= 4) {
+            memcpy(&job, p + 8, 4);
+            job = ntohl(job);
+            if (job >= match_count) {
+                match = realloc(match, job + 1);
+                if (!match) fail("realloc");
+                memset(match + match_count, 0, job + 1 - match_count);
+                match_count = job + 1;
+            }
+            match[job] = !(header[1] & htonl(UINT32_C(0x80000000))) &&
+                len - 4 == tag_len && !memcmp(p + 12, tag, tag_len);
+        } else if (job < match_count && match[job]) {
+            fwrite(p + 4, 4 + len, 1, stdout);
+        }
+        p += 8 + len;
+    }
+    if (fflush(stdout) != 0) fail("write");
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char **argv) {
+    const char *tag = NULL;
+    char *end;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "l:x:")) != -1) {
+        switch (opt) {
+        case 'l':
+            flush_ms = strtol(optarg, &end, 10);
+            if (*end || end == optarg || flush_ms < 0) usage();
+            break;
+        case 'x':
+            tag = optarg;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (tag) {
+        if (argc - optind != 1) usage();
+        return extract(tag, argv[optind]);
+    }
+    if (argc - optind < 2) usage();
+    return collect(argv[optind], argv + optind + 1, argc - optind - 1);
+}
@@ -0,0 +1,685 @@
+// Usage: out+err-grep [-E] [-c] [-s out|err] [-j N] PATTERN [FILE]...
+//
+// Search captures (stdin by default) for lines of output containing
+// PATTERN, a literal string, or with -E an extended regular expression.
+// Lines split between chunks are reassembled, per stream, as by
+// out+err-cat.  Every hit is printed as
+//
+//   [FILE:]CHUNK:STREAM:OFFSET:LINE
+//
+// CHUNK being the ordinal of the chunk holding the first match in the
+// line (control records not counted), STREAM "out" or "err", OFFSET the
+// byte offset of the match in the stream.  Hits are printed in the order
+// lines were completed.  With -c, only the number of hits is printed.
+// With -s, only the given stream is searched.
+//
+// A capture file is mapped and split into N ranges (-j, the number of
+// CPUs by default) searched in parallel.  A range starts at the first
+// offset where a chain of valid chunk headers begins, which the range
+// before must end at; a range that doesn't is searched again from the
+// actual boundary.  Lines crossing ranges are searched once all ranges
+// are done.  Captures with repeats (--dedup) refer to earlier chunks,
+// they are searched by a single thread, repeats expanded.
+//
+// Literals are found with SSE2, comparing the first and the last byte
+// of PATTERN at 16 offsets at once, and confirming candidates.  Regular
+// expressions are matched with regexec() over runs of complete lines.
+// Lines longer than LINE_MAX_LEN are searched in pieces.
+#define _GNU_SOURCE 1
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <regex.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "capture.h"
+
+#define LINE_MAX_LEN (1 << 20)
+
+// Headers checked to accept a range start.
+#define CHAIN_LEN 32
+
+// Smallest range searched by a thread of its own.
+#define RANGE_MIN (4 << 20)
+
+static const char stream_names[2][4] = { "out", "err" };
+
+static const char *pattern;
+static size_t pattern_len;
+static int extended, count_only, only_stream = -1;
+
+// Chunk data of a stream appended to a line: the chunk ordinal and
+// stream offset at line offset 'at'.
+struct piece {
+    uint64_t chunk, offset;
+    size_t at;
+};
+
+struct line {
+    char *buf;
+    size_t len, size;
+    struct piece *pieces;
+    size_t pieces_len, pieces_size;
+};
+
+struct hit {
+    uint64_t done;   // ordinal of the chunk completing the line
+    uint64_t chunk, offset;
+    int stream;
+    size_t seq;
+    char *text;
+    size_t len;
+};
+
+struct worker {
+    pthread_t thread;
+    regex_t regex;
+    // Range: nominal start and end, the chunks found.
+    const char *start, *limit, *first, *end;
+    int valid;
+    // Relative to the first chunk of the range.
+    uint64_t chunks;
+    struct {
+        struct line line;    // incomplete
+        struct line head;    // completing a line from the range before
+        int headless;        // 'line' started in the range before
+        int broken;          // ... and was too long to keep
+        uint64_t head_done;
+        uint64_t offset;     // stream bytes
+    } streams[2];
+    struct hit *hits;
+    size_t hits_len, hits_size;
+};
+
+static int format;
+static const char *data_begin, *data_end;
+
+static void usage(void) {
+    fprintf(
+        stderr,
+        "Usage: %s [-E] [-c] [-s out|err] [-j N] PATTERN [FILE]...\n",
+        program_invocation_name
+    );
+    exit(2);
+}
+
+static void fail(const char *msg) __attribute__((noreturn));
+static void fail(const char *msg) {
+    fprintf(
+        stderr, "%s: %s: %s\n",
+        program_invocation_name, msg, strerror(errno)
+    );
+    exit(2);
+}
+
+static void *grow(void *p, size_t *size, size_t need, size_t elem) {
+    size_t n = *size ? *size : 16;
+    if (need <= *size) return p;
+    while (n < need) n *= 2;
+    if (!(p = realloc(p, n * elem))) fail("malloc");
+    *size = n;
+    return p;
+}
+
+// Literal search: candidates where both the first and the last byte of
+// the pattern match, 16 offsets at a time.
+static const char *find_literal(const char *p, const char *end) {
+    const size_t m = pattern_len;
+    if (!m) return p;
+    if ((size_t)(end - p) < m) return NULL;
+#ifdef __SSE2__
+    {
+        const __m128i first = _mm_set1_epi8(pattern[0]);
+        const __m128i last = _mm_set1_epi8(pattern[m - 1]);
+        unsigned mask;
+        while ((size_t)(end - p) >= m - 1 + 16) {
+            mask = _mm_movemask_epi8(_mm_and_si128(
+                _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), first),
+                _mm_cmpeq_epi8(
+                    _mm_loadu_si128((const __m128i *)(p + m - 1)), last
+                )
+            ));
+            while (mask) {
+                const char *c = p + __builtin_ctz(mask);
+                if (m <= 2 || !memcmp(c + 1, pattern + 1, m - 2)) return c;
+                mask &= mask - 1;
+            }
+            p += 16;
+        }
+    }
+#endif
+    return memmem(p, end - p, pattern, m);
+}
+
+// The first match in complete lines [@p, @end).
+static const char *find(regex_t *regex, const char *p, const char *end) {
+    regmatch_t match = { 0, end - p };
+    if (!extended) return find_literal(p, end);
+    if (regexec(regex, p, 1, &match, REG_STARTEND) != 0) return NULL;
+    return p + match.rm_so;
+}
+
+static void add_hit(
+    struct worker *w, int stream, uint64_t done, uint64_t chunk,
+    uint64_t offset, const char *text, size_t len
+) {
+    struct hit *h;
+    w->hits = grow(w->hits, &w->hits_size, w->hits_len + 1, sizeof *h);
+    h = &w->hits[w->hits_len];
+    h->done = done;
+    h->chunk = chunk;
+    h->offset = offset;
+    h->stream = stream;
+    h->seq = w->hits_len++;
+    h->len = len;
+    h->text = NULL;
+    if (count_only) return;
+    if (!(h->text = malloc(len))) fail("malloc");
+    memcpy(h->text, text, len);
+}
+
+// Search a reassembled line completed by chunk @done.
+static void search_line(
+    struct worker *w, int stream, struct line *l, uint64_t done
+) {
+    const char *m = find(&w->regex, l->buf, l->buf + l->len);
+    size_t at, i = 0;
+    if (!m) return;
+    at = m - l->buf;
+    while (i + 1 < l->pieces_len && l->pieces[i + 1].at <= at) ++i;
+    add_hit(
+        w, stream, done, l->pieces[i].chunk,
+        l->pieces[i].offset + at - l->pieces[i].at, l->buf, l->len
+    );
+}
+
+// Search complete lines [@p, @end) within chunk @chunk, @p being at
+// stream offset @offset.
+static void search_lines(
+    struct worker *w, int stream, const char *p, const char *end,
+    uint64_t chunk, uint64_t offset
+) {
+    const char *start = p, *m, *line, *next;
+    while (p < end && (m = find(&w->regex, p, end))) {
+        line = m;
+        while (line > p && line[-1] != '\n') --line;
+        next = memchr(m, '\n', end - m);
+        next = next ? next + 1 : end;
+        add_hit(
+            w, stream, chunk, chunk, offset + (m - start), line, next - line
+        );
+        p = next;
+    }
+}
+
+static void line_reset(struct line *l) {
+    l->len = 0;
+    l->pieces_len = 0;
+}
+
+static void line_free(struct line *l) {
+    free(l->buf);
+    free(l->pieces);
+    memset(l, 0, sizeof *l);
+}
+
+// A line in progress grown too long is searched as it is.
+static void line_overflow(struct worker *w, int stream, uint64_t chunk) {
+    typeof(w->streams[0]) *s = &w->streams[stream];
+    search_line(w, stream, &s->line, chunk);
+    line_reset(&s->line);
+    if (s->headless) {
+        s->headless = 0;
+        s->broken = 1;
+        s->head_done = chunk;
+    }
+}
+
+static void line_append(
+    struct worker *w, int stream, const char *p, size_t len,
+    uint64_t chunk, uint64_t offset
+) {
+    struct line *l = &w->streams[stream].line;
+    size_t n;
+    while (len) {
+        if (l->len == LINE_MAX_LEN) line_overflow(w, stream, chunk);
+        n = len < LINE_MAX_LEN - l->len ? len : LINE_MAX_LEN - l->len;
+        l->pieces = grow(
+            l->pieces, &l->pieces_size, l->pieces_len + 1, sizeof *l->pieces
+        );
+        l->pieces[l->pieces_len].chunk = chunk;
+        l->pieces[l->pieces_len].offset = offset;
+        l->pieces[l->pieces_len++].at = l->len;
+        l->buf = grow(l->buf, &l->size, l->len + n, 1);
+        memcpy(l->buf + l->len, p, n);
+        l->len += n;
+        p += n;
+        offset += n;
+        len -= n;
+    }
+}
+
+// The line in progress is complete.
+static void line_done(struct worker *w, int stream, uint64_t chunk) {
+    typeof(w->streams[0]) *s = &w->streams[stream];
+    struct line tmp;
+    if (s->headless) {
+        // Kept to be joined with the range before.
+        tmp = s->head;
+        s->head = s->line;
+        s->line = tmp;
+        s->headless = 0;
+        s->head_done = chunk;
+    } else {
+        search_line(w, stream, &s->line, chunk);
+    }
+    line_reset(&s->line);
+}
+
+static void search_chunk(
+    struct worker *w, int stream, const char *data, size_t len
+) {
+    typeof(w->streams[0]) *s = &w->streams[stream];
+    const uint64_t chunk = w->chunks++, offset = s->offset;
+    const char *end = data + len, *first, *last;
+    s->offset += len;
+    if (only_stream != -1 && stream != only_stream) return;
+    if (!(first = memchr(data, '\n', len))) {
+        line_append(w, stream, data, len, chunk, offset);
+        return;
+    }
+    line_append(w, stream, data, first + 1 - data, chunk, offset);
+    line_done(w, stream, chunk);
+    last = memrchr(first, '\n', end - first);
+    search_lines(
+        w, stream, first + 1, last + 1, chunk, offset + (first + 1 - data)
+    );
+    if (last + 1 < end) {
+        line_append(
+            w, stream, last + 1, end - last - 1, chunk,
+            offset + (last + 1 - data)
+        );
+    }
+}
+
+// Decode the record header at @p: returns its length, or 0 if it's no
+// valid header of a record ending by @end.
+static size_t decode(const char *p, int *kind, size_t *len) {
+    const unsigned char *u = (const unsigned char *)p;
+    const size_t avail = data_end - p;
+    uint64_t key = 0;
+    uint32_t header;
+    size_t n;
+    if (format == CAPTURE_CLASSIC) {
+        if (avail < 4) return 0;
+        memcpy(&header, p, 4);
+        header = ntohl(header);
+        *kind = header >> 31;
+        *len = header & UINT32_C(0x7fffffff);
+        return *len <= avail - 4 ? 4 : 0;
+    }
+    for (n = 0; n < avail && n < 10; ++n) {
+        key |= (uint64_t)(u[n] & 0x7f) << 7 * n;
+        if (!(u[n] & 0x80)) {
+            *kind = key & 3;
+            *len = key >> 2;
+            return *kind != 3 && *len <= CAPTURE_CHUNK_MAX &&
+                *len <= avail - n - 1 ? n + 1 : 0;
+        }
+    }
+    return 0;
+}
+
+// Whether a chain of valid records starts at @p.
+static int chain(const char *p) {
+    size_t hlen, len;
+    int i, kind;
+    for (i = 0; i < CHAIN_LEN && p != data_end; ++i) {
+        if (!(hlen = decode(p, &kind, &len))) return 0;
+        p += hlen + len;
+    }
+    return 1;
+}
+
+// Search records from w->first until one starts at or past w->limit.
+static void search_range(struct worker *w) {
+    const char *p = w->first;
+    size_t hlen, len;
+    int kind;
+    while (p < w->limit && p != data_end) {
+        if (!(hlen = decode(p, &kind, &len))) {
+            fprintf(
+                stderr, "%s: Invalid chunk header at offset %zu\n",
+                program_invocation_name, (size_t)(p - data_begin)
+            );
+            p = data_end;
+            break;
+        }
+        if (kind <= CAPTURE_STDERR) search_chunk(w, kind, p + hlen, len);
+        p += hlen + len;
+    }
+    w->end = p;
+}
+
+static void *worker_main(void *arg) {
+    struct worker *w = arg;
+    const char *p;
+    for (p = w->start; p < w->limit && !chain(p); ++p);
+    if ((w->valid = p < w->limit)) {
+        w->first = p;
+        search_range(w);
+    }
+    return NULL;
+}
+
+static void worker_init(struct worker *w, int headless) {
+    int i;
+    if (
+        extended &&
+        (i = regcomp(&w->regex, pattern, REG_EXTENDED | REG_NEWLINE))
+    ) {
+        char msg[256];
+        regerror(i, &w->regex, msg, sizeof msg);
+        fprintf(stderr, "%s: %s\n", program_invocation_name, msg);
+        exit(2);
+    }
+    for (i = 0; i < 2; ++i) w->streams[i].headless = headless;
+}
+
+static void worker_free(struct worker *w) {
+    size_t i;
+    for (i = 0; i < w->hits_len; ++i) free(w->hits[i].text);
+    free(w->hits);
+    for (i = 0; i < 2; ++i) {
+        line_free(&w->streams[i].line);
+        line_free(&w->streams[i].head);
+    }
+    if (extended) regfree(&w->regex);
+}
+
+// Search again, from the end of the range before.
+static void worker_redo(struct worker *w, const char *first) {
+    const char *start = w->start, *limit = w->limit;
+    worker_free(w);
+    memset(w, 0, sizeof *w);
+    worker_init(w, 1);
+    w->start = start;
+    w->limit = limit;
+    w->first = first;
+    w->valid = 1;
+    search_range(w);
+}
+
+static int cmp_hit(const void *a, const void *b) {
+    const struct hit *x = a, *y = b;
+    if (x->done != y->done) return x->done < y->done ? -1 : 1;
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+// Lines crossing ranges: 'carry' is the worker the lines in progress
+// are joined in, with chunk ordinals and offsets absolute.
+static void join(
+    struct worker *carry, struct worker *w, uint64_t chunks,
+    const uint64_t offsets[2]
+) {
+    const size_t hits_len = carry->hits_len;
+    struct line *src;
+    size_t i, j;
+    int s;
+    for (s = 0; s < 2; ++s) {
+        typeof(w->streams[0]) *ws = &w->streams[s];
+        // The worker's head, or all of its line if it has no newline.
+        src = ws->headless ? &ws->line : &ws->head;
+        for (i = 0; i < src->pieces_len; ++i) {
+            j = i + 1 < src->pieces_len ? src->pieces[i + 1].at : src->len;
+            line_append(
+                carry, s, src->buf + src->pieces[i].at,
+                j - src->pieces[i].at, chunks + src->pieces[i].chunk,
+                offsets[s] + src->pieces[i].offset
+            );
+        }
+        if (ws->headless) continue;
+        if (carry->streams[s].line.len) {
+            search_line(
+                carry, s, &carry->streams[s].line, chunks + ws->head_done
+            );
+        }
+        line_reset(&carry->streams[s].line);
+        src = &ws->line;
+        for (i = 0; i < src->pieces_len; ++i) {
+            j = i + 1 < src->pieces_len ? src->pieces[i + 1].at : src->len;
+            line_append(
+                carry, s, src->buf + src->pieces[i].at,
+                j - src->pieces[i].at, chunks + src->pieces[i].chunk,
+                offsets[s] + src->pieces[i].offset
+            );
+        }
+    }
+    // Hits of the joined lines go with the worker's.
+    for (i = hits_len; i < carry->hits_len; ++i) {
+        struct hit *h = &carry->hits[i];
+        w->hits = grow(
+            w->hits, &w->hits_size, w->hits_len + 1, sizeof *w->hits
+        );
+        h->done -= chunks;
+        h->chunk -= chunks;
+        h->offset -= offsets[h->stream];
+        h->seq = w->hits_len;
+        w->hits[w->hits_len++] = *h;
+    }
+    carry->hits_len = hits_len;
+}
+
+static size_t print_hits(
+    const char *path, struct worker *w, uint64_t chunks,
+    const uint64_t offsets[2]
+) {
+    size_t i;
+    qsort(w->hits, w->hits_len, sizeof *w->hits, cmp_hit);
+    if (count_only) return w->hits_len;
+    for (i = 0; i < w->hits_len; ++i) {
+        const struct hit *h = &w->hits[i];
+        if (path) printf("%s:", path);
+        printf(
+            "%llu:%s:%llu:", (unsigned long long)(chunks + h->chunk),
+            stream_names[h->stream],
+            (unsigned long long)(offsets[h->stream] + h->offset)
+        );
+        fwrite(h->text, 1, h->len, stdout);
+        if (!h->len || h->text[h->len - 1] != '\n') putchar('\n');
+    }
+    return w->hits_len;
+}
+
+// Search @data of @len bytes with @threads workers.  Returns the hits.
+static size_t search(
+    const char *path, const char *data, size_t len, unsigned threads
+) {
+    struct worker *workers, carry = { 0 };
+    uint64_t chunks = 0, offsets[2] = { 0, 0 };
+    size_t hits = 0;
+    unsigned i;
+    int err, s;
+
+    format = CAPTURE_CLASSIC;
+    data_begin = data;
+    data_end = data + len;
+    if (
+        len >= CAPTURE_FILE_HEADER_LEN &&
+        !memcmp(data, CAPTURE_MAGIC, CAPTURE_FILE_HEADER_LEN - 1)
+    ) {
+        format = CAPTURE_COMPACT;
+        data += CAPTURE_FILE_HEADER_LEN;
+        len -= CAPTURE_FILE_HEADER_LEN;
+    }
+    if (threads > len / RANGE_MIN + 1) threads = len / RANGE_MIN + 1;
+    if (!(workers = calloc(threads, sizeof *workers))) fail("malloc");
+    for (i = 0; i < threads; ++i) {
+        workers[i].start = data + len / threads * i;
+        workers[i].limit = i + 1 < threads ?
+            data + len / threads * (i + 1) : data_end + 1;
+        worker_init(&workers[i], i > 0);
+    }
+    // The first range starts at the first record, whatever follows.
+    workers[0].first = data;
+    workers[0].valid = 1;
+    for (i = 1; i < threads; ++i) {
+        if ((err = pthread_create(
+                &workers[i].thread, NULL, worker_main, &workers[i]
+            ))
+        ) {
+            errno = err;
+            fail("pthread_create");
+        }
+    }
+    search_range(&workers[0]);
+    for (i = 1; i < threads; ++i) pthread_join(workers[i].thread, NULL);
+
+    worker_init(&carry, 0);
+    for (i = 0; i < threads; ++i) {
+        struct worker *w = &workers[i];
+        if (i && (!w->valid || w->first != workers[i - 1].end)) {
+            worker_redo(w, workers[i - 1].end);
+        }
+        if (i) join(&carry, w, chunks, offsets);
+        hits += print_hits(path, w, chunks, offsets);
+        if (!i) {
+            // Its lines in progress are the first to carry.
+            for (s = 0; s < 2; ++s) {
+                struct line tmp = carry.streams[s].line;
+                carry.streams[s].line = w->streams[s].line;
+                w->streams[s].line = tmp;
+            }
+        }
+        chunks += w->chunks;
+        for (s = 0; s < 2; ++s) offsets[s] += w->streams[s].offset;
+        worker_free(w);
+    }
+    // Final lines lacking a newline.
+    for (s = 0; s < 2; ++s) {
+        if (carry.streams[s].line.len) {
+            search_line(&carry, s, &carry.streams[s].line, chunks);
+        }
+    }
+    hits += print_hits(path, &carry, 0, (uint64_t[2]){ 0, 0 });
+    worker_free(&carry);
+    free(workers);
+    return hits;
+}
+
+// Search a capture that can't be mapped, e.g. a pipe.
+static size_t search_stream(const char *path, int fd) {
+    struct capture capture;
+    struct capture_chunk chunk;
+    struct worker w = { 0 };
+    size_t hits;
+    int rc, s;
+    if (capture_open(&capture, fd) != 0) fail(path ? path : "-");
+    worker_init(&w, 0);
+    while ((rc = capture_next(&capture, &chunk)) > 0) {
+        search_chunk(&w, chunk.stream, chunk.data, chunk.len);
+    }
+    if (rc < 0) {
+        fprintf(
+            stderr, "%s: %s: %s\n",
+            program_invocation_name, path ? path : "-",
+            errno == EILSEQ ? "Truncated chunk" : strerror(errno)
+        );
+    }
+    for (s = 0; s < 2; ++s) {
+        if (w.streams[s].line.len) {
+            search_line(&w, s, &w.streams[s].line, w.chunks);
+        }
+    }
+    hits = print_hits(path, &w, 0, (uint64_t[2]){ 0, 0 });
+    worker_free(&w);
+    capture_close(&capture);
+    return hits;
+}
+
+static size_t grep(const char *path, int fd, unsigned threads) {
+    struct stat st;
+    char *map;
+    size_t hits;
+    if (fstat(fd, &st) != 0) fail(path ? path : "-");
+    if (!S_ISREG(st.st_mode)) return search_stream(path, fd);
+    if (!st.st_size) return 0;
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) return search_stream(path, fd);
+    if (
+        st.st_size >= CAPTURE_FILE_HEADER_LEN &&
+        !memcmp(map, CAPTURE_MAGIC, CAPTURE_FILE_HEADER_LEN - 1) &&
+        map[CAPTURE_FILE_HEADER_LEN - 1] & CAPTURE_DEDUP
+    ) {
+        munmap(map, st.st_size);
+        return search_stream(path, fd);
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    hits = search(path, map, st.st_size, threads);
+    munmap(map, st.st_size);
+    return hits;
+}
+
+int main(int argc, char **argv) {
+    const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned threads = cpus > 0 ? cpus : 1;
+    size_t hits = 0, n;
+    char *end;
+    int opt, fd, i, many;
+
+    while ((opt = getopt(argc, argv, "+Ecs:j:")) != -1) {
+        switch (opt) {
+        case 'E':
+            extended = 1;
+            break;
+        case 'c':
+            count_only = 1;
+            break;
+        case 's':
+            if (!strcmp(optarg, "out")) {
+                only_stream = CAPTURE_STDOUT;
+            } else if (!strcmp(optarg, "err")) {
+                only_stream = CAPTURE_STDERR;
+            } else {
+                usage();
+            }
+            break;
+        case 'j':
+            threads = strtoul(optarg, &end, 10);
+            if (*end || !threads) usage();
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind == argc) usage();
+    pattern = argv[optind++];
+    pattern_len = strlen(pattern);
+    if (!extended && memchr(pattern, '\n', pattern_len)) usage();
+    many = argc - optind > 1;
+
+    if (optind == argc) hits = grep(NULL, STDIN_FILENO, threads);
+    for (i = optind; i < argc; ++i) {
+        if ((fd = open(argv[i], O_RDONLY | O_CLOEXEC)) == -1) fail(argv[i]);
+        n = grep(many ? argv[i] : NULL, fd, threads);
+        if (count_only) {
+            if (many) printf("%s:", argv[i]);
+            printf("%zu\n", n);
+        }
+        hits += n;
+        close(fd);
+    }
+    if (optind == argc && count_only) printf("%zu\n", hits);
+    if (fflush(stdout) != 0) fail("write");
+    return hits ? 0 : 1;
+}
@@ -0,0 +1,146 @@
+// Usage: out+err-recover [-n] FILE...
+//
+// Truncate compact captures written with out+err --blocks after the
+// last intact block, e.g. once the host crashed or out+err was killed
+// mid-write, leaving a torn chunk or garbage at the end.  Prints
+//
+//   FILE: OFFSET (N bytes dropped)
+//
+// With -n, the file is left alone.
+//
+// Block trailers (CAPTURE_BLOCK, see capture.h) are searched for
+// backwards from the end of the file.  A trailer is accepted if the
+// CRC32C of the block before it matches and the block starts at the file
+// header or another trailer, so only the tail and the last block are
+// read, whatever the size of the capture.  Records after the last block
+// are dropped even if complete: they can't be told from garbage, e.g.
+// zeros in place of pages never written.
+#define _GNU_SOURCE 1
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "crc32c.h"
+
+static int dry_run;
+
+static void usage(void) {
+    fprintf(
+        stderr, "Usage: %s [-n] FILE...\n", program_invocation_name
+    );
+    exit(EXIT_FAILURE);
+}
+
+static int error(const char *path, const char *msg) {
+    fprintf(stderr, "%s: %s: %s\n", program_invocation_name, path, msg);
+    return -1;
+}
+
+// Whether a trailer starts at @off, after @header bytes of file header.
+static int trailer(
+    const char *map, size_t header, size_t off, uint64_t *len
+) {
+    uint32_t crc;
+    if (capture_block_decode(map + off, len, &crc) != 0) return 0;
+    return *len && *len <= off - header &&
+        crc32c(0, map + off - *len, *len) == crc;
+}
+
+// The end of the last intact block, or 0.
+static size_t last_block(const char *map, size_t size) {
+    const char key = CAPTURE_BLOCK_DATA_LEN << 2 | CAPTURE_CONTROL;
+    const size_t header = CAPTURE_FILE_HEADER_LEN;
+    const char *p;
+    size_t off, start;
+    uint64_t len, prev_len;
+    uint32_t prev_crc;
+    if (size < header + CAPTURE_BLOCK_LEN) return 0;
+    off = size - CAPTURE_BLOCK_LEN + 1;
+    while ((p = memrchr(map + header, key, off - header))) {
+        off = p - map;
+        if (!trailer(map, header, off, &len)) continue;
+        start = off - len;
+        if (
+            start == header || (
+                start >= header + CAPTURE_BLOCK_LEN &&
+                capture_block_decode(
+                    map + start - CAPTURE_BLOCK_LEN, &prev_len, &prev_crc
+                ) == 0
+            )
+        ) {
+            return off + CAPTURE_BLOCK_LEN;
+        }
+    }
+    return 0;
+}
+
+static int recover(const char *path) {
+    struct stat st;
+    char *map;
+    size_t end;
+    int fd;
+    if ((fd = open(path, (dry_run ? O_RDONLY : O_RDWR) | O_CLOEXEC)) == -1) {
+        return error(path, strerror(errno));
+    }
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return error(path, strerror(errno));
+    }
+    map = st.st_size ?
+        mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    if (map == MAP_FAILED) {
+        close(fd);
+        return error(path, st.st_size ? strerror(errno) : "Empty file");
+    }
+    if (
+        (size_t)st.st_size < CAPTURE_FILE_HEADER_LEN ||
+        memcmp(map, CAPTURE_MAGIC, CAPTURE_FILE_HEADER_LEN - 1)
+    ) {
+        munmap(map, st.st_size);
+        close(fd);
+        return error(path, "Not a compact capture");
+    }
+    end = last_block(map, st.st_size);
+    munmap(map, st.st_size);
+    if (!end) {
+        close(fd);
+        return error(path, "No intact block");
+    }
+    if (!dry_run && (size_t)st.st_size != end && ftruncate(fd, end) != 0) {
+        close(fd);
+        return error(path, strerror(errno));
+    }
+    close(fd);
+    printf(
+        "%s: %zu (%llu bytes dropped)\n",
+        path, end, (unsigned long long)st.st_size - end
+    );
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    int opt, i, status = EXIT_SUCCESS;
+
+    while ((opt = getopt(argc, argv, "n")) != -1) {
+        switch (opt) {
+        case 'n':
+            dry_run = 1;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind == argc) usage();
+
+    for (i = optind; i < argc; ++i) {
+        if (recover(argv[i]) != 0) status = EXIT_FAILURE;
+    }
+    return status;
+}
@@ -1,47 +1,232 @@
-// Usage: out+err [-o FILE] COMMAND [ARG]...
+// Usage: out+err [OPTION]... COMMAND [ARG]...
 //
 // Run COMMAND, combining chunks sent to STDOUT and STDERR into a single
 // file, preserving the relative order.  Every chunk starts with a
 // 4 byte header.  A header encodes the data size as a 32 bit big endian
 // number.  Only 31 lower bits are used.  The high bit is 0 for STDOUT,
 // 1 for STDERR.
+//
+// With --format=compact, headers are 1 byte for chunks under 32 bytes,
+// see capture.h.  With --merge, adjacent chunks of a stream received
+// together are stored as one, not preserving write boundaries.  With
+// --dedup, chunks repeating recent ones are stored as repeat records,
+// see output.c.  With --blocks, block trailers with a CRC32C are written
+// every SIZE bytes, for out+err-recover.  With --format=split, the
+// streams are written to FILE.out and FILE.err, as is, with an index of
+// their interleaving in FILE.idx, see capture.h.
+//
+// Chunks are received while available and then written with a single
+// writev().
+//
+// With -b, chunks are received into a SIZE bytes ring buffer by the main
+// thread and written out by a separate thread, so that the child keeps
+// running while a slow disk catches up.
+//
+// With -t, chunks are also passed through to the original stdout and
+// stderr of out+err, e.g. a terminal.  A slow terminal doesn't hold up
+// the capture, rather some output is not shown.
+//
+// With --rotate-size or --rotate-time, FILE is split into segments, see
+// segment.c.  SIGHUP rotates, or reopens FILE if not rotating.
+//
+// With --stats, counters kept by the master are written to a file, see
+// stats.c.
+//
+// With --latency, time from write() until chunks are received and
+// written is measured, see latency.c.
+//
+// With --sync, the capture files are synced by a separate thread with
+// group commit, see sync.c.
+//
+// Writes larger than a datagram are split into pieces by the helper and
+// reassembled here, see helper.h.
+//
+// With --transport=pipe, stdout and stderr are pipes instead, the
+// helper frames writes with sequence numbers, and chunks are spliced
+// from the pipes to FILE in sequence order, see helper.h.
+//
+// With --spin, the receiving thread polls the socket for a while before
+// blocking, see recv_chunk().  --cpu and --priority pin it and set its
+// scheduling priority.
+//
+// With --include or --exclude, chunks (or lines, with --filter-lines)
+// not wanted are dropped before anything is written, see filter.c.
+//
+// With --rate-limit or --size-limit, a stream flooding its output is
+// mostly dropped, see limit.c.
+//
+// With --hook=plt, the helper hooks writes by rewriting GOT entries
+// rather than patching libc code, see helper.h.
+//
+// With --collector, chunks are received and stored by a shared
+// out+err-collector instead, out+err merely waits for COMMAND.
+//
+// Run by a COMMAND of another out+err, capturing to stdout, out+err
+// hands the capture over to the outer master and merely waits for
+// COMMAND, and chunks from nested instances are stored as their records
+// here, see helper.h.
 #define _GNU_SOURCE 1
-#include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
 #include <poll.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/un.h>
 #include <sys/types.h>
 #include <sys/uio.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include "capture.h"
+#include "collector.h"
+#include "env.h"
+#include "filter.h"
+#include "helper.h"
+#include "latency.h"
+#include "limit.h"
+#include "lines.h"
+#include "output.h"
+#include "pieces.h"
+#include "probes.h"
+#include "ring.h"
+#include "segment.h"
+#include "stats.h"
+#include "sync.h"
+#include "tee.h"
+#include "thread.h"
+
+// Tee buffer size, chunks that don't fit are not shown.
+#define TEE_BUF_SIZE (4 << 20)
+
+// Chunks received before writing, unless the socket runs out of them.
+#define BATCH_SIZE (1 << 20)
+
+// Ring record tag of a reassembled chunk, stored elsewhere.
+#define RING_BIG 2
+
+// Pipe transport: pipe size, if allowed.
+#define PIPE_SIZE (1 << 20)
+
+// Spin receive: the polling window starts at SPIN_START_NS once
+// growing, and stops polling below it.
+#define SPIN_START_NS 2000
+
+// Chunks written at once when measuring latency, the write time being
+// recorded for each.
+#define LATENCY_BATCH 256
+
+// Nested: how long to wait for the outer master to accept a socket,
+// before capturing as usual, e.g. under out+err-collector.
+#define NEST_ACK_MS 500
+
+extern char **environ;
+
 static int master_sock;
 static volatile int child_status;
+static volatile sig_atomic_t child_exited;
+static const char *output_path;
+static int segmented;
+static struct sockaddr_un output_addr, error_addr;
+static socklen_t output_addrlen, error_addrlen;
+static struct pieces pieces;
+
+// Sockets of nested out+err instances, see helper.h: the stream of ours
+// their records are stored to, their COMMAND's stream and their format.
+// Kept until exit, autobound names are only reused after a while.
+struct nest {
+    struct sockaddr_un addr;
+    socklen_t addrlen;
+    int stream, sub, format;
+};
+static struct nest *nests;
+static size_t nests_count;
+
+// Spin receive: the maximum and current polling window (0 - blocking
+// right away).  Receiving thread tuning: CPU (-1 - any), nice value or
+// SCHED_FIFO priority.
+static uint64_t spin_max_ns, spin_ns;
+static int receiver_cpu = -1;
+static int receiver_nice, receiver_fifo;
 
 static void sigchld_handler(int sig) {
     const int errno_old = errno;
     int status;
+    pid_t pid;
     if (
-        waitpid(-1, &status, WNOHANG) > 0 &&
+        (pid = waitpid(-1, &status, WNOHANG)) > 0 &&
         (WIFEXITED(status) || WIFSIGNALED(status))
     ) {
+        PROBE2(child_exit, pid, status);
         child_status = status;
+        child_exited = 1;
         fcntl(master_sock, F_SETFL, O_NONBLOCK);
     }
     errno = errno_old;
 }
 
+static void sighup_handler(int sig) {
+    segment_reopen();
+}
+
+static void sigusr1_handler(int sig) {
+    stats_request();
+}
+
 static void usage(void) {
     fprintf(
-        stderr, "Usage: %s [-o FILE] COMMAND [ARG]...\n",
+        stderr,
+        "Usage: %s [OPTION]... COMMAND [ARG]...\n"
+        "  -o, --output=FILE      capture to FILE instead of stdout\n"
+        "  -b, --buffer=SIZE      buffer SIZE bytes, write in a thread\n"
+        "  -t, --tee              also pass output through (with -o)\n"
+        "  -F, --format=FORMAT    classic (default), compact, or split\n"
+        "                         into FILE.out, FILE.err and FILE.idx\n"
+        "  -m, --merge            merge adjacent chunks of a stream\n"
+        "      --dedup=N          store chunks repeating one of the last N\n"
+        "                         (up to 256) as repeats (compact only)\n"
+        "      --blocks=SIZE      write CRC32C block trailers every SIZE,\n"
+        "                         for out+err-recover (compact only)\n"
+        "      --rotate-size=SIZE start a new segment of FILE after SIZE\n"
+        "      --rotate-time=TIME start a new segment of FILE after TIME\n"
+        "      --keep=N           retain N rotated segments\n"
+        "      --collector=SOCKET hand output over to out+err-collector\n"
+        "      --job=TAG          job tag for out+err-collector\n"
+        "      --stats=FILE       write statistics to FILE at exit and on\n"
+        "                         SIGUSR1\n"
+        "      --stats-interval=TIME  also every TIME\n"
+        "      --latency=FILE     write latency histograms to FILE at exit\n"
+        "      --sync=POLICY      sync the capture: none (default), chunk,\n"
+        "                         interval:MS or bytes:SIZE\n"
+        "      --transport=TYPE   socket (default) or pipe\n"
+        "      --spin=USEC        poll for up to USEC before blocking\n"
+        "      --cpu=N            pin the receiving thread to CPU N\n"
+        "      --priority=PRIO    of the receiving thread: a nice value,\n"
+        "                         or fifo:N for SCHED_FIFO priority N\n"
+        "      --include=STRING   keep only chunks containing a STRING\n"
+        "      --exclude=STRING   drop chunks containing a STRING\n"
+        "      --filter-lines     filter lines rather than chunks\n"
+        "      --rate-limit=[out:|err:]SIZE  per second, of a stream or both\n"
+        "      --size-limit=[out:|err:]SIZE  in total\n"
+        "      --limit-keep=SIZE  of a flood, keep the first and last SIZE\n"
+        "                         (default 64K)\n"
+        "      --limit-sample=N   of a flood, keep every Nth chunk (default\n"
+        "                         1000, 0 - none)\n"
+        "      --hook=SPEC        hook writes by patching code (default) or\n"
+        "                         by rewriting the GOT: code, plt or e.g.\n"
+        "                         write=plt,writev=code\n"
+        "SIZE takes K, M or G suffix, TIME takes s, m, h or d suffix.\n",
         program_invocation_name
     );
     exit(EXIT_FAILURE);
@@ -56,24 +241,6 @@ static void fail(const char *msg) {
     exit(EXIT_FAILURE);
 }
 
-static int make_socket(struct sockaddr_un* addr, socklen_t *addrlen) {
-    int sock;
-    if ((sock = socket(AF_UNIX, SOCK_DGRAM, 0)) == -1) fail("socket");
-    addr->sun_family = AF_UNIX;
-    if (bind(
-            sock, (struct sockaddr*)addr,
-            offsetof(struct sockaddr_un, sun_path)
-        ) != 0
-    ) {
-        fail("bind");
-    }
-    *addrlen = sizeof(*addr);
-    if (getsockname(sock, (struct sockaddr*)addr, addrlen) != 0) {
-        fail("getsockname");
-    }
-    return sock;
-}
-
 static size_t recv_buf_size(void) {
     int v;
     socklen_t len = sizeof v;
@@ -85,70 +252,1284 @@ static size_t recv_buf_size(void) {
     return v;
 }
 
-static void set_ldpreload(void) {
+// Set the environment of the child as @vars says, see env.h.
+static void set_env(struct env_vars *vars) {
 #ifdef HELPER_SO
-    static char ldpreload_str[] = "LD_PRELOAD="HELPER_SO;
-    char *preload_list = getenv("LD_PRELOAD");
-    char *ldpreload = ldpreload_str;
-    if (preload_list) {
-        ldpreload = malloc(sizeof(ldpreload_str) + 1 + strlen(preload_list));
-        if (!ldpreload) fail("malloc");
-        sprintf(ldpreload, "%s:%s", ldpreload_str, preload_list);
-    }
-    if (putenv(ldpreload) != 0) fail("putenv");
+    vars->helper = HELPER_SO;
 #endif
+    if (!(environ = env_make(environ, vars))) fail("malloc");
 }
 
-static void set_stdiosock(const struct sockaddr_un *addr, socklen_t len) {
-    // autobound name in abstract namespace max 8 bytes
-    static char stdiosock[sizeof("STDIOSOCK=XXXXXXXX")];
-    sprintf(
-        stdiosock, "STDIOSOCK=%.*s",
-        (int)(len - offsetof(struct sockaddr_un, sun_path) - 1),
-        addr->sun_path + 1
+// Parse a size with an optional K, M or G suffix.
+static size_t parse_size(const char *str) {
+    char *end;
+    unsigned long long v;
+    errno = 0;
+    v = strtoull(str, &end, 10);
+    switch (*end) {
+    case 'G': v <<= 10; // fallthrough
+    case 'M': v <<= 10; // fallthrough
+    case 'K': v <<= 10; ++end;
+    }
+    if (errno || end == str || *end || v > SIZE_MAX) {
+        fprintf(
+            stderr, "%s: Invalid size '%s'\n", program_invocation_name, str
+        );
+        exit(EXIT_FAILURE);
+    }
+    return v;
+}
+
+// Parse seconds with an optional s, m, h or d suffix.
+static unsigned parse_time(const char *str) {
+    char *end;
+    unsigned long v;
+    errno = 0;
+    v = strtoul(str, &end, 10);
+    switch (*end) {
+    case 'd': v *= 24; // fallthrough
+    case 'h': v *= 60; // fallthrough
+    case 'm': v *= 60; // fallthrough
+    case 's': ++end;
+    }
+    if (errno || end == str || *end || v > UINT_MAX) {
+        fprintf(
+            stderr, "%s: Invalid time '%s'\n", program_invocation_name, str
+        );
+        exit(EXIT_FAILURE);
+    }
+    return v;
+}
+
+// Parse [out:|err:]SIZE, a limit of a stream or both.
+static void parse_limit(const char *str, uint64_t limit[2]) {
+    int from = 0, to = 1;
+    if (!strncmp(str, "out:", 4)) {
+        to = 0;
+        str += 4;
+    } else if (!strncmp(str, "err:", 4)) {
+        from = 1;
+        str += 4;
+    }
+    for (; from <= to; ++from) limit[from] = parse_size(str);
+}
+
+// The stream of a piece, by the socket named in it: 0 or 1, 2 + the
+// index of a nest, or -1.
+static int stream_name(const struct helper_piece *piece) {
+    const socklen_t len =
+        piece->name_len + offsetof(struct sockaddr_un, sun_path);
+    size_t i;
+    if (
+        len == output_addrlen &&
+        !memcmp(piece->name, output_addr.sun_path, piece->name_len)
+    ) {
+        return 0;
+    }
+    if (
+        len == error_addrlen &&
+        !memcmp(piece->name, error_addr.sun_path, piece->name_len)
+    ) {
+        return 1;
+    }
+    for (i = 0; i < nests_count; ++i) {
+        if (
+            len == nests[i].addrlen &&
+            !memcmp(piece->name, nests[i].addr.sun_path, piece->name_len)
+        ) {
+            return 2 + i;
+        }
+    }
+    return -1;
+}
+
+static struct nest *nest_find(
+    const struct sockaddr_un *addr, socklen_t addrlen
+) {
+    size_t i;
+    for (i = 0; i < nests_count; ++i) {
+        if (
+            addrlen == nests[i].addrlen &&
+            !memcmp(addr, &nests[i].addr, addrlen)
+        ) {
+            return &nests[i];
+        }
+    }
+    return NULL;
+}
+
+// Register a socket of a nested out+err from its struct helper_nest in
+// @buf, and send it back as the answer.
+static void nest_add(
+    const char *buf, size_t len, const struct sockaddr_un *addr,
+    socklen_t addrlen
+) {
+    struct helper_nest msg;
+    struct helper_piece named = { .name_len = 0 };
+    struct nest *n, *p;
+    int stream;
+    memcpy(&msg, buf, sizeof msg);
+    if (
+        msg.stream > 1 || msg.format > CAPTURE_COMPACT ||
+        msg.name_len > HELPER_PIECE_NAME_MAX
+    ) {
+        return;
+    }
+    named.name_len = msg.name_len;
+    memcpy(named.name, msg.name, msg.name_len);
+    // Its stdout is one of our streams.
+    if ((stream = stream_name(&named)) == -1 || stream > 1) return;
+    if (!(n = nest_find(addr, addrlen))) {
+        if (!(p = realloc(nests, (nests_count + 1) * sizeof *p))) {
+            fail("malloc");
+        }
+        nests = p;
+        n = &nests[nests_count++];
+        n->addr = *addr;
+        n->addrlen = addrlen;
+    }
+    n->stream = stream;
+    n->sub = msg.stream;
+    n->format = msg.format;
+    sendto(
+        master_sock, buf, len, MSG_DONTWAIT, (const struct sockaddr *)addr,
+        addrlen
     );
-    if (putenv(stdiosock) != 0) fail("putenv");
 }
 
-int main(int argc, char **argv) {
+// Make the @len bytes of data at @buf a record of the nest @n, its
+// header inserted before.  @buf has room for the header.
+static size_t nest_record(const struct nest *n, char *buf, size_t len) {
+    char header[CAPTURE_HEADER_MAX];
+    const size_t hlen = capture_header(header, n->format, n->sub, len);
+    memmove(buf + hlen, buf, len);
+    memcpy(buf, header, hlen);
+    return hlen + len;
+}
 
-    int opt, fd;
-    int output_sock, error_sock;
-    struct sockaddr_un master_addr, output_addr, error_addr;
-    socklen_t master_addrlen, output_addrlen, error_addrlen;
-    size_t msg_size_max;
-    void *msg_buf;
+// A chunk reassembled from pieces of a nest (@*stream 2 + its index)
+// becomes its record, of the nest's stream.
+static void nest_big(int *stream, char **big, size_t *len) {
+    const struct nest *n;
+    char *p;
+    if (*stream < 2) return;
+    n = &nests[*stream - 2];
+    if (!(p = realloc(*big, *len + CAPTURE_HEADER_MAX))) fail("malloc");
+    *big = p;
+    *len = nest_record(n, p, *len);
+    *stream = n->stream;
+}
+
+// Add a piece sent by the helper.  Returns the size of the chunk it
+// completes, stored in *@big, or -1.
+static ssize_t recv_piece(
+    const char *buf, size_t len, const struct sockaddr_un *addr,
+    socklen_t addrlen, int *stream, char **big
+) {
+    struct helper_piece piece;
+    size_t size;
+    memcpy(&piece, buf, sizeof piece);
+    if (
+        piece.name_len > HELPER_PIECE_NAME_MAX ||
+        (*stream = stream_name(&piece)) == -1
+    ) {
+        return -1;
+    }
+    switch (pieces_add(
+        &pieces, addr, addrlen, *stream, buf + sizeof piece,
+        len - sizeof piece, piece.flags & HELPER_PIECE_MORE, big, &size
+    )) {
+    case -1:
+        fail("malloc");
+    case 0:
+        return -1;
+    }
+    nest_big(stream, big, &size);
+    return size;
+}
+
+// Take a chunk left incomplete, as pieces_take().
+static int take_piece(int *stream, char **big, size_t *len) {
+    if (!pieces_take(&pieces, stream, big, len)) return 0;
+    nest_big(stream, big, len);
+    return 1;
+}
+
+// Adjust the polling window after blocking for @ns, as halt polling in
+// KVM does: grow it if polling a little longer would have caught the
+// chunk, shrink it after a long gap, so that an idle job costs no CPU.
+static void spin_tune(uint64_t ns) {
+    if (ns <= spin_max_ns) {
+        spin_ns = spin_ns ? 2 * spin_ns : SPIN_START_NS;
+        if (spin_ns > spin_max_ns) spin_ns = spin_max_ns;
+    } else if ((spin_ns /= 2) < SPIN_START_NS) {
+        spin_ns = 0;
+    }
+}
+
+// Receive a chunk into @buf and tell which @stream it came from (0 -
+// stdout, 1 - stderr) and when it was @sent, if measuring latency.
+// A chunk reassembled from pieces is stored in *@big (malloc'd)
+// instead, NULL otherwise.  Returns the chunk size, or -1 once the
+// child has exited and the socket is drained, or if there are no
+// chunks and @flags has MSG_DONTWAIT.
+//
+// With --spin, a blocking receive polls the socket for the current
+// window first, see spin_tune().
+static ssize_t recv_chunk(
+    void *buf, size_t size, int flags, int *stream, uint64_t *sent,
+    char **big
+) {
     struct sockaddr_un msg_addr;
     socklen_t msg_addrlen;
+    char cbuf[CMSG_SPACE(sizeof(struct timespec))];
+    // Room for the header of a nest's record, datagrams are smaller than
+    // the receive buffer anyway.
+    struct iovec iov = { buf, size - CAPTURE_HEADER_MAX };
+    struct nest *n;
+    struct msghdr mh = {
+        .msg_name = &msg_addr, .msg_iov = &iov, .msg_iovlen = 1
+    };
+    struct cmsghdr *cmsg;
     ssize_t rc;
+    uint32_t magic;
+    // Spinning: whether polling, since when, and since when blocking
+    // (0 - not yet).
+    const int tuning = spin_max_ns && !(flags & MSG_DONTWAIT);
+    int spin = tuning && spin_ns;
+    uint64_t spin_start = 0, block_start = tuning && !spin ? stats_now() : 0;
+    uint64_t now;
+    *big = NULL;
+    while (1) {
+        mh.msg_namelen = sizeof msg_addr;
+        if (latency_enabled) {
+            mh.msg_control = cbuf;
+            mh.msg_controllen = sizeof cbuf;
+        }
+        rc = recvmsg(master_sock, &mh, spin ? flags | MSG_DONTWAIT : flags);
+        msg_addrlen = mh.msg_namelen;
+        stats_add(&stats.recv_calls, 1);
+        if (rc < 0 && spin && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            now = stats_now();
+            if (!spin_start) spin_start = now;
+            if (now - spin_start < spin_ns && !child_exited) continue;
+            // Nothing within the window, block.
+            stats_add(&stats.spin_misses, 1);
+            stats_add(&stats.spin_ns, now - spin_start);
+            spin = 0;
+            block_start = now;
+            continue;
+        }
+        if (rc >= 0 && tuning) {
+            // Got something, account for the wait and start over.
+            if (block_start) {
+                spin_tune(stats_now() - block_start);
+            } else if (spin_start) {
+                stats_add(&stats.spin_hits, 1);
+                stats_add(&stats.spin_ns, stats_now() - spin_start);
+            }
+            spin = spin_ns != 0;
+            spin_start = 0;
+            block_start = spin ? 0 : stats_now();
+        }
+        if (rc < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                stats_add(&stats.recv_eagain, 1);
+                return -1;
+            }
+            if (errno == EINTR) {
+                stats_add(&stats.recv_eintr, 1);
+                continue;
+            }
+            fail("recvfrom");
+        }
+        if (
+            msg_addrlen == output_addrlen &&
+            !memcmp(&msg_addr, &output_addr, output_addrlen)
+        ) {
+            *stream = 0;
+        } else if (
+            msg_addrlen == error_addrlen &&
+            !memcmp(&msg_addr, &error_addr, error_addrlen)
+        ) {
+            *stream = 1;
+        } else if ((n = nest_find(&msg_addr, msg_addrlen))) {
+            *stream = n->stream;
+            rc = nest_record(n, buf, rc);
+        } else if (
+            rc >= (ssize_t)sizeof(struct helper_piece) &&
+            (memcpy(&magic, buf, sizeof magic), magic == HELPER_PIECE_MAGIC)
+        ) {
+            rc = recv_piece(buf, rc, &msg_addr, msg_addrlen, stream, big);
+            if (rc < 0) continue;
+        } else if (
+            rc == sizeof(struct helper_nest) &&
+            (memcpy(&magic, buf, sizeof magic), magic == HELPER_NEST_MAGIC)
+        ) {
+            nest_add(buf, rc, &msg_addr, msg_addrlen);
+            continue;
+        } else {
+            stats_control(buf, rc);
+            continue;
+        }
+        PROBE2(chunk_received, *stream, rc);
+        stats_chunk(*stream, rc);
+        stats_sample();
+        if (latency_enabled) {
+            uint64_t now = latency_now();
+            *sent = now;
+            for (
+                cmsg = CMSG_FIRSTHDR(&mh); cmsg;
+                cmsg = CMSG_NXTHDR(&mh, cmsg)
+            ) {
+                if (
+                    cmsg->cmsg_level == SOL_SOCKET &&
+                    cmsg->cmsg_type == SCM_TIMESTAMPNS
+                ) {
+                    struct timespec ts;
+                    memcpy(&ts, CMSG_DATA(cmsg), sizeof ts);
+                    *sent = ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+                }
+            }
+            latency_record(*stream, LATENCY_RECEIVED, *sent, now);
+        }
+        return rc;
+    }
+}
+
+// Pin the receiving thread and set its priority, as asked.  Warns
+// rather than fails, the child running already.
+static void tune_receiver(void) {
+    struct sched_param param = { .sched_priority = receiver_fifo };
+    cpu_set_t set;
+    int err;
+    if (receiver_cpu != -1) {
+        CPU_ZERO(&set);
+        CPU_SET(receiver_cpu, &set);
+        if ((err = pthread_setaffinity_np(pthread_self(), sizeof set, &set))) {
+            fprintf(
+                stderr, "%s: Pin to CPU %d: %s\n",
+                program_invocation_name, receiver_cpu, strerror(err)
+            );
+        }
+    }
+    if (
+        receiver_fifo &&
+        (err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param))
+    ) {
+        fprintf(
+            stderr, "%s: Set SCHED_FIFO priority: %s\n",
+            program_invocation_name, strerror(err)
+        );
+    }
+    // Per thread on Linux.
+    if (receiver_nice && setpriority(PRIO_PROCESS, 0, receiver_nice) != 0) {
+        fprintf(
+            stderr, "%s: Set nice value: %s\n",
+            program_invocation_name, strerror(errno)
+        );
+    }
+}
+
+// Connect to out+err-collector early, to fail before running the child.
+static int collector_connect(const char *name) {
+    struct sockaddr_un addr;
+    socklen_t addrlen;
+    int sock;
+    if (collector_addr(name, &addr, &addrlen) != 0) {
+        errno = ENAMETOOLONG;
+        fail(name);
+    }
+    if (
+        (sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) == -1 ||
+        connect(sock, (struct sockaddr *)&addr, addrlen) != 0
+    ) {
+        fail(name);
+    }
+    return sock;
+}
+
+// Hand the master socket over, see collector.h.
+static void collector_hello(int sock, const char *tag) {
+    struct collector_msg msg = {
+        .type = COLLECTOR_HELLO,
+        .hello = {
+            .output_addrlen = output_addrlen, .error_addrlen = error_addrlen,
+            .output_addr = output_addr, .error_addr = error_addr
+        }
+    };
+    char cbuf[CMSG_SPACE(sizeof(int))] = { 0 };
+    struct iovec iov = { &msg, sizeof msg };
+    struct msghdr mh = {
+        .msg_iov = &iov, .msg_iovlen = 1,
+        .msg_control = cbuf, .msg_controllen = sizeof cbuf
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &master_sock, sizeof(int));
+    snprintf(msg.hello.tag, sizeof msg.hello.tag, "%s", tag);
+    if (sendmsg(sock, &mh, MSG_NOSIGNAL) != sizeof msg) fail("sendmsg");
+}
+
+// Report the exit status and wait until chunks are stored.
+static void collector_exit(int sock, int status) {
+    struct collector_msg msg = { .type = COLLECTOR_EXIT, .status = status };
+    if (
+        send(sock, &msg, sizeof msg, MSG_NOSIGNAL) != sizeof msg ||
+        recv(sock, &msg, sizeof msg, 0) != sizeof msg ||
+        msg.type != COLLECTOR_ACK
+    ) {
+        fprintf(
+            stderr, "%s: Collector didn't confirm the output was stored\n",
+            program_invocation_name
+        );
+    }
+}
+
+// Under another out+err, capturing to our stdout, one of its sockets:
+// connect a socket per stream of COMMAND to its master and register
+// them, see helper.h.  Returns 0 once both were acknowledged, storing
+// them in @socks, or -1 to capture as usual.
+static int nest_connect(int format, int socks[2]) {
+    const char *stdiosock = getenv("STDIOSOCK");
+    const socklen_t name_off = offsetof(struct sockaddr_un, sun_path);
+    struct sockaddr_un outer = { .sun_family = AF_UNIX }, addr;
+    socklen_t outer_len, len = sizeof addr;
+    struct helper_nest msg, ack;
+    struct pollfd pfd = { .events = POLLIN };
+    int i;
+    if (!stdiosock || strlen(stdiosock) >= sizeof outer.sun_path) return -1;
+    // Autobound name in abstract namespace.
+    memcpy(outer.sun_path + 1, stdiosock, strlen(stdiosock));
+    outer_len = name_off + 1 + strlen(stdiosock);
+    if (
+        getpeername(STDOUT_FILENO, (struct sockaddr *)&addr, &len) != 0 ||
+        len != outer_len || memcmp(&addr, &outer, len) ||
+        (len = sizeof addr, getsockname(
+            STDOUT_FILENO, (struct sockaddr *)&addr, &len
+        )) != 0 ||
+        len <= name_off || len - name_off > HELPER_PIECE_NAME_MAX
+    ) {
+        return -1;
+    }
+    memset(&msg, 0, sizeof msg);
+    msg.magic = HELPER_NEST_MAGIC;
+    msg.format = format;
+    msg.name_len = len - name_off;
+    memcpy(msg.name, addr.sun_path, msg.name_len);
+    socks[0] = socks[1] = -1;
+    for (i = 0; i < 2; ++i) {
+        msg.stream = i;
+        if (
+            (socks[i] = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0)) == -1 ||
+            bind(socks[i], (struct sockaddr *)&outer, name_off) != 0 ||
+            connect(socks[i], (struct sockaddr *)&outer, outer_len) != 0 ||
+            send(socks[i], &msg, sizeof msg, 0) != sizeof msg
+        ) {
+            goto fail;
+        }
+        pfd.fd = socks[i];
+        if (
+            poll(&pfd, 1, NEST_ACK_MS) != 1 ||
+            recv(socks[i], &ack, sizeof ack, 0) != sizeof ack ||
+            memcmp(&ack, &msg, sizeof msg)
+        ) {
+            goto fail;
+        }
+    }
+    return 0;
+
+fail:
+    for (i = 0; i < 2; ++i) {
+        if (socks[i] != -1) close(socks[i]);
+    }
+    return -1;
+}
+
+// Run COMMAND @argv with its stdout and stderr the nest sockets @socks,
+// and wait for it.  Returns its wait status.
+static int nest_run(char **argv, int format, const char *hook, int socks[2]) {
+    char header[CAPTURE_FILE_HEADER_LEN];
+    pid_t pid;
     int status;
+    // The start of our capture, as output_start() would write.
+    if (
+        format == CAPTURE_COMPACT &&
+        write(STDOUT_FILENO, header, capture_file_header(header, 0)) < 0
+    ) {
+        fail("write");
+    }
+    switch (pid = fork()) {
+    case -1:
+        fail("fork");
+    case 0:
+        if (
+            dup3(socks[0], STDOUT_FILENO, 0) != STDOUT_FILENO ||
+            dup3(socks[1], STDERR_FILENO, 0) != STDERR_FILENO
+        ) {
+            fail("Redirect stdout/stderr");
+        }
+        // STDIOSOCK and the rest are the outer master's.
+        set_env(&(struct env_vars){ .hook = hook });
+        execvp(argv[0], argv);
+        fprintf(
+            stderr, "%s: Failed to run '%s': %s\n",
+            program_invocation_name, argv[0], strerror(errno)
+        );
+        exit(EXIT_FAILURE);
+    }
+    close(socks[0]);
+    close(socks[1]);
+    while (waitpid(pid, &status, 0) != pid) {
+        if (errno != EINTR) fail("waitpid");
+    }
+    PROBE2(child_exit, pid, status);
+    return status;
+}
+
+// Exit as COMMAND did.
+static int exit_status(int status) {
+    if (WIFSIGNALED(status)) {
+        kill(getpid(), WTERMSIG(status));
+    }
+    return WEXITSTATUS(status);
+}
+
+static struct ring ring;
+static uint64_t ring_sent[RING_SLOTS];
+static int tee_mode;
+static unsigned dedup;
+// Pipe transport: chunks copied to user space rather than spliced.
+static int pipe_copy;
+
+// Chunks queued for writing, if measuring latency.
+static struct { int stream; uint64_t sent; } pending[LATENCY_BATCH];
+static unsigned pending_count;
+
+static void flush(void) {
+    uint64_t now;
+    unsigned i;
+    output_flush();
+    if (!pending_count) return;
+    now = latency_now();
+    for (i = 0; i < pending_count; ++i) {
+        latency_record(
+            pending[i].stream, LATENCY_WRITTEN, pending[i].sent, now
+        );
+    }
+    pending_count = 0;
+}
+
+// Lines being reassembled, with --filter-lines, and a line joined from
+// its parts.
+static struct lines lines;
+static int filter_lines;
+static char *line_buf;
+static size_t line_size;
+
+// Store a chunk kept by the filters.  Returns whether it was stored
+// rather than dropped over a limit.
+static int store(int stream, const char *p, size_t len) {
+    if (limit_enabled && !limit_check(stream, len)) {
+        limit_drop(stream, p, len);
+        return 0;
+    }
+    output_chunk(stream, p, len);
+    return 1;
+}
 
-    while ((opt = getopt(argc, argv, "+o:")) != -1) {
+static void filtered(size_t len) {
+    stats_add(&stats.filtered_chunks, 1);
+    stats_add(&stats.filtered_bytes, len);
+}
+
+static void filter_line(
+    void *ctx, int stream, const struct iovec *iov, int iovcnt
+) {
+    const size_t len = iov[0].iov_len + (iovcnt > 1 ? iov[1].iov_len : 0);
+    if (!filter_check(iov, iovcnt)) {
+        filtered(len);
+        return;
+    }
+    if (iovcnt == 1) {
+        store(stream, iov[0].iov_base, len);
+        return;
+    }
+    // Joined and written at once, the incomplete line buffer is reused
+    // before output_flush().
+    if (len > line_size) {
+        free(line_buf);
+        if (!(line_buf = malloc(len))) fail("malloc");
+        line_size = len;
+    }
+    memcpy(line_buf, iov[0].iov_base, iov[0].iov_len);
+    memcpy(line_buf + iov[0].iov_len, iov[1].iov_base, iov[1].iov_len);
+    store(stream, line_buf, len);
+    output_flush();
+}
+
+static void chunk(int stream, const char *p, size_t len, uint64_t sent) {
+    struct iovec iov = { (void *)p, len };
+    if (tee_mode) tee_chunk(stream, p, len);
+    if (filter_lines) {
+        if (lines_feed(&lines, stream, p, len) != 0) fail("malloc");
+    } else if (filter_enabled && !filter_check(&iov, 1)) {
+        filtered(len);
+        return;
+    } else if (!store(stream, p, len)) {
+        return;
+    }
+    if (latency_enabled) {
+        pending[pending_count].stream = stream;
+        pending[pending_count].sent = sent;
+        if (++pending_count == LATENCY_BATCH) flush();
+    }
+}
+
+// Write a chunk reassembled from pieces, on its own as it's freed.
+static void big_chunk(int stream, char *p, size_t len, uint64_t sent) {
+    flush();
+    chunk(stream, p, len, sent);
+    flush();
+    free(p);
+}
+
+// Ring record of a reassembled chunk.
+struct big { char *p; size_t len; };
+
+static void *ring_writer(void *arg) {
+    uint32_t tail = 0, n, i;
+    struct big big;
+    while ((n = ring_peek(&ring, tail, -1))) {
+        for (i = 0; i < n; ++i) {
+            const struct ring_slot *s = ring_slot(&ring, tail + i);
+            const uint64_t sent = ring_sent[(tail + i) % RING_SLOTS];
+            if (s->tag & RING_BIG) {
+                memcpy(&big, ring_data(&ring, s), sizeof big);
+                big_chunk(s->tag & ~RING_BIG, big.p, big.len, sent);
+            } else {
+                chunk(s->tag, ring_data(&ring, s), s->len, sent);
+            }
+        }
+        flush();
+        ring_release(&ring, tail += n);
+    }
+    return NULL;
+}
+
+static void ring_commit_big(char *p, struct big big, int stream) {
+    memcpy(p, &big, sizeof big);
+    ring_commit(&ring, sizeof big, stream | RING_BIG);
+}
+
+static void ring_receive(size_t msg_size_max) {
+    pthread_t writer;
+    uint32_t head = 0;
+    struct big big;
+    ssize_t rc;
+    int err, stream;
+
+    if (ring_init(&ring, ring.size, msg_size_max) != 0) fail("malloc");
+    if (thread_start(&writer, ring_writer) != 0) fail("pthread_create");
+    tune_receiver();
+
+    while (1) {
+        char *p = ring_reserve(&ring, msg_size_max, 1);
+        rc = recv_chunk(
+            p, msg_size_max, 0, &stream, &ring_sent[head % RING_SLOTS],
+            &big.p
+        );
+        if (rc < 0) break;
+        if (big.p) {
+            big.len = rc;
+            ring_commit_big(p, big, stream);
+        } else {
+            ring_commit(&ring, rc, stream);
+        }
+        // Stamps follow the records committed.
+        ++head;
+    }
+    while (take_piece(&stream, &big.p, &big.len)) {
+        ring_sent[head++ % RING_SLOTS] = latency_enabled ? latency_now() : 0;
+        ring_commit_big(ring_reserve(&ring, sizeof big, 1), big, stream);
+    }
+
+    ring_close(&ring);
+    if ((err = pthread_join(writer, NULL))) {
+        errno = err;
+        fail("pthread_join");
+    }
+}
+
+// Pipe transport, see helper.h.
+struct pipe_in {
+    int fd, stream;
+    int eof, raw;
+    size_t have;               // frame header bytes read
+    struct helper_frame frame;
+};
+
+static struct pipe_in pipe_in[2];
+static int pipe_fds[2][2], page_fd;
+static char *copy_buf;
+static size_t copy_size;
+
+static void pipe_setup(void) {
+    struct helper_pipe_page *page;
+    pthread_mutexattr_t attr;
+    struct stat st;
+    int i;
+    if (
+        (page_fd = memfd_create("out+err", MFD_CLOEXEC)) == -1 ||
+        ftruncate(page_fd, sizeof *page) != 0
+    ) {
+        fail("memfd_create");
+    }
+    page = mmap(
+        NULL, sizeof *page, PROT_READ | PROT_WRITE, MAP_SHARED, page_fd, 0
+    );
+    if (page == MAP_FAILED) fail("mmap");
+    if (
+        (errno = pthread_mutexattr_init(&attr)) ||
+        (errno = pthread_mutexattr_setpshared(
+            &attr, PTHREAD_PROCESS_SHARED
+        )) ||
+        (errno = pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST)) ||
+        (errno = pthread_mutex_init(&page->lock, &attr))
+    ) {
+        fail("pthread_mutex_init");
+    }
+    for (i = 0; i < 2; ++i) {
+        if (
+            pipe2(pipe_fds[i], O_CLOEXEC) != 0 ||
+            fstat(pipe_fds[i][0], &st) != 0 ||
+            fcntl(pipe_fds[i][0], F_SETFL, O_NONBLOCK) != 0
+        ) {
+            fail("pipe");
+        }
+        // Best effort, the limit is /proc/sys/fs/pipe-max-size.
+        fcntl(pipe_fds[i][1], F_SETPIPE_SZ, PIPE_SIZE);
+        page->dev = st.st_dev;
+        page->ino[i] = st.st_ino;
+        pipe_in[i].fd = pipe_fds[i][0];
+        pipe_in[i].stream = i;
+    }
+    page->magic = HELPER_PIPE_MAGIC;
+}
+
+static char *copy_reserve(size_t len) {
+    if (len > copy_size) {
+        free(copy_buf);
+        if (!(copy_buf = malloc(len))) fail("malloc");
+        copy_size = len;
+    }
+    return copy_buf;
+}
+
+// Read @len bytes from a pipe, waiting for them.  Returns fewer if the
+// pipe was closed.
+static size_t pipe_read(int fd, char *p, size_t len) {
+    struct pollfd pfd = { fd, POLLIN };
+    size_t total = 0;
+    ssize_t rc;
+    while (total < len) {
+        rc = read(fd, p + total, len - total);
+        stats_add(&stats.recv_calls, 1);
+        if (rc == 0) break;
+        if (rc < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                poll(&pfd, 1, -1);
+                continue;
+            }
+            if (errno == EINTR) continue;
+            fail("read");
+        }
+        total += rc;
+    }
+    return total;
+}
+
+// Data not framed by the helper, e.g. written by a static binary, is
+// stored as read, without ordering.
+static void pipe_raw(struct pipe_in *in, const char *p, size_t len) {
+    if (!in->raw) {
+        fprintf(
+            stderr, "%s: Unframed %s, order is lost\n",
+            program_invocation_name, in->stream ? "stderr" : "stdout"
+        );
+        in->raw = 1;
+    }
+    if (!len) return;
+    stats_chunk(in->stream, len);
+    chunk(in->stream, p, len, 0);
+    flush();
+}
+
+// Read what is available of the next frame header.  Returns whether
+// anything was read.
+static int pipe_fill(struct pipe_in *in) {
+    char *p = (char *)&in->frame;
+    ssize_t rc;
+    if (in->eof || in->have == sizeof in->frame) return 0;
+    if (in->raw) {
+        p = copy_reserve(BATCH_SIZE);
+        rc = read(in->fd, p, BATCH_SIZE);
+    } else {
+        rc = read(in->fd, p + in->have, sizeof in->frame - in->have);
+    }
+    stats_add(&stats.recv_calls, 1);
+    if (rc < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            stats_add(&stats.recv_eagain, 1);
+            return 0;
+        }
+        if (errno == EINTR) return 0;
+        fail("read");
+    }
+    if (in->raw) {
+        in->eof = !rc;
+        pipe_raw(in, p, rc);
+        return 1;
+    }
+    if (!rc) {
+        in->eof = 1;
+        if (in->have) pipe_raw(in, p, in->have);
+        in->have = 0;
+        return 1;
+    }
+    if (
+        (in->have += rc) == sizeof in->frame &&
+        in->frame.magic != HELPER_FRAME_MAGIC
+    ) {
+        pipe_raw(in, p, in->have);
+        in->have = 0;
+    }
+    return 1;
+}
+
+// The frame due: numbered @next, otherwise the earliest one if the
+// other pipe can't have it, or @any.
+static struct pipe_in *pipe_due(uint64_t next, int any) {
+    struct pipe_in *p = NULL, *other = NULL;
+    int i;
+    for (i = 0; i < 2; ++i) {
+        if (pipe_in[i].have != sizeof pipe_in[i].frame) continue;
+        if (!p || pipe_in[i].frame.seq < p->frame.seq) p = &pipe_in[i];
+    }
+    if (!p) return NULL;
+    other = &pipe_in[p == pipe_in];
+    if (
+        p->frame.seq == next || any || other->eof || other->raw ||
+        other->have == sizeof other->frame
+    ) {
+        return p;
+    }
+    return NULL;
+}
+
+static void pipe_chunk(struct pipe_in *in) {
+    const size_t len = in->frame.len;
+    char *p;
+    size_t n;
+    in->have = 0;
+    PROBE2(chunk_received, in->stream, len);
+    stats_chunk(in->stream, len);
+    stats_sample();
+    if (!pipe_copy && (!limit_enabled || limit_check(in->stream, len))) {
+        output_splice(in->stream, in->fd, len);
+        return;
+    }
+    // Passed through, filtered, deduplicated, checksummed or dropped, so
+    // copied to user space after all.
+    p = copy_reserve(len);
+    n = pipe_read(in->fd, p, len);
+    memset(p + n, 0, len - n);
+    if (pipe_copy) {
+        chunk(in->stream, p, len, 0);
+    } else {
+        limit_drop(in->stream, p, len);
+    }
+    flush();
+}
+
+// Helper reports, see stats_control().
+static void recv_control(void) {
+    char buf[sizeof(struct helper_stats)];
+    ssize_t rc;
+    while (
+        (rc = recv(master_sock, buf, sizeof buf, MSG_DONTWAIT | MSG_TRUNC))
+            >= 0
+    ) {
+        stats_control(buf, rc);
+    }
+}
+
+static void pipe_receive(void) {
+    struct pollfd pfd[3];
+    struct pipe_in *due;
+    sigset_t mask, old;
+    uint64_t next = 0;
+    int i, n, progress;
+
+    tune_receiver();
+    // Unblocked only while waiting, not to miss the child exiting.
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &old);
+    while (1) {
+        for (progress = 0, i = 0; i < 2; ++i) {
+            progress |= pipe_fill(&pipe_in[i]);
+        }
+        if ((due = pipe_due(next, 0))) {
+            next = due->frame.seq + 1;
+            pipe_chunk(due);
+            continue;
+        }
+        recv_control();
+        if (
+            (pipe_in[0].eof && pipe_in[1].eof) ||
+            (child_exited && !progress)
+        ) {
+            break;
+        }
+        if (progress) continue;
+        flush();
+        for (n = 0, i = 0; i < 2; ++i) {
+            if (
+                !pipe_in[i].eof &&
+                pipe_in[i].have != sizeof pipe_in[i].frame
+            ) {
+                pfd[n].fd = pipe_in[i].fd;
+                pfd[n++].events = POLLIN;
+            }
+        }
+        pfd[n].fd = master_sock;
+        pfd[n++].events = POLLIN;
+        ppoll(pfd, n, NULL, &old);
+    }
+    // Frames left by descendants still running.
+    while ((due = pipe_due(next, 1))) {
+        next = due->frame.seq + 1;
+        pipe_chunk(due);
+    }
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    flush();
+}
+
+static void receive(size_t msg_size_max) {
+    const size_t size =
+        2 * msg_size_max > BATCH_SIZE ? 2 * msg_size_max : BATCH_SIZE;
+    char *buf, *big;
+    size_t used = 0, len;
+    uint64_t sent;
+    ssize_t rc;
+    int stream;
+
+    if (!(buf = malloc(size))) fail("malloc");
+    tune_receiver();
+    while (1) {
+        if (size - used < msg_size_max) {
+            flush();
+            used = 0;
+        }
+        // Block only with nothing to write.
+        rc = recv_chunk(
+            buf + used, msg_size_max, used ? MSG_DONTWAIT : 0,
+            &stream, &sent, &big
+        );
+        if (rc < 0) {
+            if (!used) break;
+            flush();
+            used = 0;
+            continue;
+        }
+        if (big) {
+            big_chunk(stream, big, rc, sent);
+            used = 0;
+            continue;
+        }
+        chunk(stream, buf + used, rc, sent);
+        used += rc;
+    }
+    while (take_piece(&stream, &big, &len)) {
+        big_chunk(stream, big, len, latency_enabled ? latency_now() : 0);
+    }
+    free(buf);
+}
+
+int main(int argc, char **argv) {
+
+    static const struct option options[] = {
+        { "output",      required_argument, NULL, 'o' },
+        { "buffer",      required_argument, NULL, 'b' },
+        { "tee",         no_argument,       NULL, 't' },
+        { "format",      required_argument, NULL, 'F' },
+        { "merge",       no_argument,       NULL, 'm' },
+        { "dedup",       required_argument, NULL, 'D' },
+        { "blocks",      required_argument, NULL, 'B' },
+        { "rotate-size", required_argument, NULL, 'S' },
+        { "rotate-time", required_argument, NULL, 'T' },
+        { "keep",        required_argument, NULL, 'K' },
+        { "collector",   required_argument, NULL, 'C' },
+        { "job",         required_argument, NULL, 'J' },
+        { "stats",       required_argument, NULL, 's' },
+        { "stats-interval", required_argument, NULL, 'I' },
+        { "latency",     required_argument, NULL, 'L' },
+        { "sync",        required_argument, NULL, 'Y' },
+        { "transport",   required_argument, NULL, 'P' },
+        { "hook",        required_argument, NULL, 'H' },
+        { "spin",        required_argument, NULL, 'W' },
+        { "cpu",         required_argument, NULL, 'U' },
+        { "priority",    required_argument, NULL, 'R' },
+        { "include",     required_argument, NULL, 'i' },
+        { "exclude",     required_argument, NULL, 'x' },
+        { "filter-lines", no_argument,      NULL, 'l' },
+        { "rate-limit",  required_argument, NULL, 'A' },
+        { "size-limit",  required_argument, NULL, 'Z' },
+        { "limit-keep",  required_argument, NULL, 'E' },
+        { "limit-sample", required_argument, NULL, 'N' },
+        { NULL }
+    };
+    int opt;
+    char *end;
+    long prio, ms;
+    size_t num;
+    int format = CAPTURE_CLASSIC, flags = 0;
+    struct segment_opts segment_opts = { 0 };
+    struct limit_opts limit_opts = { .keep = 64 << 10, .sample = 1000 };
+    struct sync_opts sync_opts = { SYNC_NONE };
+    int limits = 0, filters = 0;
+    size_t block_size = 0;
+    const char *collector = NULL, *job = NULL;
+    const char *stats_path = NULL, *latency_path = NULL, *hook = NULL;
+    unsigned stats_interval = 0;
+    char job_buf[COLLECTOR_TAG_MAX];
+    int collector_sock;
+    pid_t pid;
+    int output_sock, error_sock;
+    int out_fd, err_fd; // the child's ends, then the sampled ones
+    struct env_vars vars = { 0 };
+    char pipe_path[sizeof("/proc/4294967295/fd/2147483647")];
+    int pipe_transport = 0;
+    int nest_socks[2];
+    struct sockaddr_un master_addr;
+    socklen_t master_addrlen;
+    size_t msg_size_max;
+    int status;
+
+    while ((opt = getopt_long(argc, argv, "+o:b:tF:m", options, NULL)) != -1) {
         switch (opt) {
         case 'o':
-            fd = open(
-                optarg, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0600
-            );
-            if (fd == -1 || dup3(fd, STDOUT_FILENO, 0) != STDOUT_FILENO) {
-                fprintf(
-                    stderr, "%s: %s: %s\n",
-                    program_invocation_name, optarg, strerror(errno)
-                );
-                exit(EXIT_FAILURE);
+            output_path = optarg;
+            break;
+        case 'b':
+            ring.size = parse_size(optarg);
+            break;
+        case 't':
+            tee_mode = 1;
+            break;
+        case 'F':
+            if (!strcmp(optarg, "classic")) {
+                format = CAPTURE_CLASSIC;
+            } else if (!strcmp(optarg, "compact")) {
+                format = CAPTURE_COMPACT;
+            } else if (!strcmp(optarg, "split")) {
+                format = CAPTURE_SPLIT;
+            } else {
+                usage();
+            }
+            break;
+        case 'm':
+            flags |= CAPTURE_MERGED;
+            break;
+        case 'D':
+            num = parse_size(optarg);
+            if (!num || num > CAPTURE_REPEAT_WINDOW) usage();
+            dedup = num;
+            break;
+        case 'B':
+            if (!(block_size = parse_size(optarg))) usage();
+            break;
+        case 'S':
+            segment_opts.rotate_size = parse_size(optarg);
+            break;
+        case 'T':
+            segment_opts.rotate_time = parse_time(optarg);
+            break;
+        case 'K':
+            segment_opts.keep = parse_size(optarg);
+            break;
+        case 'C':
+            collector = optarg;
+            break;
+        case 'J':
+            job = optarg;
+            break;
+        case 's':
+            stats_path = optarg;
+            break;
+        case 'I':
+            stats_interval = parse_time(optarg);
+            break;
+        case 'L':
+            latency_path = optarg;
+            break;
+        case 'P':
+            if (!strcmp(optarg, "socket")) {
+                pipe_transport = 0;
+            } else if (!strcmp(optarg, "pipe")) {
+                pipe_transport = 1;
+            } else {
+                usage();
+            }
+            break;
+        case 'H':
+            hook = optarg;
+            break;
+        case 'Y':
+            if (!strcmp(optarg, "none")) {
+                sync_opts.policy = SYNC_NONE;
+            } else if (!strcmp(optarg, "chunk")) {
+                sync_opts.policy = SYNC_CHUNK;
+            } else if (!strncmp(optarg, "interval:", 9)) {
+                sync_opts.policy = SYNC_INTERVAL;
+                errno = 0;
+                ms = strtol(optarg + 9, &end, 10);
+                if (
+                    errno || end == optarg + 9 || *end || ms <= 0 ||
+                    ms > UINT_MAX
+                ) {
+                    usage();
+                }
+                sync_opts.arg = ms;
+            } else if (!strncmp(optarg, "bytes:", 6)) {
+                sync_opts.policy = SYNC_BYTES;
+                if (!(sync_opts.arg = parse_size(optarg + 6))) usage();
+            } else {
+                usage();
+            }
+            break;
+        case 'i':
+        case 'x':
+            if (!*optarg) usage();
+            filter_add(optarg, opt == 'x');
+            filters = 1;
+            break;
+        case 'l':
+            filter_lines = 1;
+            break;
+        case 'A':
+            parse_limit(optarg, limit_opts.rate);
+            limits = 1;
+            break;
+        case 'Z':
+            parse_limit(optarg, limit_opts.size);
+            limits = 1;
+            break;
+        case 'E':
+            limit_opts.keep = parse_size(optarg);
+            break;
+        case 'N':
+            if ((num = parse_size(optarg)) > UINT_MAX) usage();
+            limit_opts.sample = num;
+            break;
+        case 'W':
+            spin_max_ns = parse_size(optarg) * 1000;
+            break;
+        case 'U':
+            if ((num = parse_size(optarg)) >= CPU_SETSIZE) usage();
+            receiver_cpu = num;
+            break;
+        case 'R':
+            if (!strncmp(optarg, "fifo:", 5)) {
+                receiver_fifo = parse_size(optarg + 5);
+                if (receiver_fifo < 1 || receiver_fifo > 99) usage();
+            } else {
+                errno = 0;
+                prio = strtol(optarg, &end, 10);
+                if (
+                    errno || end == optarg || *end || prio < -20 || prio > 19
+                ) {
+                    usage();
+                }
+                receiver_nice = prio;
             }
             break;
         default:
             usage();
         }
     }
-    if (optind >= argc) usage();
+    if (
+        optind >= argc ||
+        (!output_path && (
+            tee_mode || segment_opts.rotate_size || segment_opts.rotate_time ||
+            format == CAPTURE_SPLIT
+        )) ||
+        (format == CAPTURE_SPLIT && (
+            segment_opts.rotate_size || segment_opts.rotate_time
+        )) ||
+        (flags && format != CAPTURE_COMPACT) ||
+        (dedup && (format != CAPTURE_COMPACT || flags)) ||
+        (block_size && format != CAPTURE_COMPACT) ||
+        (stats_interval && !stats_path) ||
+        (filter_lines && !filters) ||
+        (pipe_transport && (
+            collector || ring.size || latency_path || spin_max_ns
+        )) ||
+        (collector && (
+            output_path || ring.size || format || flags || stats_path ||
+            latency_path || spin_max_ns || receiver_cpu != -1 ||
+            receiver_nice || receiver_fifo || limits || filters || dedup ||
+            block_size || sync_opts.policy
+        ))
+    ) {
+        usage();
+    }
+
+    // Capturing to stdout as is: hand it over if under out+err.
+    if (
+        !output_path && !collector && !ring.size && !pipe_transport &&
+        !flags && !dedup && !block_size && !limits && !filters &&
+        !stats_path && !latency_path && !spin_max_ns &&
+        receiver_cpu == -1 && !receiver_nice && !receiver_fifo &&
+        !sync_opts.policy && nest_connect(format, nest_socks) == 0
+    ) {
+        return exit_status(nest_run(argv + optind, format, hook, nest_socks));
+    }
+
+    segmented = output_path && format != CAPTURE_SPLIT;
+    if (segmented) {
+        if (segment_open(output_path, &segment_opts) == -1) {
+            fprintf(
+                stderr, "%s: %s: %s\n",
+                program_invocation_name, output_path, strerror(errno)
+            );
+            exit(EXIT_FAILURE);
+        }
+    }
 
-    master_sock = make_socket(&master_addr, &master_addrlen);
-    output_sock = make_socket(&output_addr, &output_addrlen);
-    error_sock  = make_socket(&error_addr,  &error_addrlen);
+    if (
+        (master_sock = env_socket(&master_addr, &master_addrlen)) == -1 ||
+        (output_sock = env_socket(&output_addr, &output_addrlen)) == -1 ||
+        (error_sock = env_socket(&error_addr, &error_addrlen)) == -1
+    ) {
+        fail("socket");
+    }
 
     msg_size_max = recv_buf_size();
-    if (!(msg_buf = malloc(msg_size_max))) fail("malloc");
+
+    if (latency_path) {
+        int on = 1;
+        if (
+            setsockopt(master_sock, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof on)
+                != 0
+        ) {
+            fail("setsockopt");
+        }
+        latency_start(latency_path);
+    }
 
     if (
         connect(
@@ -161,23 +1542,49 @@ int main(int argc, char **argv) {
         fail("connect");
     }
 
-    if (signal(SIGCHLD, sigchld_handler) != 0) fail("signal");
+    out_fd = output_sock;
+    err_fd = error_sock;
+    if (pipe_transport) {
+        pipe_setup();
+        out_fd = pipe_fds[0][1];
+        err_fd = pipe_fds[1][1];
+    }
 
-    switch (fork()) {
+    if (collector) {
+        collector_sock = collector_connect(collector);
+    } else if (signal(SIGCHLD, sigchld_handler) != 0) {
+        fail("signal");
+    }
+
+    switch (pid = fork()) {
     case -1:
         fail("fork");
     case 0:
         if (
             close(master_sock) != 0 ||
-            dup3(output_sock, STDOUT_FILENO, 0) != STDOUT_FILENO ||
+            dup3(out_fd, STDOUT_FILENO, 0) != STDOUT_FILENO ||
             close(output_sock) != 0 ||
-            dup3(error_sock, STDERR_FILENO, 0) != STDERR_FILENO ||
+            dup3(err_fd, STDERR_FILENO, 0) != STDERR_FILENO ||
             close(error_sock) != 0
         ) {
             fail("Redirect stdout/stderr");
         }
-        set_ldpreload();
-        set_stdiosock(&master_addr, master_addrlen);
+        vars.addr = &master_addr;
+        vars.addrlen = master_addrlen;
+        vars.pieces = !collector;
+        if (pipe_transport) {
+            // See helper.h.
+            snprintf(
+                pipe_path, sizeof pipe_path, "/proc/%d/fd/%d",
+                (int)getppid(), page_fd
+            );
+            vars.pipe = pipe_path;
+        }
+        vars.hook = hook;
+        if (stats_path) {
+            vars.stats = stats_interval ? stats_interval * 1000 : 1000;
+        }
+        set_env(&vars);
         execvp(argv[optind], argv + optind);
         fprintf(
             stderr, "%s: Failed to run '%s': %s\n",
@@ -186,55 +1593,88 @@ int main(int argc, char **argv) {
         return EXIT_FAILURE;
     }
 
-    while (1) {
-        uint32_t header;
-        struct iovec iov[2];
-        msg_addrlen = sizeof msg_addr;
-        rc = recvfrom(
-            master_sock, msg_buf, msg_size_max, 0,
-            (struct sockaddr*)&msg_addr, &msg_addrlen
-        );
-        if (rc < 0) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
-            if (errno == EINTR) continue;
-            fail("recvfrom");
+    if (collector) {
+        if (!job) {
+            snprintf(
+                job_buf, sizeof job_buf, "%s[%d]",
+                basename(argv[optind]), (int)pid
+            );
+            job = job_buf;
         }
+        collector_hello(collector_sock, job);
+        close(master_sock);
+        while (waitpid(pid, &status, 0) != pid) {
+            if (errno != EINTR) fail("waitpid");
+        }
+        PROBE2(child_exit, pid, status);
+        collector_exit(collector_sock, status);
+        child_status = status;
+    }
+
+    if (pipe_transport) {
+        // For EOF once the child and its descendants are done.
+        close(pipe_fds[0][1]);
+        close(pipe_fds[1][1]);
+        out_fd = pipe_fds[0][0];
+        err_fd = pipe_fds[1][0];
+    }
+
+    // In the parent only, so that the child inherits SIGHUP disposition,
+    // e.g. nohup.  Split files aren't reopened.
+    if (
+        output_path &&
+        signal(SIGHUP, segmented ? sighup_handler : SIG_IGN) == SIG_ERR
+    ) {
+        fail("signal");
+    }
+
+    if (stats_path) {
         if (
-            msg_addrlen == output_addrlen &&
-            !memcmp(&msg_addr, &output_addr, output_addrlen)
+            stats_start(stats_path, stats_interval, out_fd, err_fd)
+                != 0
         ) {
-            header = htonl(rc);
-        } else if (
-            msg_addrlen == error_addrlen &&
-            !memcmp(&msg_addr, &error_addr, error_addrlen)
-        ) {
-            header = htonl(UINT32_C(0x80000000) | rc);
-        } else {
-            continue;
-        }
-        iov[0].iov_base = &header;
-        iov[0].iov_len = 4;
-        iov[1].iov_base = msg_buf;
-        iov[1].iov_len = rc;
-        while (iov[0].iov_len) {
-            rc = writev(STDOUT_FILENO, iov, 2);
-            if (rc < 0) {
-                if (errno == EINTR) continue;
-                fail("writev");
-            }
-            while (rc && iov[0].iov_len <= rc) {
-                rc -= iov[0].iov_len;
-                iov[0] = iov[1];
-                iov[1].iov_len = 0;
-            }
-            iov[0].iov_base += rc;
-            iov[0].iov_len -= rc;
+            fail("stats");
         }
+        if (signal(SIGUSR1, sigusr1_handler) == SIG_ERR) fail("signal");
     }
 
-    status = child_status;
-    if (WIFSIGNALED(status)) {
-        kill(getpid(), WTERMSIG(status));
+    if (
+        tee_mode &&
+        tee_start(STDOUT_FILENO, STDERR_FILENO, TEE_BUF_SIZE, msg_size_max)
+            != 0
+    ) {
+        fail("tee");
     }
-    return WEXITSTATUS(status);
+
+    if (collector) {
+        // Done already.
+    } else {
+        if (dedup) output_dedup(dedup);
+        if (block_size) output_blocks(block_size);
+        if (sync_opts.policy && sync_start(&sync_opts) != 0) fail("sync");
+        if (format == CAPTURE_SPLIT) output_split(output_path);
+        output_start(format, flags, segmented);
+        pipe_copy = tee_mode || filters || dedup || block_size;
+        if (limits) limit_start(&limit_opts, format);
+        if (filters) filter_compile();
+        if (filter_lines) lines_init(&lines, filter_line, NULL);
+        if (pipe_transport) {
+            pipe_receive();
+        } else if (ring.size) {
+            ring_receive(msg_size_max);
+        } else {
+            receive(msg_size_max);
+        }
+        if (filter_lines) lines_finish(&lines);
+        if (limits) limit_finish();
+        output_finish();
+        sync_finish();
+    }
+
+    if (tee_mode) tee_finish();
+    if (segmented) segment_close();
+    stats_finish();
+    if (latency_path && latency_report() != 0) fail(latency_path);
+
+    return exit_status(child_status);
 }
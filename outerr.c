@@ -0,0 +1,312 @@
+// The capture of a child: its stdout and stderr are sockets connected to
+// the master socket, told apart by address, as in out+err.  The child is
+// started with posix_spawn(), i.e. vfork() in glibc and musl, so that
+// spawning from a large host doesn't copy its page tables.  Its exit is
+// seen through a pidfd, polled along with the master socket by way of an
+// epoll instance of the capture, which is outerr_fd(), and it is waited
+// for by the pidfd too, not to reap another child of the host.
+//
+// Chunks are received into a buffer of the capture and passed on from
+// there.  Writes larger than a datagram are split by the helper and
+// reassembled (pieces.c), and then passed from their own buffer.
+#define _GNU_SOURCE 1
+#include <errno.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "env.h"
+#include "helper.h"
+#include "outerr.h"
+#include "pieces.h"
+
+// Chunks passed per outerr_read() call at most, so that a busy child
+// doesn't hold up the others.
+#define READ_BATCH 256
+
+extern char **environ;
+
+struct outerr {
+    pid_t pid;
+    int sock, pidfd, epfd;
+    int exited, done, status;
+    struct sockaddr_un addr[2]; // stdout, stderr
+    socklen_t addrlen[2];
+    struct pieces pieces;
+    char *buf;
+    size_t size;
+};
+
+static void destroy(struct outerr *o) {
+    const int saved_errno = errno;
+    int stream;
+    char *data;
+    size_t size;
+    while (pieces_take(&o->pieces, &stream, &data, &size)) free(data);
+    if (o->sock != -1) close(o->sock);
+    if (o->pidfd != -1) close(o->pidfd);
+    if (o->epfd != -1) close(o->epfd);
+    free(o->buf);
+    free(o);
+    errno = saved_errno;
+}
+
+struct outerr *outerr_spawn(
+    char *const argv[], const struct outerr_opts *opts
+) {
+    static const struct outerr_opts default_opts;
+    struct outerr *o;
+    struct sockaddr_un master_addr;
+    socklen_t master_addrlen;
+    posix_spawn_file_actions_t actions;
+    struct epoll_event ev = { .events = EPOLLIN };
+    struct env_vars vars = { .pieces = 1 };
+    char **env;
+    int socks[2] = { -1, -1 }, v, i, err;
+    socklen_t len = sizeof v;
+
+    if (!opts) opts = &default_opts;
+    if (!(o = calloc(1, sizeof *o))) return NULL;
+    o->pidfd = o->epfd = -1;
+    if ((o->sock = env_socket(&master_addr, &master_addrlen)) == -1) {
+        goto fail;
+    }
+    for (i = 0; i < 2; ++i) {
+        if (
+            (socks[i] = env_socket(&o->addr[i], &o->addrlen[i])) == -1 ||
+            connect(
+                socks[i], (struct sockaddr *)&master_addr, master_addrlen
+            ) != 0
+        ) {
+            goto fail;
+        }
+    }
+    if (getsockopt(o->sock, SOL_SOCKET, SO_RCVBUF, &v, &len) != 0) {
+        goto fail;
+    }
+    o->size = v;
+    if (!(o->buf = malloc(o->size))) goto fail;
+
+    vars.helper = opts->helper;
+#ifdef HELPER_SO
+    if (!vars.helper) vars.helper = HELPER_SO;
+#endif
+    vars.addr = &master_addr;
+    vars.addrlen = master_addrlen;
+    vars.hook = opts->hook;
+    if (!(env = env_make(opts->envp ? opts->envp : environ, &vars))) {
+        goto fail;
+    }
+    // The sockets are close-on-exec, their copies aren't.
+    if (!(err = posix_spawn_file_actions_init(&actions))) {
+        if (
+            !(err = posix_spawn_file_actions_adddup2(
+                &actions, socks[0], STDOUT_FILENO
+            )) &&
+            !(err = posix_spawn_file_actions_adddup2(
+                &actions, socks[1], STDERR_FILENO
+            ))
+        ) {
+            err = posix_spawnp(&o->pid, argv[0], &actions, NULL, argv, env);
+        }
+        posix_spawn_file_actions_destroy(&actions);
+    }
+    free(env);
+    if (err) {
+        errno = err;
+        goto fail;
+    }
+    close(socks[0]);
+    close(socks[1]);
+    socks[0] = socks[1] = -1;
+
+    o->pidfd = syscall(SYS_pidfd_open, o->pid, 0);
+    if (o->pidfd == -1 && errno == ESRCH) {
+        // Gone already, reaped by the host: its chunks are all queued.
+        o->exited = 1;
+        o->status = -1;
+    }
+    if (
+        (o->pidfd == -1 && !o->exited) ||
+        (o->epfd = epoll_create1(EPOLL_CLOEXEC)) == -1 ||
+        epoll_ctl(o->epfd, EPOLL_CTL_ADD, o->sock, &ev) != 0 ||
+        (o->pidfd != -1 && epoll_ctl(
+            o->epfd, EPOLL_CTL_ADD, o->pidfd, &ev
+        ) != 0)
+    ) {
+        // Started already, don't leave it running uncaptured.
+        err = errno;
+        kill(o->pid, SIGKILL);
+        while (waitpid(o->pid, NULL, 0) == -1 && errno == EINTR);
+        destroy(o);
+        errno = err;
+        return NULL;
+    }
+    return o;
+
+fail:
+    for (i = 0; i < 2; ++i) {
+        if (socks[i] != -1) close(socks[i]);
+    }
+    destroy(o);
+    return NULL;
+}
+
+pid_t outerr_pid(const struct outerr *o) {
+    return o->pid;
+}
+
+int outerr_fd(const struct outerr *o) {
+    return o->epfd;
+}
+
+// The stream of a piece, by the socket named in it, or -1.
+static int piece_stream(const struct outerr *o, const char *buf) {
+    struct helper_piece piece;
+    int i;
+    memcpy(&piece, buf, sizeof piece);
+    for (i = 0; i < 2 && piece.name_len <= HELPER_PIECE_NAME_MAX; ++i) {
+        if (
+            piece.name_len + offsetof(struct sockaddr_un, sun_path) ==
+                o->addrlen[i] &&
+            !memcmp(piece.name, o->addr[i].sun_path, piece.name_len)
+        ) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Pass a chunk received from @addr on, reassembling pieces.
+static int dispatch(
+    struct outerr *o, ssize_t len, const struct sockaddr_un *addr,
+    socklen_t addrlen, outerr_fn *fn, void *ctx
+) {
+    struct helper_piece piece;
+    uint32_t magic;
+    char *data;
+    size_t size;
+    int i;
+    for (i = 0; i < 2; ++i) {
+        if (addrlen == o->addrlen[i] && !memcmp(addr, &o->addr[i], addrlen)) {
+            fn(ctx, i, o->buf, len);
+            return 0;
+        }
+    }
+    // Anything else but pieces, e.g. helper stats, is ignored.
+    if (
+        len < (ssize_t)sizeof piece ||
+        (memcpy(&magic, o->buf, sizeof magic), magic != HELPER_PIECE_MAGIC) ||
+        (i = piece_stream(o, o->buf)) == -1
+    ) {
+        return 0;
+    }
+    memcpy(&piece, o->buf, sizeof piece);
+    switch (pieces_add(
+        &o->pieces, addr, addrlen, i, o->buf + sizeof piece,
+        len - sizeof piece, piece.flags & HELPER_PIECE_MORE, &data, &size
+    )) {
+    case -1:
+        return -1;
+    case 1:
+        fn(ctx, i, data, size);
+        free(data);
+    }
+    return 0;
+}
+
+// The wait status of the child, as waitpid() stores it, from @info.
+static int wait_status(const siginfo_t *info) {
+    switch (info->si_code) {
+    case CLD_EXITED:
+        return (info->si_status & 0xff) << 8;
+    case CLD_DUMPED:
+        return info->si_status | 0x80;
+    default:
+        return info->si_status;
+    }
+}
+
+// Reap the child by its pidfd, so that no other child is, waiting for
+// it unless @nohang.  If the host reaped it, e.g. ignoring SIGCHLD, it
+// has exited all the same, with the status unknown: -1.  Returns 0 or
+// -1 (errno set).
+static int reap(struct outerr *o, int nohang) {
+    siginfo_t info;
+    info.si_pid = 0;
+    if (
+        waitid(
+            P_PIDFD, o->pidfd, &info, WEXITED | (nohang ? WNOHANG : 0)
+        ) != 0
+    ) {
+        if (errno != ECHILD) return -1;
+        o->exited = 1;
+        o->status = -1;
+    } else if (info.si_pid) {
+        o->exited = 1;
+        o->status = wait_status(&info);
+    }
+    return 0;
+}
+
+int outerr_read(struct outerr *o, outerr_fn *fn, void *ctx) {
+    struct sockaddr_un addr;
+    struct iovec iov = { o->buf, o->size };
+    struct msghdr mh = { .msg_name = &addr, .msg_iov = &iov, .msg_iovlen = 1 };
+    ssize_t rc;
+    int n, stream;
+    char *data;
+    size_t size;
+
+    if (o->done) return 0;
+    // Once it has exited, chunks sent by the child are all queued.
+    if (!o->exited && reap(o, 1) != 0 && errno != EINTR) return -1;
+    for (n = 0; n < READ_BATCH; ++n) {
+        mh.msg_namelen = sizeof addr;
+        rc = recvmsg(o->sock, &mh, MSG_DONTWAIT);
+        if (rc < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+            if (!o->exited) return 1;
+            // Chunks left incomplete, e.g. the writer was killed midway.
+            while (pieces_take(&o->pieces, &stream, &data, &size)) {
+                fn(ctx, stream, data, size);
+                free(data);
+            }
+            o->done = 1;
+            return 0;
+        }
+        if (dispatch(o, rc, &addr, mh.msg_namelen, fn, ctx) != 0) return -1;
+    }
+    return 1;
+}
+
+int outerr_free(struct outerr *o, int *status) {
+    int rc = 0;
+    // No more reads, a child still writing gets ECONNREFUSED rather than
+    // blocking.
+    close(o->sock);
+    o->sock = -1;
+    while (!o->exited && reap(o, 0) != 0) {
+        if (errno != EINTR) {
+            rc = -1;
+            break;
+        }
+    }
+    if (!rc && o->status == -1) {
+        errno = ECHILD;
+        rc = -1;
+    }
+    if (status) *status = o->status;
+    destroy(o);
+    return rc;
+}
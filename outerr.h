@@ -0,0 +1,65 @@
+// libouterr: capture the stdout and stderr of child processes from
+// within a program, as out+err does, without running out+err.
+//
+// outerr_spawn() starts COMMAND with the helper library preloaded, its
+// stdout and stderr connected to a socket of the capture, and
+// outerr_read() hands chunks to a callback in the relative order they
+// were written, each from the receive buffer, without copying.  Nothing
+// blocks and no signals are used: outerr_fd() is to be polled for
+// input, e.g. added to the host's epoll set, so that a single thread
+// captures many children.
+//
+//     struct outerr *o = outerr_spawn(argv, NULL);
+//     struct pollfd pfd = { outerr_fd(o), POLLIN };
+//     while (outerr_read(o, fn, ctx) > 0) poll(&pfd, 1, -1);
+//     outerr_free(o, &status);
+//
+// A capture is used by one thread at a time.  Linux 5.4 or later
+// (pidfd_open, waitid P_PIDFD).  Link with -louterr; C++ wrapper in
+// outerr.hpp.
+#pragma once
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct outerr;
+
+// Called with a chunk written by the child to @stream (0 - stdout,
+// 1 - stderr), valid until the callback returns.
+typedef void outerr_fn(void *ctx, int stream, const char *data, size_t len);
+
+struct outerr_opts {
+    const char *helper; // helper library path, NULL - the installed one
+    const char *hook;   // STDIOHOOK, see helper.h, NULL - the default
+    char *const *envp;  // the child's environment, NULL - environ
+};
+
+// Start @argv[0], searched for in PATH, with @opts (may be NULL).
+// Returns NULL on failure, errno set.
+struct outerr *outerr_spawn(char *const argv[], const struct outerr_opts *opts);
+
+// The child's PID.
+pid_t outerr_pid(const struct outerr *o);
+
+// A file descriptor readable when there are chunks to read or once the
+// child has exited.
+int outerr_fd(const struct outerr *o);
+
+// Pass the chunks available, up to a batch, to @fn.  Returns 1 if the
+// child may write more, 0 once it has exited and all of its chunks were
+// passed, or -1 on failure (errno set).
+int outerr_read(struct outerr *o, outerr_fn *fn, void *ctx);
+
+// Wait for the child, unless outerr_read() saw it exit already, and
+// release the capture.  Stores the wait status in *@status (may be
+// NULL).  Chunks not read are dropped.  Returns 0, or -1 (errno set),
+// ECHILD if the host reaped the child, e.g. ignoring SIGCHLD.
+int outerr_free(struct outerr *o, int *status);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,105 @@
+// C++ wrapper of outerr.h, header-only (C++17).
+//
+//     libouterr::capture c({"make", "-j8"});
+//     struct pollfd pfd = { c.fd(), POLLIN };
+//     while (c.read([](int stream, std::string_view data) { ... })) {
+//         poll(&pfd, 1, -1);
+//     }
+//     int status = c.wait();
+//
+// Failures throw std::system_error.  An exception thrown by the callback
+// is rethrown by read() as is, once outerr_read() has returned; the
+// remaining chunks of that batch are skipped.
+#pragma once
+
+#include <cerrno>
+#include <exception>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include "outerr.h"
+
+namespace libouterr {
+
+class capture {
+public:
+    explicit capture(
+        const std::vector<std::string> &args,
+        const outerr_opts *opts = nullptr
+    ) {
+        std::vector<char *> argv;
+        for (const std::string &arg : args) {
+            argv.push_back(const_cast<char *>(arg.c_str()));
+        }
+        argv.push_back(nullptr);
+        if (!(o_ = outerr_spawn(argv.data(), opts))) fail("outerr_spawn");
+    }
+
+    capture(capture &&other) noexcept : o_(std::exchange(other.o_, nullptr))
+    {}
+
+    capture &operator=(capture &&other) noexcept {
+        std::swap(o_, other.o_);
+        return *this;
+    }
+
+    capture(const capture &) = delete;
+    capture &operator=(const capture &) = delete;
+
+    // Waits for the child, as outerr_free() does, unless waited for.
+    ~capture() {
+        if (o_) outerr_free(o_, nullptr);
+    }
+
+    pid_t pid() const { return outerr_pid(o_); }
+    int fd() const { return outerr_fd(o_); }
+
+    // Pass the chunks available to @fn(int stream, std::string_view).
+    // Returns false once the child has exited and all were passed.
+    template <class F> bool read(F &&fn) {
+        struct call {
+            F &fn;
+            std::exception_ptr error;
+            static void trampoline(
+                void *ctx, int stream, const char *data, size_t len
+            ) {
+                call *c = static_cast<call *>(ctx);
+                if (c->error) return;
+                try {
+                    c->fn(stream, std::string_view(data, len));
+                } catch (...) {
+                    c->error = std::current_exception();
+                }
+            }
+        } c{fn, nullptr};
+        int rc = outerr_read(o_, &call::trampoline, &c);
+        if (c.error) std::rethrow_exception(c.error);
+        if (rc < 0) fail("outerr_read");
+        return rc > 0;
+    }
+
+    // Wait for the child and release the capture.  Returns the wait
+    // status.  Throws with EINVAL if moved from or waited for already.
+    int wait() {
+        int status;
+        if (!o_) {
+            errno = EINVAL;
+            fail("wait");
+        }
+        int rc = outerr_free(std::exchange(o_, nullptr), &status);
+        if (rc != 0) fail("outerr_free");
+        return status;
+    }
+
+private:
+    [[noreturn]] static void fail(const char *what) {
+        throw std::system_error(errno, std::generic_category(), what);
+    }
+
+    outerr *o_;
+};
+
+} // namespace libouterr
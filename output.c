@@ -0,0 +1,563 @@
+// Chunks are queued as iovecs pointing at the received data, and
+// written with a single writev() per batch.  With CAPTURE_MERGED, a
+// run of chunks of a stream becomes a single record; its header is
+// filled in once the run ends.  Every segment starts with a file
+// header.
+//
+// With deduplication, a chunk equal to one of the last `window` ones
+// starts a repeat, counted while the following chunks repeat those
+// after it, and stored as a CAPTURE_REPEAT record when a chunk doesn't
+// or at output_flush().  Candidates are found by a hash of the chunk,
+// in an index of the latest chunk per hash bucket, then compared; the
+// last chunks are copied, as the received data doesn't stay around.
+// Segments only start with a batch then, so that repeats don't refer to
+// chunks of the previous segment.
+//
+// With blocks, the CRC32C of every batch is computed before writing it,
+// and a CAPTURE_BLOCK trailer is appended to the first batch completing
+// a block of the size, or written on its own before a new segment and
+// at exit.
+//
+// Split, the chunks of every stream are queued as iovecs of their own,
+// and written with a writev() per stream and batch, followed by the
+// index entries of the batch: one per stream switch, and one for the
+// run at the end of the batch, so that all the data written is indexed.
+//
+// Chunks from the pipe transport are spliced from the pipe.  splice()
+// fails on an output opened with O_APPEND or a terminal, they are
+// copied through a buffer from then on.
+#define _GNU_SOURCE 1
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "crc32c.h"
+#include "output.h"
+#include "probes.h"
+#include "segment.h"
+#include "stats.h"
+#include "sync.h"
+
+static int format, flags, segmented;
+static int cur_fd = STDOUT_FILENO;
+
+static struct iovec iov[UIO_MAXIOV];
+static int iovcnt;
+static char headers[UIO_MAXIOV][CAPTURE_HEADER_MAX];
+
+// Merged run: header iovec index, stream and length so far.
+static int run_iov = -1, run_stream;
+static size_t run_len;
+
+static int splice_failed;
+
+// Split: the stream files and the index, iovecs per stream, the stream
+// offsets queued, the stream of the current run (-1 - none), the index
+// entries queued, and the last entry.
+static int split_fd[2], index_fd;
+static struct iovec split_iov[2][UIO_MAXIOV];
+static int split_iovcnt[2];
+static uint64_t split_off[2];
+static int split_stream = -1;
+static char index_buf[2 * UIO_MAXIOV + 1][CAPTURE_INDEX_ENTRY_LEN];
+static int index_count;
+static int indexed_stream = -1;
+static uint64_t indexed_off;
+
+// Blocks: the size, the current block's length and CRC, and iovecs kept
+// for records appended by output_flush().
+static size_t block_size;
+static uint64_t block_len;
+static uint32_t block_crc;
+static char trailer[CAPTURE_BLOCK_LEN];
+static int iov_spare;
+
+// Deduplication: the last chunks (len SIZE_MAX if not to be repeated),
+// as expanded by readers, and the index by hash: a chunk number + 1,
+// 0 - none.
+#define SEEN_INDEX_SIZE (4 * CAPTURE_REPEAT_WINDOW)
+
+static struct seen {
+    uint64_t hash;
+    int stream;
+    size_t len;
+} *seen;
+static char *seen_data;
+static uint64_t seen_count, seen_index[SEEN_INDEX_SIZE];
+static unsigned window, repeat_distance;
+static uint64_t repeat_count;
+static int batch_started;
+static char repeats[UIO_MAXIOV][CAPTURE_HEADER_MAX + CAPTURE_REPEAT_MAX];
+
+static void fail(const char *msg) __attribute__((noreturn));
+static void fail(const char *msg) {
+    fprintf(
+        stderr, "%s: %s: %s\n",
+        program_invocation_name, msg, strerror(errno)
+    );
+    exit(EXIT_FAILURE);
+}
+
+static size_t write_all(int fd, struct iovec *iov, int iovcnt) {
+    size_t total = 0;
+    uint64_t start;
+    ssize_t rc, written;
+    while (iovcnt) {
+        start = stats_now();
+        rc = writev(fd, iov, iovcnt);
+        stats_add(&stats.writev_ns, stats_now() - start);
+        stats_add(&stats.writev_calls, 1);
+        if (rc < 0) {
+            if (errno == EINTR) continue;
+            fail("writev");
+        }
+        total += rc;
+        stats_add(&stats.writev_bytes, rc);
+        written = rc;
+        while (iovcnt && (size_t)rc >= iov->iov_len) {
+            rc -= iov->iov_len;
+            ++iov;
+            --iovcnt;
+        }
+        if (iovcnt) {
+            PROBE3(writev_partial, fd, written, iovcnt);
+            iov->iov_base += rc;
+            iov->iov_len -= rc;
+        }
+    }
+    sync_written(total);
+    return total;
+}
+
+static size_t write_file_header(int fd) {
+    char buf[CAPTURE_FILE_HEADER_LEN];
+    struct iovec iov = { buf, capture_file_header(buf, flags) };
+    return format == CAPTURE_COMPACT ? write_all(fd, &iov, 1) : 0;
+}
+
+void output_dedup(unsigned w) {
+    window = w;
+    if (
+        !(seen = malloc(window * sizeof *seen)) ||
+        !(seen_data = malloc(window * CAPTURE_REPEAT_CHUNK_MAX))
+    ) {
+        fail("malloc");
+    }
+}
+
+void output_blocks(size_t size) {
+    block_size = size;
+}
+
+void output_split(const char *path) {
+    static const char *const suffixes[] = CAPTURE_SPLIT_SUFFIXES;
+    char header[CAPTURE_INDEX_HEADER_LEN] = CAPTURE_INDEX_MAGIC;
+    struct iovec hiov = { header, sizeof header };
+    char *name;
+    int i, fd;
+    for (i = 0; i < 3; ++i) {
+        if (asprintf(&name, "%s%s", path, suffixes[i]) == -1) fail("malloc");
+        fd = open(name, O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, 0600);
+        if (fd == -1) fail(name);
+        free(name);
+        if (i < 2) {
+            split_fd[i] = fd;
+        } else {
+            index_fd = fd;
+        }
+        sync_track(i, fd);
+    }
+    write_all(index_fd, &hiov, 1);
+}
+
+void output_start(int f, int fl, int seg) {
+    format = f;
+    flags = fl | (window ? CAPTURE_DEDUP : 0);
+    iov_spare = !!window + !!block_size;
+    segmented = seg;
+    if (segmented) {
+        cur_fd = segment_fd();
+        segment_written(write_file_header(cur_fd));
+    } else {
+        write_file_header(cur_fd);
+    }
+    if (format != CAPTURE_SPLIT) sync_track(0, cur_fd);
+}
+
+static void end_run(void) {
+    if (run_iov == -1) return;
+    iov[run_iov].iov_len = capture_header(
+        iov[run_iov].iov_base, format, run_stream, run_len
+    );
+    run_iov = -1;
+}
+
+static uint64_t hash(const char *p, size_t len) {
+    const uint64_t m = UINT64_C(0x9e3779b97f4a7c15);
+    uint64_t h = len * m, w;
+    for (; len >= 8; p += 8, len -= 8) {
+        memcpy(&w, p, 8);
+        h = (h ^ w) * m;
+        h ^= h >> 29;
+    }
+    if (len) {
+        w = 0;
+        memcpy(&w, p, len);
+        h = (h ^ w) * m;
+        h ^= h >> 29;
+    }
+    return h;
+}
+
+static void seen_add(uint64_t h, int stream, const void *data, size_t len) {
+    struct seen *s = &seen[seen_count % window];
+    s->hash = h;
+    s->stream = stream;
+    s->len = len;
+    if (len <= CAPTURE_REPEAT_CHUNK_MAX) {
+        memcpy(
+            seen_data + seen_count % window * CAPTURE_REPEAT_CHUNK_MAX,
+            data, len
+        );
+        seen_index[h % SEEN_INDEX_SIZE] = seen_count + 1;
+    }
+    ++seen_count;
+}
+
+static void seen_clear(void) {
+    unsigned i;
+    for (i = 0; i < window; ++i) seen[i].len = SIZE_MAX;
+    memset(seen_index, 0, sizeof seen_index);
+}
+
+// Whether the chunk @distance chunks back is this one.
+static int seen_equal(
+    unsigned distance, int stream, const void *data, size_t len
+) {
+    const uint64_t i = seen_count - distance;
+    const struct seen *s = &seen[i % window];
+    return s->stream == stream && s->len == len &&
+        len <= CAPTURE_REPEAT_CHUNK_MAX && !memcmp(
+        seen_data + i % window * CAPTURE_REPEAT_CHUNK_MAX, data, len
+    );
+}
+
+static void end_repeat(void) {
+    char *p = repeats[iovcnt];
+    size_t n;
+    if (!repeat_count) return;
+    // Room is kept, see iov_spare.
+    n = capture_repeat_encode(
+        p + CAPTURE_HEADER_MAX, repeat_distance, repeat_count
+    );
+    iov[iovcnt].iov_len = capture_header(p, format, CAPTURE_CONTROL, n);
+    memmove(p + iov[iovcnt].iov_len, p + CAPTURE_HEADER_MAX, n);
+    iov[iovcnt].iov_base = p;
+    iov[iovcnt++].iov_len += n;
+    repeat_count = 0;
+}
+
+// Start a segment only with a batch.
+static size_t next_segment(void);
+
+static void start_batch(void) {
+    size_t n;
+    if (batch_started) return;
+    batch_started = 1;
+    if ((n = next_segment())) {
+        seen_clear();
+        segment_written(n);
+    }
+}
+
+// Returns whether the chunk is a repeat, counted rather than queued.
+static int dedup(int stream, const void *data, size_t len) {
+    uint64_t h, i;
+    start_batch();
+    if (repeat_count) {
+        if (seen_equal(repeat_distance, stream, data, len)) {
+            h = seen[(seen_count - repeat_distance) % window].hash;
+            seen_add(h, stream, data, len);
+            ++repeat_count;
+            stats_add(&stats.repeated_chunks, 1);
+            stats_add(&stats.repeated_bytes, len);
+            return 1;
+        }
+        end_repeat();
+    }
+    if (len > CAPTURE_REPEAT_CHUNK_MAX) {
+        seen_add(0, stream, data, len);
+        return 0;
+    }
+    h = hash(data, len);
+    i = seen_index[h % SEEN_INDEX_SIZE];
+    if (
+        i && seen_count - (i - 1) <= window &&
+        seen[(i - 1) % window].hash == h &&
+        seen_equal(seen_count - (i - 1), stream, data, len)
+    ) {
+        repeat_distance = seen_count - (i - 1);
+        repeat_count = 1;
+        seen_add(h, stream, data, len);
+        stats_add(&stats.repeated_chunks, 1);
+        stats_add(&stats.repeated_bytes, len);
+        return 1;
+    }
+    seen_add(h, stream, data, len);
+    return 0;
+}
+
+// Queue an index entry for the run of @stream so far, unless there is
+// one already.
+static void index_add(int stream) {
+    if (stream == indexed_stream && split_off[stream] == indexed_off) return;
+    capture_index_encode(index_buf[index_count++], stream, split_off[stream]);
+    indexed_stream = stream;
+    indexed_off = split_off[stream];
+}
+
+static void split_chunk(int stream, const void *data, size_t len) {
+    struct iovec *v = split_iov[stream];
+    int *cnt = &split_iovcnt[stream];
+    if (*cnt == UIO_MAXIOV || index_count == 2 * UIO_MAXIOV) output_flush();
+    if (split_stream != -1 && split_stream != stream) index_add(split_stream);
+    if (*cnt && v[*cnt - 1].iov_base + v[*cnt - 1].iov_len == data) {
+        v[*cnt - 1].iov_len += len;
+    } else {
+        v[*cnt].iov_base = (void *)data;
+        v[(*cnt)++].iov_len = len;
+    }
+    split_off[stream] += len;
+    split_stream = stream;
+}
+
+static void split_flush(void) {
+    struct iovec index_iov = { index_buf, 0 };
+    size_t total;
+    int i;
+    if (split_stream != -1) index_add(split_stream);
+    for (i = 0; i < 2; ++i) {
+        if (!split_iovcnt[i]) continue;
+        total = write_all(split_fd[i], split_iov[i], split_iovcnt[i]);
+        PROBE3(chunks_written, split_fd[i], total, split_iovcnt[i]);
+        split_iovcnt[i] = 0;
+    }
+    if (index_count) {
+        index_iov.iov_len = index_count * CAPTURE_INDEX_ENTRY_LEN;
+        write_all(index_fd, &index_iov, 1);
+        index_count = 0;
+    }
+}
+
+void output_chunk(int stream, const void *data, size_t len) {
+    if (format == CAPTURE_SPLIT) {
+        split_chunk(stream, data, len);
+        return;
+    }
+    if (window && dedup(stream, data, len)) return;
+    if (
+        run_iov != -1 && run_stream == stream &&
+        run_len + len <= CAPTURE_CHUNK_MAX
+    ) {
+        if (iov[iovcnt - 1].iov_base + iov[iovcnt - 1].iov_len == data) {
+            iov[iovcnt - 1].iov_len += len;
+            run_len += len;
+            return;
+        }
+        if (iovcnt + iov_spare < UIO_MAXIOV) {
+            iov[iovcnt].iov_base = (void *)data;
+            iov[iovcnt++].iov_len = len;
+            run_len += len;
+            return;
+        }
+    }
+    end_run();
+    if (iovcnt + 2 + iov_spare > UIO_MAXIOV) output_flush();
+    iov[iovcnt].iov_base = headers[iovcnt];
+    if (flags & CAPTURE_MERGED) {
+        run_iov = iovcnt;
+        run_stream = stream;
+        run_len = len;
+    } else {
+        iov[iovcnt].iov_len = capture_header(
+            headers[iovcnt], format, stream, len
+        );
+    }
+    ++iovcnt;
+    iov[iovcnt].iov_base = (void *)data;
+    iov[iovcnt++].iov_len = len;
+}
+
+void output_control(const void *data, size_t len) {
+    end_run();
+    if (window) {
+        start_batch();
+        end_repeat();
+    }
+    if (iovcnt + 2 + iov_spare > UIO_MAXIOV) output_flush();
+    iov[iovcnt].iov_base = headers[iovcnt];
+    iov[iovcnt].iov_len = capture_header(
+        headers[iovcnt], format, CAPTURE_CONTROL, len
+    );
+    ++iovcnt;
+    iov[iovcnt].iov_base = (void *)data;
+    iov[iovcnt++].iov_len = len;
+}
+
+// Write the trailer of the current block, unless empty.
+static void end_block(void) {
+    struct iovec t = { trailer, 0 };
+    size_t n;
+    if (!block_len) return;
+    t.iov_len = capture_block_encode(trailer, block_len, block_crc);
+    n = write_all(cur_fd, &t, 1);
+    if (segmented) segment_written(n);
+    block_len = 0;
+    block_crc = 0;
+}
+
+// Every segment is a complete capture file.  A file reopened on SIGHUP
+// that still has data, i.e. wasn't moved away, is appended to as is.
+static size_t next_segment(void) {
+    struct stat st;
+    int fd;
+    if (!segmented) return 0;
+    if (block_size && segment_due()) end_block();
+    if ((fd = segment_fd()) == cur_fd) return 0;
+    cur_fd = fd;
+    sync_track(0, cur_fd);
+    block_len = 0;
+    block_crc = 0;
+    if (fstat(cur_fd, &st) == 0 && st.st_size) return 0;
+    return write_file_header(cur_fd);
+}
+
+void output_flush(void) {
+    size_t total;
+    int i;
+    if (format == CAPTURE_SPLIT) {
+        split_flush();
+        sync_batch();
+        return;
+    }
+    end_run();
+    end_repeat();
+    batch_started = 0;
+    if (!iovcnt) return;
+    total = window ? 0 : next_segment();
+    if (block_size) {
+        for (i = 0; i < iovcnt; ++i) {
+            block_crc = crc32c(block_crc, iov[i].iov_base, iov[i].iov_len);
+            block_len += iov[i].iov_len;
+        }
+        if (block_len >= block_size) {
+            iov[iovcnt].iov_base = trailer;
+            iov[iovcnt++].iov_len =
+                capture_block_encode(trailer, block_len, block_crc);
+            block_len = 0;
+            block_crc = 0;
+        }
+    }
+    total += write_all(cur_fd, iov, iovcnt);
+    PROBE3(chunks_written, cur_fd, total, iovcnt);
+    if (segmented) segment_written(total);
+    iovcnt = 0;
+    sync_batch();
+}
+
+// Move @len bytes from the pipe @fd to @out.  Returns the bytes moved,
+// short if the pipe was closed.
+static size_t move(int fd, int out, size_t len) {
+    static char buf[1 << 16];
+    struct pollfd pfd = { fd, POLLIN };
+    struct iovec buf_iov;
+    size_t total = 0;
+    ssize_t rc;
+    while (len) {
+        if (!splice_failed) {
+            rc = splice(
+                fd, NULL, out, NULL, len, SPLICE_F_MOVE | SPLICE_F_MORE
+            );
+            if (rc < 0 && errno == EINVAL) {
+                splice_failed = 1;
+                continue;
+            }
+        } else {
+            rc = read(fd, buf, len < sizeof buf ? len : sizeof buf);
+            if (rc > 0) {
+                buf_iov.iov_base = buf;
+                buf_iov.iov_len = rc;
+                write_all(out, &buf_iov, 1);
+            }
+        }
+        if (rc == 0) break;
+        if (rc < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                poll(&pfd, 1, -1);
+                continue;
+            }
+            if (errno == EINTR) continue;
+            fail("splice");
+        }
+        stats_add(&stats.splice_calls, 1);
+        stats_add(&stats.splice_bytes, rc);
+        // write_all() accounts for its own.
+        if (!splice_failed) sync_written(rc);
+        total += rc;
+        len -= rc;
+    }
+    return total;
+}
+
+void output_splice(int stream, int fd, size_t len) {
+    static const char zeros[1 << 12];
+    char header[CAPTURE_HEADER_MAX];
+    struct iovec hiov = { header, 0 };
+    size_t total, moved;
+    output_flush();
+    if (format == CAPTURE_SPLIT) {
+        // Raw data, nothing to pad with.
+        if (split_stream != -1 && split_stream != stream) {
+            index_add(split_stream);
+        }
+        moved = move(fd, split_fd[stream], len);
+        PROBE3(chunks_written, split_fd[stream], moved, 1);
+        split_off[stream] += moved;
+        split_stream = stream;
+        split_flush();
+        sync_batch();
+        return;
+    }
+    total = next_segment();
+    if (window) {
+        // Not seen, never repeated.
+        if (total) seen_clear();
+        seen_add(0, stream, NULL, SIZE_MAX);
+    }
+    hiov.iov_len = capture_header(header, format, stream, len);
+    total += write_all(cur_fd, &hiov, 1);
+    total += moved = move(fd, cur_fd, len);
+    // The writer was killed midway, pad to keep the file readable.
+    for (len -= moved; len; len -= hiov.iov_len) {
+        hiov.iov_base = (void *)zeros;
+        hiov.iov_len = len < sizeof zeros ? len : sizeof zeros;
+        total += write_all(cur_fd, &hiov, 1);
+    }
+    PROBE3(chunks_written, cur_fd, total, 1);
+    if (segmented) segment_written(total);
+    sync_batch();
+}
+
+void output_finish(void) {
+    output_flush();
+    if (block_size) end_block();
+}
@@ -0,0 +1,39 @@
+// Encoding chunks and writing them to the capture file.
+#pragma once
+
+#include <stddef.h>
+
+// Start writing chunks in @format (capture.h) with @flags to stdout, or
+// to segments (segment.h) if @segmented.
+void output_start(int format, int flags, int segmented);
+
+// Store chunks repeating one of the last @window (up to
+// CAPTURE_REPEAT_WINDOW) as CAPTURE_REPEAT records, compact format
+// without CAPTURE_MERGED only.  Called before output_start().
+void output_dedup(unsigned window);
+
+// Close a CAPTURE_BLOCK trailed block every @size bytes or so, compact
+// format only.  Called before output_start().
+void output_blocks(size_t size);
+
+// Write a split capture to @path with suffixes (capture.h) instead,
+// format CAPTURE_SPLIT.  Called before output_start().
+void output_split(const char *path);
+
+// Queue a chunk, @data must stay valid until output_flush().
+void output_chunk(int stream, const void *data, size_t len);
+
+// Queue a control record (compact format only), @data must stay valid
+// until output_flush().
+void output_control(const void *data, size_t len);
+
+// Write queued chunks.
+void output_flush(void);
+
+// Write a chunk of @len bytes read from the pipe @fd, after the queued
+// ones.  The data is moved with splice(), never copied to user space,
+// unless the output doesn't support it.  Not with output_blocks().
+void output_splice(int stream, int fd, size_t len);
+
+// Write queued chunks and the last block's trailer, at exit.
+void output_finish(void);
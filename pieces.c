@@ -0,0 +1,77 @@
+// Chunks being reassembled are kept per sender, a thread of the child
+// sends the pieces of a chunk one after another.  There are about as
+// many as writing threads, so a list will do.
+#include <stdlib.h>
+#include <string.h>
+
+#include "capture.h"
+#include "pieces.h"
+
+struct assembly {
+    struct assembly *next;
+    struct sockaddr_un addr;
+    socklen_t addrlen;
+    int stream;
+    char *data;
+    size_t len, size;
+};
+
+static int append(struct assembly *a, const char *p, size_t len) {
+    size_t size;
+    char *data;
+    // A chunk is limited in size, the excess is dropped.
+    if (len > CAPTURE_CHUNK_MAX - a->len) len = CAPTURE_CHUNK_MAX - a->len;
+    if (a->len + len > a->size) {
+        size = a->size ? a->size : len;
+        while (size < a->len + len) size *= 2;
+        if (!(data = realloc(a->data, size))) return -1;
+        a->data = data;
+        a->size = size;
+    }
+    memcpy(a->data + a->len, p, len);
+    a->len += len;
+    return 0;
+}
+
+static void take(struct assembly **link, char **data, size_t *size) {
+    struct assembly *a = *link;
+    *link = a->next;
+    *data = a->data;
+    *size = a->len;
+    free(a);
+}
+
+int pieces_add(
+    struct pieces *ps, const struct sockaddr_un *addr, socklen_t addrlen,
+    int stream, const char *p, size_t len, int more, char **data,
+    size_t *size
+) {
+    struct assembly **link, *a;
+    for (link = &ps->assemblies; (a = *link); link = &a->next) {
+        if (a->addrlen == addrlen && !memcmp(&a->addr, addr, addrlen)) {
+            break;
+        }
+    }
+    if (!a) {
+        // Ends a chunk that failed midway.
+        if (!len && !more) return 0;
+        if (!(a = calloc(1, sizeof *a))) return -1;
+        memcpy(&a->addr, addr, addrlen);
+        a->addrlen = addrlen;
+        a->stream = stream;
+        a->next = ps->assemblies;
+        ps->assemblies = a;
+        link = &ps->assemblies;
+    }
+    if (append(a, p, len) != 0) return -1;
+    if (more) return 0;
+    take(link, data, size);
+    return 1;
+}
+
+int pieces_take(struct pieces *ps, int *stream, char **data, size_t *size) {
+    if (!ps->assemblies) return 0;
+    *stream = ps->assemblies->stream;
+    take(&ps->assemblies, data, size);
+    return 1;
+}
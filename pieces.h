@@ -0,0 +1,27 @@
+// Reassembly of writes the helper split into pieces, see helper.h.
+// A struct pieces per master socket, used by its receiving thread only.
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Zero-initialized.
+struct pieces {
+    struct assembly *assemblies;
+};
+
+// Add a piece of @len bytes of @stream from the sender @addr, the last
+// of its chunk unless @more.  Once the chunk is complete, returns 1 and
+// stores it in *@data (malloc'd, freed by the caller) and *@size.
+// Returns 0 if incomplete, or -1 (errno set).
+int pieces_add(
+    struct pieces *ps, const struct sockaddr_un *addr, socklen_t addrlen,
+    int stream, const char *p, size_t len, int more, char **data,
+    size_t *size
+);
+
+// Take a chunk left incomplete, e.g. the writer was killed midway.
+// Returns 1, storing it as pieces_add() does, or 0 if there are none.
+int pieces_take(struct pieces *ps, int *stream, char **data, size_t *size);
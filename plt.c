@@ -0,0 +1,170 @@
+// GOT rewriting, see plt.h.  x86_64 only, like hook_engine: RELA
+// relocations, JUMP_SLOT and GLOB_DAT types.
+#define _GNU_SOURCE 1
+#include <elf.h>
+#include <link.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "plt.h"
+
+// GOT pages remembered to count each once, more are counted every time.
+#define PAGES_MAX 64
+
+struct walk {
+    const struct plt_hook *hooks;
+    int count;
+    uintptr_t self;
+    uintptr_t page_size;
+    uintptr_t pages[PAGES_MAX];
+    unsigned npages;
+    int entries;
+    int failed;
+};
+
+// Dynamic section pointers are relocated in place by glibc, not by
+// musl, nor in the vDSO.
+static uintptr_t dyn_ptr(uintptr_t base, uintptr_t ptr) {
+    return ptr < base ? base + ptr : ptr;
+}
+
+static void note_page(struct walk *w, uintptr_t page) {
+    unsigned i;
+    for (i = 0; i < w->npages && i < PAGES_MAX; ++i) {
+        if (w->pages[i] == page) return;
+    }
+    if (w->npages < PAGES_MAX) w->pages[w->npages] = page;
+    ++w->npages;
+}
+
+static int rewrite(
+    struct walk *w, void **slot, void *value,
+    uintptr_t relro_start, uintptr_t relro_end
+) {
+    uintptr_t page = (uintptr_t)slot & ~(w->page_size - 1);
+    int ro = page >= relro_start && page < relro_end;
+    if (*slot == value) return 0;
+    if (
+        ro && mprotect((void *)page, w->page_size, PROT_READ | PROT_WRITE)
+            != 0
+    ) {
+        return -1;
+    }
+    *slot = value;
+    if (ro) mprotect((void *)page, w->page_size, PROT_READ);
+    note_page(w, page);
+    ++w->entries;
+    return 0;
+}
+
+static void rewrite_relocs(
+    struct walk *w, uintptr_t base, const ElfW(Rela) *rel, size_t size,
+    const ElfW(Sym) *symtab, const char *strtab,
+    uintptr_t relro_start, uintptr_t relro_end
+) {
+    const ElfW(Rela) *end = rel + size / sizeof *rel;
+    const char *name;
+    int i;
+    for (; rel < end; ++rel) {
+        if (
+            ELF64_R_TYPE(rel->r_info) != R_X86_64_JUMP_SLOT &&
+            ELF64_R_TYPE(rel->r_info) != R_X86_64_GLOB_DAT
+        ) {
+            continue;
+        }
+        name = strtab + symtab[ELF64_R_SYM(rel->r_info)].st_name;
+        for (i = 0; i < w->count; ++i) {
+            if (strcmp(name, w->hooks[i].name) != 0) continue;
+            if (rewrite(
+                    w, (void **)(base + rel->r_offset),
+                    w->hooks[i].replacement, relro_start, relro_end
+                ) != 0
+            ) {
+                w->failed = 1;
+            }
+            break;
+        }
+    }
+}
+
+static int walk_object(struct dl_phdr_info *info, size_t size, void *arg) {
+    struct walk *w = arg;
+    const uintptr_t base = info->dlpi_addr;
+    const ElfW(Dyn) *dyn = NULL, *d;
+    const ElfW(Sym) *symtab = NULL;
+    const ElfW(Rela) *jmprel = NULL, *rela = NULL;
+    const char *strtab = NULL;
+    size_t jmprel_size = 0, rela_size = 0;
+    uintptr_t start, relro_start = 0, relro_end = 0;
+    int i;
+    for (i = 0; i < info->dlpi_phnum; ++i) {
+        const ElfW(Phdr) *ph = &info->dlpi_phdr[i];
+        start = base + ph->p_vaddr;
+        switch (ph->p_type) {
+        case PT_LOAD:
+            if (w->self >= start && w->self < start + ph->p_memsz) return 0;
+            break;
+        case PT_DYNAMIC:
+            dyn = (const ElfW(Dyn) *)start;
+            break;
+        case PT_GNU_RELRO:
+            // Made read-only by the dynamic linker, whole pages.
+            relro_start = start & ~(w->page_size - 1);
+            relro_end = (start + ph->p_memsz) & ~(w->page_size - 1);
+            break;
+        }
+    }
+    if (!dyn) return 0;
+    for (d = dyn; d->d_tag != DT_NULL; ++d) {
+        switch (d->d_tag) {
+        case DT_SYMTAB:
+            symtab = (const void *)dyn_ptr(base, d->d_un.d_ptr);
+            break;
+        case DT_STRTAB:
+            strtab = (const void *)dyn_ptr(base, d->d_un.d_ptr);
+            break;
+        case DT_JMPREL:
+            jmprel = (const void *)dyn_ptr(base, d->d_un.d_ptr);
+            break;
+        case DT_PLTRELSZ:
+            jmprel_size = d->d_un.d_val;
+            break;
+        case DT_RELA:
+            rela = (const void *)dyn_ptr(base, d->d_un.d_ptr);
+            break;
+        case DT_RELASZ:
+            rela_size = d->d_un.d_val;
+            break;
+        }
+    }
+    if (!symtab || !strtab) return 0;
+    if (jmprel) {
+        rewrite_relocs(
+            w, base, jmprel, jmprel_size, symtab, strtab,
+            relro_start, relro_end
+        );
+    }
+    if (rela) {
+        rewrite_relocs(
+            w, base, rela, rela_size, symtab, strtab, relro_start, relro_end
+        );
+    }
+    return 0;
+}
+
+int plt_hook(
+    const struct plt_hook *hooks, int count, const void *self,
+    unsigned *pages
+) {
+    struct walk w = {
+        .hooks = hooks,
+        .count = count,
+        .self = (uintptr_t)self,
+        .page_size = sysconf(_SC_PAGESIZE),
+    };
+    dl_iterate_phdr(walk_object, &w);
+    *pages += w.npages;
+    return w.failed ? -1 : w.entries;
+}
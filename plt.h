@@ -0,0 +1,25 @@
+// Hooking by rewriting GOT entries, an alternative to patching code
+// (hook_engine) that leaves text pages shared between processes.
+//
+// Objects call imported functions through GOT entries filled in by the
+// dynamic linker: JUMP_SLOT relocations for calls through the PLT,
+// GLOB_DAT ones for references, e.g. taking the address.  Rewriting the
+// entries redirects calls from every object but the one defining the
+// function, whose own calls don't go through the GOT.  GOT pages are
+// written by the dynamic linker anyway, they are private already.
+#pragma once
+
+struct plt_hook {
+    const char *name;
+    void *replacement;
+};
+
+// Redirect calls to the @count functions named in @hooks from all the
+// objects loaded, except the one containing @self.  Objects loaded later
+// with dlopen() are not affected.  Adds the GOT pages written to
+// *@pages.  Returns the entries rewritten, or -1 (errno set) if a
+// read-only (RELRO) entry could not be made writable.
+int plt_hook(
+    const struct plt_hook *hooks, int count, const void *self,
+    unsigned *pages
+);
@@ -0,0 +1,78 @@
+// Statically defined tracing (SDT/USDT) probes, for perf, bpftrace,
+// SystemTap, etc., e.g.
+//
+//   bpftrace -e 'usdt:/usr/bin/out+err:outerr:chunk_received
+//                { @[arg0] = hist(arg1); }'
+//
+// A probe is a nop instruction, and an ELF note in .note.stapsdt
+// describing its location and arguments, in the format of
+// <sys/sdt.h>, not required to build.  Tracers replace the nop with a
+// breakpoint once a probe is enabled.  Arguments are integers; a
+// disabled probe costs the nop and keeping arguments in registers.
+//
+// Probes (provider outerr):
+//   chunk_received(stream, size)             master, chunk received
+//   chunks_written(fd, bytes, iovecs)        master, chunks written
+//   writev_partial(fd, written, iovecs_left) master, short writev()
+//   child_exit(pid, status)                  master, COMMAND exited
+//   helper_split(fd, size, pieces)           helper, write split
+//   helper_hooked(pid, text_pages, got_pages) helper, hooks installed
+#pragma once
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// Argument size, negative if signed, as "%n" prints the negated value.
+#define PROBE_SIZE(x) \
+    (((__typeof__(x))-1 < 1 ? 1 : -1) * (int)sizeof(x))
+
+#define PROBE_OP(i, x) [s##i] "n" (PROBE_SIZE(x)), [a##i] "nor" (x)
+#define PROBE_ARG(i) "%n[s" #i "]@%[a" #i "]"
+
+#if defined(__x86_64__)
+#define PROBE_ADDR ".8byte"
+#else
+#define PROBE_ADDR ".4byte"
+#endif
+
+#define PROBE_(name, args, ...) __asm__ __volatile__ ( \
+    "990: nop\n" \
+    ".pushsection .note.stapsdt,\"?\",\"note\"\n" \
+    ".balign 4\n" \
+    ".4byte 992f-991f, 994f-993f, 3\n" \
+    "991: .asciz \"stapsdt\"\n" \
+    "992: .balign 4\n" \
+    "993: " PROBE_ADDR " 990b\n" \
+    PROBE_ADDR " _.stapsdt.base\n" \
+    PROBE_ADDR " 0\n" \
+    ".asciz \"outerr\"\n" \
+    ".asciz \"" #name "\"\n" \
+    ".asciz \"" args "\"\n" \
+    "994: .balign 4\n" \
+    ".popsection\n" \
+    ".ifndef _.stapsdt.base\n" \
+    ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+    ".weak _.stapsdt.base\n" \
+    ".hidden _.stapsdt.base\n" \
+    "_.stapsdt.base: .space 1\n" \
+    ".size _.stapsdt.base, 1\n" \
+    ".popsection\n" \
+    ".endif\n" \
+    :: __VA_ARGS__ \
+)
+
+#define PROBE1(name, a) \
+    PROBE_(name, PROBE_ARG(1), PROBE_OP(1, a))
+#define PROBE2(name, a, b) \
+    PROBE_(name, PROBE_ARG(1) " " PROBE_ARG(2), \
+        PROBE_OP(1, a), PROBE_OP(2, b))
+#define PROBE3(name, a, b, c) \
+    PROBE_(name, PROBE_ARG(1) " " PROBE_ARG(2) " " PROBE_ARG(3), \
+        PROBE_OP(1, a), PROBE_OP(2, b), PROBE_OP(3, c))
+
+#else
+
+#define PROBE1(name, a) ((void)(a))
+#define PROBE2(name, a, b) ((void)(a), (void)(b))
+#define PROBE3(name, a, b, c) ((void)(a), (void)(b), (void)(c))
+
+#endif
@@ -0,0 +1,99 @@
+#define _GNU_SOURCE 1
+#include <errno.h>
+#include <linux/futex.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ring.h"
+
+static void ring_signal(struct ring_event *ev, int force) {
+    if (force || atomic_load(&ev->waiting)) {
+        atomic_fetch_add(&ev->seq, 1);
+        syscall(SYS_futex, &ev->seq, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+}
+
+// Sleep on @ev unless the state has changed meanwhile, which @ready()
+// checks after announcing the sleep.  Returns on a spurious wakeup too,
+// callers check again.
+static void ring_wait(
+    struct ring *r, struct ring_event *ev, int (*ready)(struct ring *),
+    int timeout_ms
+) {
+    struct timespec ts = {
+        .tv_sec = timeout_ms / 1000, .tv_nsec = timeout_ms % 1000 * 1000000
+    };
+    uint32_t seq;
+    atomic_store(&ev->waiting, 1);
+    seq = atomic_load(&ev->seq);
+    if (!ready(r)) {
+        syscall(
+            SYS_futex, &ev->seq, FUTEX_WAIT_PRIVATE, seq,
+            timeout_ms < 0 ? NULL : &ts, NULL, 0
+        );
+    }
+    atomic_store(&ev->waiting, 0);
+}
+
+int ring_init(struct ring *r, size_t size, size_t rec_max) {
+    if (size < 2 * rec_max) size = 2 * rec_max;
+    r->size = size;
+    return (r->buf = malloc(size)) ? 0 : -1;
+}
+
+static int ring_drained(struct ring *r) {
+    return atomic_load(&r->head) - atomic_load(&r->tail) < RING_SLOTS &&
+        r->need - atomic_load(&r->buf_tail) <= r->size;
+}
+
+void *ring_reserve(struct ring *r, size_t len, int wait) {
+    uint64_t pos = r->buf_head;
+    if (r->size - pos % r->size < len) pos += r->size - pos % r->size;
+    r->need = pos + len;
+    while (!ring_drained(r)) {
+        if (!wait) return NULL;
+        ring_wait(r, &r->drained, ring_drained, -1);
+    }
+    r->buf_head = pos;
+    return r->buf + pos % r->size;
+}
+
+void ring_commit(struct ring *r, size_t len, uint32_t tag) {
+    uint32_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    r->slot[head % RING_SLOTS].pos = r->buf_head;
+    r->slot[head % RING_SLOTS].len = len;
+    r->slot[head % RING_SLOTS].tag = tag;
+    r->buf_head += len;
+    atomic_store(&r->head, head + 1);
+    ring_signal(&r->filled, 0);
+}
+
+void ring_close(struct ring *r) {
+    atomic_store(&r->closed, 1);
+    ring_signal(&r->filled, 1);
+}
+
+static __thread uint32_t tail_seen;
+static int ring_filled(struct ring *r) {
+    return atomic_load(&r->head) != tail_seen || atomic_load(&r->closed);
+}
+
+uint32_t ring_peek(struct ring *r, uint32_t tail, int timeout_ms) {
+    tail_seen = tail;
+    if (!ring_filled(r)) {
+        ring_wait(r, &r->filled, ring_filled, timeout_ms);
+        while (timeout_ms < 0 && !ring_filled(r)) {
+            ring_wait(r, &r->filled, ring_filled, timeout_ms);
+        }
+    }
+    return atomic_load(&r->head) - tail;
+}
+
+void ring_release(struct ring *r, uint32_t tail) {
+    const struct ring_slot *s = &r->slot[(tail - 1) % RING_SLOTS];
+    atomic_store(&r->buf_tail, s->pos + s->len);
+    atomic_store(&r->tail, tail);
+    ring_signal(&r->drained, 0);
+}
@@ -0,0 +1,68 @@
+// Lock-free ring buffer with a single producer and a single consumer.
+//
+// Records are stored contiguously, in the order committed.  A record
+// never wraps around the end of the buffer, the space left is skipped
+// instead.  Slots point at the records.  Either side sleeps on a futex
+// only when the ring is empty or full.
+#pragma once
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define RING_SLOTS 4096
+
+struct ring_slot {
+    uint64_t pos;
+    uint32_t len;
+    uint32_t tag;
+};
+
+// A producer or consumer going to sleep raises 'waiting'; the other
+// side then bumps 'seq' and wakes it with a futex.
+struct ring_event {
+    _Atomic uint32_t seq;
+    _Atomic int waiting;
+};
+
+struct ring {
+    char *buf;
+    size_t size;
+    struct ring_slot slot[RING_SLOTS];
+    _Atomic uint32_t head, tail; // slots published / consumed
+    _Atomic uint64_t buf_tail;   // buf bytes consumed
+    _Atomic int closed;
+    struct ring_event filled, drained;
+    uint64_t buf_head;           // producer only
+    uint64_t need;
+};
+
+// Allocate the buffer, at least twice @rec_max so a wrap doesn't stall
+// until the ring is drained.  Returns 0 or -1 (errno set).
+int ring_init(struct ring *r, size_t size, size_t rec_max);
+
+// Producer: reserve @len contiguous bytes, waiting for the consumer if
+// @wait, otherwise returning NULL when there's no room.
+void *ring_reserve(struct ring *r, size_t len, int wait);
+
+// Producer: publish @len bytes of the reserved space as a record.
+void ring_commit(struct ring *r, size_t len, uint32_t tag);
+
+// Producer: no more records; the consumer drains the rest.
+void ring_close(struct ring *r);
+
+// Consumer: return the number of records past @tail, waiting up to
+// @timeout_ms (-1 to wait indefinitely) if there are none.  Returns 0
+// once the ring is closed and drained, or on timeout.
+uint32_t ring_peek(struct ring *r, uint32_t tail, int timeout_ms);
+
+static inline struct ring_slot *ring_slot(struct ring *r, uint32_t i) {
+    return &r->slot[i % RING_SLOTS];
+}
+
+static inline char *ring_data(struct ring *r, const struct ring_slot *s) {
+    return r->buf + s->pos % r->size;
+}
+
+// Consumer: records before @tail are no longer needed.
+void ring_release(struct ring *r, uint32_t tail);
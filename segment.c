@@ -0,0 +1,225 @@
+// With rotation, the current segment is always PATH, rotated segments
+// are renamed to PATH.1, PATH.2, etc. (numbering continues from the
+// existing ones), and the next segment is prepared as PATH.next in
+// advance.  Segments are preallocated to the rotation size.  As
+// segments are switched at chunk boundaries, every one is a complete
+// capture file.
+//
+// Without rotation, SIGHUP reopens PATH, i.e. starts a new file if
+// the old one was moved away by a log manager.
+//
+// Opening, renaming, trimming and deleting files happens on a separate
+// thread.  The writer merely switches to a file descriptor prepared
+// by the thread and hands the old one over.
+#define _GNU_SOURCE 1
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "segment.h"
+#include "thread.h"
+
+static struct segment_opts opts;
+static const char *path;
+static char *next_path;
+static int rotating;
+
+// Writer side.
+static int cur_fd;
+static uint64_t cur_written;
+static time_t cur_opened;
+
+static _Atomic int next_fd = -1;   // prepared by the thread
+static _Atomic int retire_fd = -1; // handed over to the thread
+static uint64_t retire_written;
+static _Atomic int reopen;         // SIGHUP: switch asap
+static _Atomic int reopen_pending; // SIGHUP: prepare a file
+static _Atomic int stop;
+static unsigned seq;               // number of the next rotated segment
+static int event_fd;
+static pthread_t thread;
+
+static time_t now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+static void wake(void) {
+    uint64_t one = 1;
+    while (write(event_fd, &one, sizeof one) < 0 && errno == EINTR);
+}
+
+static char *rotated_path(unsigned n) {
+    static char buf[PATH_MAX];
+    snprintf(buf, sizeof buf, "%s.%u", path, n);
+    return buf;
+}
+
+// Continue numbering after the rotated segments already present.
+static unsigned first_seq(void) {
+    const char *slash = strrchr(path, '/');
+    const char *base = slash ? slash + 1 : path;
+    char *dir = slash ? strndup(path, slash - path + 1) : strdup(".");
+    size_t base_len = strlen(base);
+    unsigned max = 0;
+    struct dirent *ent;
+    DIR *d;
+    if (dir && (d = opendir(dir))) {
+        while ((ent = readdir(d))) {
+            char *end;
+            unsigned long n;
+            if (
+                strncmp(ent->d_name, base, base_len) ||
+                ent->d_name[base_len] != '.'
+            ) {
+                continue;
+            }
+            n = strtoul(ent->d_name + base_len + 1, &end, 10);
+            if (!*end && end != ent->d_name + base_len + 1 && n > max) {
+                max = n;
+            }
+        }
+        closedir(d);
+    }
+    free(dir);
+    return max + 1;
+}
+
+static int open_segment(const char *name, int flags) {
+    int fd = open(name, O_CREAT | O_WRONLY | O_CLOEXEC | flags, 0600);
+    // Best effort, not all filesystems support that.
+    if (fd != -1 && opts.rotate_size) {
+        fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, opts.rotate_size);
+    }
+    return fd;
+}
+
+static void retire(int fd, uint64_t written) {
+    if (rotating) {
+        // Release preallocated space.
+        if (ftruncate(fd, written) != 0) {
+            fprintf(
+                stderr, "%s: %s: %s\n",
+                program_invocation_name, path, strerror(errno)
+            );
+        }
+    }
+    close(fd);
+    if (!rotating) return;
+    if (renameat2(AT_FDCWD, next_path, AT_FDCWD, path, RENAME_EXCHANGE) == 0) {
+        rename(next_path, rotated_path(seq));
+    } else {
+        rename(path, rotated_path(seq));
+        rename(next_path, path);
+    }
+    if (opts.keep && seq > opts.keep) unlink(rotated_path(seq - opts.keep));
+    ++seq;
+}
+
+static void *segment_main(void *arg) {
+    uint64_t events;
+    int fd, stopping;
+    while (1) {
+        // The last retired segment precedes stop.
+        stopping = atomic_load(&stop);
+        // The slot is emptied only once done with, retire_written too.
+        if ((fd = atomic_load(&retire_fd)) != -1) {
+            retire(fd, retire_written);
+            atomic_store(&retire_fd, -1);
+        }
+        if (stopping) return NULL;
+        if (
+            atomic_load(&next_fd) == -1 &&
+            (rotating || atomic_exchange(&reopen_pending, 0))
+        ) {
+            fd = rotating ?
+                open_segment(next_path, O_TRUNC) :
+                open_segment(path, O_APPEND);
+            if (fd == -1) {
+                fprintf(
+                    stderr, "%s: %s: %s\n", program_invocation_name,
+                    rotating ? next_path : path, strerror(errno)
+                );
+            }
+            atomic_store(&next_fd, fd);
+        }
+        while (read(event_fd, &events, sizeof events) < 0 && errno == EINTR);
+    }
+}
+
+int segment_open(const char *p, const struct segment_opts *o) {
+    path = p;
+    opts = *o;
+    rotating = opts.rotate_size || opts.rotate_time;
+    if (rotating) {
+        if (asprintf(&next_path, "%s.next", path) < 0) return -1;
+        seq = first_seq();
+    }
+    if ((cur_fd = open_segment(path, O_TRUNC)) == -1) return -1;
+    cur_opened = now();
+    if (
+        (event_fd = eventfd(0, EFD_CLOEXEC)) == -1 ||
+        thread_start(&thread, segment_main) != 0
+    ) {
+        return -1;
+    }
+    return cur_fd;
+}
+
+// Stays true until segment_fd(): the next segment, once ready, is only
+// taken by it.  Not before the thread is done with the previous one.
+int segment_due(void) {
+    return (
+        (opts.rotate_size && cur_written >= opts.rotate_size) ||
+        (opts.rotate_time && now() - cur_opened >= opts.rotate_time) ||
+        atomic_load(&reopen)
+    ) && atomic_load(&next_fd) != -1 && atomic_load(&retire_fd) == -1;
+}
+
+int segment_fd(void) {
+    int fd;
+    // Keep writing to the current segment if the next one isn't ready.
+    if (!segment_due()) return cur_fd;
+    fd = atomic_exchange(&next_fd, -1);
+    atomic_store(&reopen, 0);
+    retire_written = cur_written;
+    atomic_store(&retire_fd, cur_fd);
+    wake();
+    cur_fd = fd;
+    cur_written = 0;
+    cur_opened = now();
+    return cur_fd;
+}
+
+void segment_written(size_t len) {
+    cur_written += len;
+}
+
+void segment_reopen(void) {
+    atomic_store(&reopen_pending, 1);
+    atomic_store(&reopen, 1);
+    wake();
+}
+
+void segment_close(void) {
+    int fd;
+    atomic_store(&stop, 1);
+    wake();
+    pthread_join(thread, NULL);
+    if (rotating) ftruncate(cur_fd, cur_written);
+    close(cur_fd);
+    if ((fd = atomic_exchange(&next_fd, -1)) != -1) {
+        close(fd);
+        if (rotating) unlink(next_path);
+    }
+}
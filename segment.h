@@ -0,0 +1,33 @@
+// Capture file segments: size and time based rotation, and reopening
+// on SIGHUP for external log managers.
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct segment_opts {
+    uint64_t rotate_size; // bytes, 0 - unlimited
+    unsigned rotate_time; // seconds, 0 - unlimited
+    unsigned keep;        // rotated segments retained, 0 - all
+};
+
+// Open @path for writing chunks and start the rotation thread.
+// Returns a file descriptor to write to, or -1 (errno set).
+int segment_open(const char *path, const struct segment_opts *opts);
+
+// Returns a file descriptor to write chunks to, i.e. a new segment once
+// it is time to rotate.  Never blocks: a segment is prepared in advance.
+int segment_fd(void);
+
+// Whether segment_fd() is going to return a new segment, e.g. to finish
+// the current one first.
+int segment_due(void);
+
+// Account for @len bytes written to segment_fd().
+void segment_written(size_t len);
+
+// Rotate or reopen at the next chunk boundary.  Async-signal-safe.
+void segment_reopen(void);
+
+// Finish the current segment and stop the rotation thread.
+void segment_close(void);
@@ -0,0 +1,257 @@
+// The stats file is plain text, a "name value" pair per line; sizes
+// are in bytes, times in nanoseconds:
+//
+//   elapsed_ns 1500000000
+//   stdout_chunks 100
+//   stdout_bytes 5000
+//   ...
+//   size_lt_64 95
+//   size_lt_128 5
+//
+// size_lt_N counts datagrams at least N/2 bytes in size (N=1: empty),
+// only non-zero buckets are listed.  queue_max is the high-water mark of
+// memory queued at the master socket by the stream, including kernel
+// overhead, sampled with SIOCOUTQ every STATS_SAMPLE_EVERY chunks (bytes
+// queued in the pipe with the pipe transport, FIONREAD).  With --spin,
+// spin_hits and spin_misses count polling windows that caught a chunk
+// and that ended blocking, spin_ns is the time spent polling.
+// filtered_chunks counts chunks (lines with --filter-lines) dropped by
+// --include and --exclude, repeated_chunks those stored as repeats by
+// --dedup.  With --sync, sync_commits counts commits and sync_batches
+// the batches written they took, i.e. coalesced; sync_ns and
+// sync_max_ns are the time spent syncing, in total and by the slowest
+// commit, sync_lag_max_ns the longest time from a batch written until
+// committed.
+//
+// Counters reported by the helper (helper.h) follow per PID, e.g.
+// helper_1234_blocked_ns; text_pages and got_pages are the pages the
+// helper's hooks made private, see --hook.
+//
+// The file is replaced atomically, through PATH.tmp.  It is written on
+// a separate thread, woken by SIGUSR1 via an eventfd.
+#define _GNU_SOURCE 1
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/sockios.h>
+
+#include "helper.h"
+#include "stats.h"
+#include "thread.h"
+
+#define STATS_SAMPLE_EVERY 64
+
+struct stats stats;
+
+static const char *path;
+static char *tmp_path;
+static unsigned interval;
+static int socks[2];
+static unsigned sample_count;
+static uint64_t started;
+static _Atomic int stop;
+static int event_fd = -1;
+static pthread_t thread;
+
+// Latest helper reports, a PID each.
+static struct helper_stats *helpers;
+static size_t helpers_count, helpers_size;
+static pthread_mutex_t helpers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+uint64_t stats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+static uint64_t get(_Atomic uint64_t *counter) {
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+static unsigned long long timeval_ns(const struct timeval *tv) {
+    return tv->tv_sec * 1000000000ULL + tv->tv_usec * 1000ULL;
+}
+
+static void write_stats(void) {
+    static const char *const names[2] = { "stdout", "stderr" };
+    struct rusage ru;
+    FILE *f;
+    int i;
+    if (!(f = fopen(tmp_path, "we"))) goto fail;
+    fprintf(
+        f, "elapsed_ns %llu\n", (unsigned long long)(stats_now() - started)
+    );
+    // The master itself, all threads.
+    if (getrusage(RUSAGE_SELF, &ru) == 0) {
+        fprintf(
+            f, "cpu_user_ns %llu\ncpu_sys_ns %llu\n",
+            timeval_ns(&ru.ru_utime), timeval_ns(&ru.ru_stime)
+        );
+    }
+    for (i = 0; i < 2; ++i) {
+        fprintf(
+            f, "%s_chunks %llu\n%s_bytes %llu\n%s_queue_max %llu\n",
+            names[i], (unsigned long long)get(&stats.chunks[i]),
+            names[i], (unsigned long long)get(&stats.bytes[i]),
+            names[i], (unsigned long long)get(&stats.queue_max[i])
+        );
+    }
+    fprintf(
+        f,
+        "recv_calls %llu\nrecv_eintr %llu\nrecv_eagain %llu\n"
+        "spin_hits %llu\nspin_misses %llu\nspin_ns %llu\n"
+        "writev_calls %llu\nwritev_bytes %llu\nwritev_ns %llu\n"
+        "splice_calls %llu\nsplice_bytes %llu\n"
+        "filtered_chunks %llu\nfiltered_bytes %llu\n"
+        "repeated_chunks %llu\nrepeated_bytes %llu\n"
+        "sync_commits %llu\nsync_batches %llu\nsync_ns %llu\n"
+        "sync_max_ns %llu\nsync_lag_max_ns %llu\n",
+        (unsigned long long)get(&stats.recv_calls),
+        (unsigned long long)get(&stats.recv_eintr),
+        (unsigned long long)get(&stats.recv_eagain),
+        (unsigned long long)get(&stats.spin_hits),
+        (unsigned long long)get(&stats.spin_misses),
+        (unsigned long long)get(&stats.spin_ns),
+        (unsigned long long)get(&stats.writev_calls),
+        (unsigned long long)get(&stats.writev_bytes),
+        (unsigned long long)get(&stats.writev_ns),
+        (unsigned long long)get(&stats.splice_calls),
+        (unsigned long long)get(&stats.splice_bytes),
+        (unsigned long long)get(&stats.filtered_chunks),
+        (unsigned long long)get(&stats.filtered_bytes),
+        (unsigned long long)get(&stats.repeated_chunks),
+        (unsigned long long)get(&stats.repeated_bytes),
+        (unsigned long long)get(&stats.sync_commits),
+        (unsigned long long)get(&stats.sync_batches),
+        (unsigned long long)get(&stats.sync_ns),
+        (unsigned long long)get(&stats.sync_max_ns),
+        (unsigned long long)get(&stats.sync_lag_max_ns)
+    );
+    for (i = 0; i < STATS_SIZE_BUCKETS; ++i) {
+        uint64_t n = get(&stats.sizes[i]);
+        if (n) {
+            fprintf(
+                f, "size_lt_%llu %llu\n",
+                1ULL << i, (unsigned long long)n
+            );
+        }
+    }
+    pthread_mutex_lock(&helpers_lock);
+    for (i = 0; i < (int)helpers_count; ++i) {
+        const struct helper_stats *h = &helpers[i];
+        fprintf(
+            f,
+            "helper_%u_writes %llu\n"
+            "helper_%u_split_writes %llu\n"
+            "helper_%u_split_pieces %llu\n"
+            "helper_%u_split_pieces_max %llu\n"
+            "helper_%u_blocked %llu\n"
+            "helper_%u_blocked_ns %llu\n"
+            "helper_%u_text_pages %llu\n"
+            "helper_%u_got_pages %llu\n",
+            h->pid, (unsigned long long)h->writes,
+            h->pid, (unsigned long long)h->split_writes,
+            h->pid, (unsigned long long)h->split_pieces,
+            h->pid, (unsigned long long)h->split_pieces_max,
+            h->pid, (unsigned long long)h->blocked,
+            h->pid, (unsigned long long)h->blocked_ns,
+            h->pid, (unsigned long long)h->text_pages,
+            h->pid, (unsigned long long)h->got_pages
+        );
+    }
+    pthread_mutex_unlock(&helpers_lock);
+    if (fclose(f) != 0) goto fail;
+    if (rename(tmp_path, path) != 0) goto fail;
+    return;
+fail:
+    fprintf(
+        stderr, "%s: %s: %s\n",
+        program_invocation_name, path, strerror(errno)
+    );
+}
+
+static void *stats_main(void *arg) {
+    struct pollfd pfd = { event_fd, POLLIN };
+    uint64_t events;
+    while (1) {
+        // Signals are blocked, SIGUSR1 and stop come as events.
+        if (poll(&pfd, 1, interval ? (int)(interval * 1000) : -1) > 0) {
+            while (read(event_fd, &events, sizeof events) < 0 &&
+                errno == EINTR);
+        }
+        write_stats();
+        if (atomic_load(&stop)) return NULL;
+    }
+}
+
+int stats_start(const char *p, unsigned i, int out_sock, int err_sock) {
+    path = p;
+    interval = i;
+    socks[0] = out_sock;
+    socks[1] = err_sock;
+    started = stats_now();
+    if (asprintf(&tmp_path, "%s.tmp", path) < 0) return -1;
+    if ((event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1) return -1;
+    return thread_start(&thread, stats_main);
+}
+
+void stats_sample(void) {
+    int i, v;
+    if (event_fd == -1 || sample_count++ % STATS_SAMPLE_EVERY) return;
+    for (i = 0; i < 2; ++i) {
+        if (
+            ioctl(socks[i], SIOCOUTQ, &v) == 0 ||
+            ioctl(socks[i], FIONREAD, &v) == 0
+        ) {
+            stats_max(&stats.queue_max[i], v);
+        }
+    }
+}
+
+void stats_control(const void *buf, size_t len) {
+    struct helper_stats msg;
+    size_t i;
+    if (event_fd == -1 || len != sizeof msg) return;
+    memcpy(&msg, buf, sizeof msg);
+    if (msg.magic != HELPER_STATS_MAGIC) return;
+    pthread_mutex_lock(&helpers_lock);
+    for (i = 0; i < helpers_count && helpers[i].pid != msg.pid; ++i);
+    if (i == helpers_count) {
+        if (helpers_count == helpers_size) {
+            size_t size = helpers_size ? 2 * helpers_size : 16;
+            struct helper_stats *p = realloc(helpers, size * sizeof *p);
+            if (!p) goto out;
+            helpers = p;
+            helpers_size = size;
+        }
+        ++helpers_count;
+    }
+    helpers[i] = msg;
+out:
+    pthread_mutex_unlock(&helpers_lock);
+}
+
+void stats_request(void) {
+    const int errno_old = errno;
+    uint64_t one = 1;
+    if (event_fd != -1) {
+        while (write(event_fd, &one, sizeof one) < 0 && errno == EINTR);
+    }
+    errno = errno_old;
+}
+
+void stats_finish(void) {
+    if (event_fd == -1) return;
+    atomic_store(&stop, 1);
+    stats_request();
+    pthread_join(thread, NULL);
+}
@@ -0,0 +1,75 @@
+// Master statistics: counters kept on the hot path, written out to a
+// stats file at exit, on SIGUSR1 and periodically.
+#pragma once
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Datagram sizes, bucket N counts sizes in [2^(N-1), 2^N).
+#define STATS_SIZE_BUCKETS 32
+
+// Every counter has a single writer thread, so that updates are plain
+// loads and stores.  The stats thread reads them concurrently.
+struct stats {
+    // Receiving thread.
+    _Atomic uint64_t chunks[2], bytes[2]; // per stream
+    _Atomic uint64_t sizes[STATS_SIZE_BUCKETS];
+    _Atomic uint64_t recv_calls, recv_eintr, recv_eagain;
+    _Atomic uint64_t spin_hits, spin_misses, spin_ns; // --spin
+    _Atomic uint64_t queue_max[2];        // bytes queued, per stream
+    // Writing thread.
+    _Atomic uint64_t writev_calls, writev_bytes, writev_ns;
+    _Atomic uint64_t splice_calls, splice_bytes;
+    _Atomic uint64_t filtered_chunks, filtered_bytes; // filters
+    _Atomic uint64_t repeated_chunks, repeated_bytes; // --dedup
+    // Sync thread (--sync).
+    _Atomic uint64_t sync_commits, sync_batches;
+    _Atomic uint64_t sync_ns, sync_max_ns, sync_lag_max_ns;
+};
+
+extern struct stats stats;
+
+static inline void stats_add(_Atomic uint64_t *counter, uint64_t v) {
+    atomic_store_explicit(
+        counter,
+        atomic_load_explicit(counter, memory_order_relaxed) + v,
+        memory_order_relaxed
+    );
+}
+
+static inline void stats_max(_Atomic uint64_t *counter, uint64_t v) {
+    if (v > atomic_load_explicit(counter, memory_order_relaxed)) {
+        atomic_store_explicit(counter, v, memory_order_relaxed);
+    }
+}
+
+static inline void stats_chunk(int stream, size_t len) {
+    stats_add(&stats.chunks[stream], 1);
+    stats_add(&stats.bytes[stream], len);
+    stats_add(&stats.sizes[len ? 64 - __builtin_clzll(len) : 0], 1);
+}
+
+// Nanoseconds since an arbitrary point, for timing.
+uint64_t stats_now(void);
+
+// Start writing stats to @path every @interval seconds (0 - never),
+// and sampling socket queues of @out_sock and @err_sock, the sending
+// ends of the child's stdout and stderr (or the reading ends of pipes).
+// Returns 0 or -1 (errno set).
+int stats_start(
+    const char *path, unsigned interval, int out_sock, int err_sock
+);
+
+// Sample socket queues, every so many calls.  Receiving thread only.
+void stats_sample(void);
+
+// Handle a datagram from neither stream, e.g. a helper report.
+// Receiving thread only.
+void stats_control(const void *buf, size_t len);
+
+// Write stats soon.  Async-signal-safe.
+void stats_request(void);
+
+// Write final stats and stop.
+void stats_finish(void);
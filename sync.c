@@ -0,0 +1,205 @@
+// Group commit: the writer merely counts the batches written and asks
+// for a commit as the policy says (every batch, every so many bytes,
+// or, for the interval, the first batch since the last commit starts a
+// timer).  The thread then takes every batch written so far, starts
+// writeback of all the files with sync_file_range() and waits for them
+// with fdatasync(), in order, so that a split index is durable after
+// the data it refers to.  Batches written meanwhile are all taken by
+// the next commit.  The writer holds the lock only to update a few
+// counters, never while the disk is busy.
+//
+// Files are synced through duplicates of their descriptors, owned by
+// the thread: a segment closed once rotated stays open until its last
+// commit.
+#define _GNU_SOURCE 1
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "stats.h"
+#include "sync.h"
+#include "thread.h"
+
+int sync_enabled;
+uint64_t sync_unbatched;
+
+static struct sync_opts opts;
+static pthread_t thread;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond;
+
+// Writer side: bytes batched since the last commit request.
+static uint64_t requested_bytes;
+
+// Under the lock: the files, the ones let go, to be synced once more
+// and closed, the batches not committed yet and when the first of them
+// was written.
+static int files[SYNC_FILES] = { -1, -1, -1 };
+static int *retired;
+static size_t retired_count, retired_size;
+static uint64_t batches, first_batch;
+static int requested, stop;
+
+static void fail(const char *msg) __attribute__((noreturn));
+static void fail(const char *msg) {
+    fprintf(
+        stderr, "%s: %s: %s\n",
+        program_invocation_name, msg, strerror(errno)
+    );
+    exit(EXIT_FAILURE);
+}
+
+static void sync_fds(const int *fds, size_t count) {
+    size_t i;
+    // Writeback of all of them at once first.
+    for (i = 0; i < count; ++i) {
+        if (fds[i] != -1) sync_file_range(fds[i], 0, 0, SYNC_FILE_RANGE_WRITE);
+    }
+    for (i = 0; i < count; ++i) {
+        if (fds[i] != -1 && fdatasync(fds[i]) != 0 && errno != EINVAL) {
+            fprintf(
+                stderr, "%s: fdatasync: %s\n",
+                program_invocation_name, strerror(errno)
+            );
+        }
+    }
+}
+
+// Commit @n batches, the first written at @since, with the lock held.
+static void commit(uint64_t n, uint64_t since) {
+    int fds[SYNC_FILES], *old = retired;
+    size_t old_count = retired_count, i;
+    uint64_t start, end;
+    memcpy(fds, files, sizeof fds);
+    retired = NULL;
+    retired_count = retired_size = 0;
+    pthread_mutex_unlock(&lock);
+
+    start = stats_now();
+    sync_fds(old, old_count);
+    sync_fds(fds, SYNC_FILES);
+    end = stats_now();
+    for (i = 0; i < old_count; ++i) close(old[i]);
+    free(old);
+    if (n) {
+        stats_add(&stats.sync_commits, 1);
+        stats_add(&stats.sync_batches, n);
+        stats_add(&stats.sync_ns, end - start);
+        stats_max(&stats.sync_max_ns, end - start);
+        stats_max(&stats.sync_lag_max_ns, end - since);
+    }
+
+    pthread_mutex_lock(&lock);
+}
+
+static void *sync_main(void *arg) {
+    struct timespec ts;
+    uint64_t deadline, n, since;
+    pthread_mutex_lock(&lock);
+    while (1) {
+        if (!requested && !stop) {
+            if (opts.policy != SYNC_INTERVAL || !batches) {
+                pthread_cond_wait(&cond, &lock);
+                continue;
+            }
+            deadline = first_batch + opts.arg * 1000000;
+            if (stats_now() < deadline) {
+                ts.tv_sec = deadline / 1000000000;
+                ts.tv_nsec = deadline % 1000000000;
+                pthread_cond_timedwait(&cond, &lock, &ts);
+                continue;
+            }
+        }
+        if (batches || retired_count) {
+            n = batches;
+            since = first_batch;
+            batches = 0;
+            requested = 0;
+            commit(n, since);
+            continue;
+        }
+        requested = 0;
+        if (stop) break;
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+int sync_start(const struct sync_opts *o) {
+    pthread_condattr_t attr;
+    opts = *o;
+    // Deadlines are stats_now() times.
+    if (
+        pthread_condattr_init(&attr) != 0 ||
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC) != 0 ||
+        pthread_cond_init(&cond, &attr) != 0
+    ) {
+        return -1;
+    }
+    pthread_condattr_destroy(&attr);
+    if (thread_start(&thread, sync_main) != 0) return -1;
+    sync_enabled = 1;
+    return 0;
+}
+
+void sync_track(int slot, int fd) {
+    int *p, dup_fd = -1;
+    if (!sync_enabled) return;
+    if (fd != -1 && (dup_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0)) == -1) {
+        fail("dup");
+    }
+    pthread_mutex_lock(&lock);
+    if (files[slot] != -1) {
+        if (retired_count == retired_size) {
+            retired_size = retired_size ? 2 * retired_size : 4;
+            if (!(p = realloc(retired, retired_size * sizeof *p))) {
+                fail("malloc");
+            }
+            retired = p;
+        }
+        retired[retired_count++] = files[slot];
+    }
+    files[slot] = dup_fd;
+    pthread_mutex_unlock(&lock);
+}
+
+void sync_batch(void) {
+    int wake = 0;
+    if (!sync_enabled || !sync_unbatched) return;
+    requested_bytes += sync_unbatched;
+    sync_unbatched = 0;
+    pthread_mutex_lock(&lock);
+    if (!batches++) {
+        first_batch = stats_now();
+        // Starts the timer.
+        wake = opts.policy == SYNC_INTERVAL;
+    }
+    if (
+        opts.policy == SYNC_CHUNK ||
+        (opts.policy == SYNC_BYTES && requested_bytes >= opts.arg)
+    ) {
+        requested = wake = 1;
+        requested_bytes = 0;
+    }
+    pthread_mutex_unlock(&lock);
+    if (wake) pthread_cond_signal(&cond);
+}
+
+void sync_finish(void) {
+    int i;
+    if (!sync_enabled) return;
+    sync_batch();
+    pthread_mutex_lock(&lock);
+    stop = 1;
+    pthread_mutex_unlock(&lock);
+    pthread_cond_signal(&cond);
+    pthread_join(thread, NULL);
+    for (i = 0; i < SYNC_FILES; ++i) {
+        if (files[i] != -1) close(files[i]);
+    }
+}
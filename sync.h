@@ -0,0 +1,42 @@
+// Durability of the capture files: fdatasync() with group commit on a
+// separate thread, so that writing never waits for the disk.
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum { SYNC_NONE, SYNC_INTERVAL, SYNC_BYTES, SYNC_CHUNK };
+
+// Files synced at once: the capture, or the split files.
+#define SYNC_FILES 3
+
+struct sync_opts {
+    int policy;   // SYNC_*
+    uint64_t arg; // ms for SYNC_INTERVAL, bytes for SYNC_BYTES
+};
+
+// Nonzero once sync_start() was called.
+extern int sync_enabled;
+
+// Bytes written since the last sync_batch().
+extern uint64_t sync_unbatched;
+
+// Start the sync thread.  Returns 0 or -1 (errno set).
+int sync_start(const struct sync_opts *opts);
+
+// Sync @fd as file @slot from now on; the file previously in @slot is
+// synced once more and let go.  @fd may be closed by the caller.
+// Writing thread only, as the rest.
+void sync_track(int slot, int fd);
+
+// Account for @len bytes written to the files.
+static inline void sync_written(size_t len) {
+    sync_unbatched += len;
+}
+
+// A batch was written: commit it, as the policy says.  Never blocks on
+// the disk.
+void sync_batch(void);
+
+// Commit whatever was written, and stop the thread.
+void sync_finish(void);
@@ -0,0 +1,205 @@
+// Chunks are copied into a ring buffer and written by a separate
+// thread, so a slow terminal or CI log never stalls the capture.  The
+// thread joins adjacent chunks of a stream into a single write.  Pipes
+// are fed with vmsplice(): the pipe references the buffer pages rather
+// than copying them, hence the buffer space is only reused after
+// FIONREAD shows the reader has consumed the data.
+#define _GNU_SOURCE 1
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "ring.h"
+#include "tee.h"
+#include "thread.h"
+
+// How often to check if a pipe reader has caught up.
+#define TEE_PIPE_POLL_MS 10
+
+struct tee_dest {
+    int fd;
+    int is_pipe;
+    uint64_t spliced; // total bytes vmsplice()-d
+};
+
+// Records before 'tail' can be released once 'spliced' bytes written to
+// 'dest' were consumed.
+struct tee_pending {
+    uint32_t tail;
+    struct tee_dest *dest;
+    uint64_t spliced;
+};
+
+static struct ring tee_ring;
+static struct tee_dest tee_dest[2];
+static struct tee_pending tee_pending[RING_SLOTS];
+static unsigned tee_pending_head, tee_pending_tail;
+// Bytes dropped since the last note, producer only.  The note itself
+// goes into the ring, to show up where output is missing.
+static uint64_t tee_dropped;
+#define TEE_NOTE 2
+static pthread_t tee_thread;
+
+static void *tee_main(void *arg);
+
+int tee_start(int out_fd, int err_fd, size_t size, size_t chunk_max) {
+    struct stat st;
+    int i;
+    tee_dest[0].fd = out_fd;
+    tee_dest[1].fd = err_fd;
+    for (i = 0; i != 2; ++i) {
+        if (fstat(tee_dest[i].fd, &st) != 0) return -1;
+        tee_dest[i].is_pipe = S_ISFIFO(st.st_mode);
+    }
+    if (ring_init(&tee_ring, size, chunk_max) != 0) return -1;
+    // A closed terminal yields EPIPE instead of killing the capture.
+    return thread_start(&tee_thread, tee_main);
+}
+
+void tee_chunk(int stream, const void *buf, size_t len) {
+    void *p;
+    if (!len) return;
+    if (tee_dropped) {
+        if (!(p = ring_reserve(&tee_ring, sizeof tee_dropped, 0))) {
+            tee_dropped += len;
+            return;
+        }
+        memcpy(p, &tee_dropped, sizeof tee_dropped);
+        ring_commit(&tee_ring, sizeof tee_dropped, TEE_NOTE);
+        tee_dropped = 0;
+    }
+    if (!(p = ring_reserve(&tee_ring, len, 0))) {
+        tee_dropped += len;
+        return;
+    }
+    memcpy(p, buf, len);
+    ring_commit(&tee_ring, len, stream);
+}
+
+void tee_finish(void) {
+    ring_close(&tee_ring);
+    pthread_join(tee_thread, NULL);
+}
+
+static void tee_write(struct tee_dest *dest, struct iovec *iov, int iovcnt) {
+    ssize_t rc;
+    while (iovcnt && dest->fd != -1) {
+        rc = dest->is_pipe ?
+            vmsplice(dest->fd, iov, iovcnt, 0) :
+            writev(dest->fd, iov, iovcnt);
+        if (rc < 0) {
+            if (errno == EINTR) continue;
+            // Keep capturing if the terminal is gone.
+            dest->fd = -1;
+            return;
+        }
+        if (dest->is_pipe) dest->spliced += rc;
+        while (iovcnt && (size_t)rc >= iov->iov_len) {
+            rc -= iov->iov_len;
+            ++iov;
+            --iovcnt;
+        }
+        if (iovcnt) {
+            iov->iov_base += rc;
+            iov->iov_len -= rc;
+        }
+    }
+}
+
+static int tee_consumed(const struct tee_pending *p) {
+    int unread;
+    if (!p->dest || p->dest->fd == -1) return 1;
+    return ioctl(p->dest->fd, FIONREAD, &unread) != 0 ||
+        p->dest->spliced - unread >= p->spliced;
+}
+
+static void tee_release(void) {
+    const unsigned pending_tail = tee_pending_tail;
+    while (
+        tee_pending_tail != tee_pending_head &&
+        tee_consumed(&tee_pending[tee_pending_tail % RING_SLOTS])
+    ) {
+        ++tee_pending_tail;
+    }
+    if (tee_pending_tail != pending_tail) {
+        ring_release(
+            &tee_ring, tee_pending[(tee_pending_tail - 1) % RING_SLOTS].tail
+        );
+    }
+}
+
+static void tee_note_dropped(uint64_t dropped) {
+    char note[64];
+    struct iovec iov = { note, 0 };
+    if (!dropped) return;
+    iov.iov_len = snprintf(
+        note, sizeof note, "\n[out+err: %llu bytes not shown]\n",
+        (unsigned long long)dropped
+    );
+    // Not from the ring, don't vmsplice.
+    if (tee_dest[1].fd != -1) {
+        struct tee_dest dest = { tee_dest[1].fd };
+        tee_write(&dest, &iov, 1);
+    }
+}
+
+static void *tee_main(void *arg) {
+    struct iovec iov[UIO_MAXIOV];
+    uint32_t tail = 0, n, i;
+    int iovcnt;
+
+    while (1) {
+        int busy = tee_pending_tail != tee_pending_head;
+        if (!(n = ring_peek(&tee_ring, tail, busy ? TEE_PIPE_POLL_MS : -1))) {
+            // Pipe readers may lag behind, don't wait for them on exit.
+            if (atomic_load(&tee_ring.closed)) {
+                tee_note_dropped(tee_dropped);
+                return NULL;
+            }
+            tee_release();
+            continue;
+        }
+        // A run of chunks of the same stream.
+        const uint32_t stream = ring_slot(&tee_ring, tail)->tag;
+        iovcnt = 0;
+        if (stream == TEE_NOTE) {
+            uint64_t dropped;
+            memcpy(
+                &dropped, ring_data(&tee_ring, ring_slot(&tee_ring, tail)),
+                sizeof dropped
+            );
+            tee_note_dropped(dropped);
+            i = 1;
+        } else for (i = 0; i < n; ++i) {
+            const struct ring_slot *s = ring_slot(&tee_ring, tail + i);
+            char *p = ring_data(&tee_ring, s);
+            if (s->tag != stream) break;
+            if (
+                iovcnt &&
+                iov[iovcnt - 1].iov_base + iov[iovcnt - 1].iov_len == p
+            ) {
+                iov[iovcnt - 1].iov_len += s->len;
+                continue;
+            }
+            if (iovcnt == UIO_MAXIOV) break;
+            iov[iovcnt].iov_base = p;
+            iov[iovcnt++].iov_len = s->len;
+        }
+        if (iovcnt) tee_write(&tee_dest[stream], iov, iovcnt);
+        tail += i;
+        tee_pending[tee_pending_head++ % RING_SLOTS] = (struct tee_pending){
+            .tail = tail,
+            .dest = iovcnt && tee_dest[stream].is_pipe ?
+                &tee_dest[stream] : NULL,
+            .spliced = iovcnt ? tee_dest[stream].spliced : 0
+        };
+        tee_release();
+    }
+}
@@ -0,0 +1,17 @@
+// Tee mode: pass chunks through to the original stdout and stderr
+// while capturing.
+#pragma once
+
+#include <stddef.h>
+
+// Start passing chunks through to @out_fd and @err_fd, buffering up to
+// @size bytes (at least twice @chunk_max).  Returns 0 or -1 (errno set).
+int tee_start(int out_fd, int err_fd, size_t size, size_t chunk_max);
+
+// Queue a chunk for @stream (0 - stdout, 1 - stderr).  Never blocks:
+// chunks that don't fit in the buffer are dropped, and a note saying
+// how many bytes were lost is shown later.
+void tee_chunk(int stream, const void *buf, size_t len);
+
+// Flush queued chunks and stop.
+void tee_finish(void);
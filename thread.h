@@ -0,0 +1,23 @@
+// Helper threads of the master.
+#pragma once
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+
+// Start a thread with all signals blocked: they are for the main
+// thread, e.g. SIGCHLD must unblock its recvfrom().  Notably, SIGPIPE
+// becomes EPIPE.  Returns 0 or -1 (errno set).
+static inline int thread_start(pthread_t *thread, void *(*fn)(void *)) {
+    sigset_t sigall, sigold;
+    int err;
+    sigfillset(&sigall);
+    pthread_sigmask(SIG_SETMASK, &sigall, &sigold);
+    err = pthread_create(thread, NULL, fn, NULL);
+    pthread_sigmask(SIG_SETMASK, &sigold, NULL);
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}